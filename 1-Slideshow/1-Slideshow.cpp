@@ -15,7 +15,7 @@
   - XPT2046_Bitbang by nitek: For interfacing with the touchscreen.
   - SdFat by Greiman (greiman/SdFat): Advanced SD card handling.
   - JPEGDEC by BitBank (bitbank2/JPEGDEC): JPG decoding for image display.
-  - QRCode by ricmoo: To display QR codes on the TFT screen.
+  - QR Code generator by Project Nayuki (lib/QRCodeGen): To display QR codes on the TFT screen.
   - ESP32-audioI2S by schreibfaul1: For WAV and MP3 audio playback via I2S.
   - AudioFileSourceSD by Phil Schatzmann: Provides audio file reading from SD.
   - mDNS (ESP32 Core): Enables access to the device using photoframe.local.
@@ -44,21 +44,28 @@
 #include <WiFiManager.h>          // WiFiManager to manage Wi-Fi connections
 #include <AsyncTCP.h>             // Async TCP library for WebSocket
 #include <ESPAsyncWebServer.h>    // Async Web Server
+#include <StreamString.h>         // String-backed Print for JSON fragments
 #include <TFT_eSPI.h>             // TFT display library
 #include <XPT2046_Bitbang.h>      // Touch screen library
 #include <SPI.h>
 #include <SdFat.h>                // SD card library (SdFat)
-#include <SD.h>                   // Standard SD library
 #include <JPEGDEC.h>              // JPG decoder library
 #include "SPIFFS.h"               // Include SPIFFS to satisfy TFT_eSPI dependency
-#include "qrcode.h"               // QR code library
-#include "AudioFileSourceSD.h"    // Audio file source from SD card
+#include "qrcodegen.hpp"          // QR code library (lib/QRCodeGen)
+#include "AudioFileSource.h"      // Base class for the SdFat audio source
+#include "AudioFileSourceBuffer.h"  // Read-ahead buffer for audio playback
 #include "AudioGeneratorWAV.h"    // WAV audio generator
 #include "AudioOutputI2S.h"       // I2S audio output
 #include <FS.h>                   // Include FS.h
 #include "esp_task_wdt.h"         // ESP32 Task Watchdog Timer
 #include "esp_heap_caps.h"        // Heap memory debugging
+#include "web_assets.h"           // Gzipped web UI, generated by script/gzip_web.py
 #include <ESPmDNS.h>
+#include <Preferences.h>            // NVS storage for the last slide
+#include "esp_pm.h"               // Clock scaling and light sleep, see Power management
+#include <Update.h>               // Firmware updates over the web server
+#include "esp_ota_ops.h"
+#include <AsyncUDP.h>             // Multicast for synced frames
 
 // Touch Screen pins
 #define XPT2046_IRQ 36
@@ -72,1080 +79,4333 @@
 
 TFT_eSPI tft = TFT_eSPI();
 JPEGDEC jpeg;
+JPEGDEC *jpegAhead = nullptr;  // Second decoder, owned by the prefetch task
+int16_t frameWidth = 0;        // Panel size after rotation, for the background tasks
+int16_t frameHeight = 0;
 XPT2046_Bitbang ts(XPT2046_MOSI, XPT2046_MISO, XPT2046_CLK, XPT2046_CS);
 
+// QR codes for the web address, encoded into fixed buffers on the stack. An
+// address with port fits version 3, 4 leaves room for a longer hostname.
+#define QR_MAX_VERSION 4
+typedef qrcodegen::FixedQrCode<QR_MAX_VERSION> FrameQRCode;
+
 // Audio objects
+class AudioFileSourceSdFat;
 AudioGeneratorWAV *wav;
-AudioFileSourceSD *file;
+AudioFileSourceSdFat *file;
 AudioOutputI2S *out = nullptr;  // Initialize to nullptr
 
 SPIClass sdSpi(VSPI);
-SdSpiConfig sdSpiConfig(SD_CS, SHARED_SPI, SD_SCK_MHZ(10), &sdSpi);  // Use SHARED_SPI mode
+// The card has VSPI to itself, so it runs in DEDICATED_SPI mode at the fastest
+// clock that passes the mount probe (see mountSdCard)
+const uint8_t sdSpeedsMHz[] = {40, 25, 20, 10};
+uint8_t sdSpeedStep = 0;       // Index of the current clock in sdSpeedsMHz
+uint8_t sdSpiMHz = 0;          // Clock the card is mounted at, 0 if not mounted
+uint32_t sdReadKBps = 0;       // Raw sector read speed measured at mount
 SdFat sd;
-SdBaseFile root;
+SdBaseFile albumDir;           // Folder of the album on show, see openAlbum
+SdBaseFile cacheDir;
+SdBaseFile thumbDir;
 SdBaseFile jpgFile;
 int16_t currentIndex = 0;
 uint16_t fileCount = 0;
 
+// Albums are the card's root folder and the folders directly inside it. Only
+// the album on show is indexed, and it has its own cache folders and saved
+// index, so switching costs a scan of that album alone (or none when its saved
+// index still matches). albumPath and the index change together under xSpiMutex.
+#define ALBUM_NAME_MAX 64
+char albumPath[ALBUM_NAME_MAX + 1] = "/";
+uint32_t albumGeneration = 0;  // Bumped on every switch, so late results for the old album are dropped
+
+// Path of a file in the album on show, called with xSpiMutex held
+String albumFilePath(const char *name) {
+  String path = albumPath;
+  if (path.length() > 1) path += '/';
+  return path + name;
+}
+
 uint32_t timer;
 SemaphoreHandle_t xSpiMutex;
 
 AsyncWebServer server(80);
 AsyncWebSocket ws("/ws");  // Create a WebSocket object
 WiFiManager wm;
-volatile bool buttonPressed = false;
-
-bool sdMounted = false;
+Preferences prefs;  // NVS: the last slide and the speed, see saveLastSlide and setSlideSpeed
+bool buttonPressed = false;  // Set by loop() from CMD_BUTTON, see readButton
+
+volatile bool sdMounted = false;  // Read by the web server, see trySpiMutex
+volatile uint16_t sdReadErrors = 0;  // Card errors since the last mount, see countSdError
+#define SD_ERROR_LIMIT 3             // Card errors before remounting at a slower clock
+#define SD_READ_TIMEOUT_MS 250       // Slower reads count as errors, see sdRead
+#define SD_RETRY_MIN_MS 2000         // First wait before mounting a lost card again
+#define SD_RETRY_MAX_MS 60000        // The wait doubles up to this
+#define SD_PROBE_SECTORS 4           // Sectors per probe read
 bool slideshowActive = true;
+volatile bool benchRunning = false;  // The benchmark has the panel and card, see runBenchmark
+volatile bool benchSweeping = false; // The card is remounted at bench clocks, see benchSdReads
+volatile bool otaRunning = false;    // A firmware update is being written, see handleUpdateData
+
+// Metrics
+// Timings are kept as Prometheus-style histograms and served on /metrics. Each
+// one has a single writer at a time: slide timings are only recorded by loop(),
+// SD wait times and byte counts only while holding xSpiMutex. So recording
+// needs no extra lock, and a scrape at worst sees one sample half-recorded.
+#define HISTOGRAM_BUCKETS 12
+const uint32_t histogramBoundsMicros[HISTOGRAM_BUCKETS] = {
+  100, 500, 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
+
+struct Histogram {
+  uint32_t buckets[HISTOGRAM_BUCKETS + 1] = {};  // The last one is +Inf
+  uint32_t count = 0;
+  uint64_t sumMicros = 0;
+
+  void record(uint32_t micros) {
+    uint8_t i = 0;
+    while (i < HISTOGRAM_BUCKETS && micros > histogramBoundsMicros[i]) i++;
+    buckets[i]++;
+    count++;
+    sumMicros += micros;
+  }
+};
+
+struct Metrics {
+  Histogram slideLookup;    // Finding the slide in the index
+  Histogram slideOpen;      // Opening its file on the card
+  Histogram slideDecode;    // JPEG decoding, less the time spent pushing
+  Histogram slidePush;      // Pushing pixels to the panel
+  Histogram spiWait;        // Waiting for xSpiMutex
+  uint64_t sdBytesRead = 0;
+  uint32_t sdReadErrorsTotal = 0;  // Unlike sdReadErrors, never reset
+  uint32_t sdSeekErrorsTotal = 0;
+  uint32_t sdOpenErrorsTotal = 0;
+  uint32_t sdTimeoutsTotal = 0;    // Reads slower than SD_READ_TIMEOUT_MS
+  uint32_t sdRemountsTotal = 0;    // Remounts after SD_ERROR_LIMIT errors
+  uint32_t sdMountFailuresTotal = 0;  // Failed attempts at mounting a lost card
+} metrics;
+
+// Per-slide totals, added to while loop() draws a slide
+uint32_t slideOpenMicros = 0;
+uint32_t slideDecodeMicros = 0;  // Includes the pushes made from JPEGDraw
+uint32_t slidePushMicros = 0;
+
+// Take the SD lock, recording how long it took to get it
+void takeSpiMutex() {
+  uint32_t start = micros();
+  xSemaphoreTake(xSpiMutex, portMAX_DELAY);
+  metrics.spiWait.record(micros() - start);
+}
+
+void giveSpiMutex() {
+  xSemaphoreGive(xSpiMutex);
+}
+
+// Take the SD lock only if it comes free within waitMs. The web server's
+// handlers answer busy rather than stall the network task, and every client
+// on it, behind a long hold. Chunk fillers pass 0 and try the chunk again on
+// the next poll. They all get the same answer while the card is lost and
+// waiting to be mounted again; a streamed response checks sdMounted to end.
+#define WEB_SPI_WAIT_MS 50
+volatile uint32_t webSpiBusy = 0;  // Requests and chunks turned away
+
+bool trySpiMutex(uint32_t waitMs = WEB_SPI_WAIT_MS) {
+  uint32_t start = micros();
+  if (!sdMounted || benchSweeping || xSemaphoreTake(xSpiMutex, pdMS_TO_TICKS(waitMs)) != pdTRUE) {
+    webSpiBusy++;
+    return false;
+  }
+  metrics.spiWait.record(micros() - start);
+  return true;
+}
+
+void sendBusy(AsyncWebServerRequest *request) {
+  AsyncWebServerResponse *response = request->beginResponse(503, "text/plain", "SD card busy");
+  response->addHeader("Retry-After", "1");
+  request->send(response);
+}
+
+// Count a failed card access towards the next remount, called with xSpiMutex held
+void countSdError(uint32_t &total) {
+  sdReadErrors++;
+  total++;
+}
+
+// Read from a file with the SD lock held, counting bytes and errors. SdFat
+// waits up to 300 ms per sector on a card that stopped answering, so a read
+// that takes longer than SD_READ_TIMEOUT_MS counts as an error too.
+int32_t sdRead(SdBaseFile &file, void *buffer, size_t length) {
+  uint32_t start = millis();
+  int32_t n = file.read(buffer, length);
+  if (n > 0) metrics.sdBytesRead += n;
+  if (n < 0) countSdError(metrics.sdReadErrorsTotal);
+  else if (millis() - start > SD_READ_TIMEOUT_MS) countSdError(metrics.sdTimeoutsTotal);
+  return n;
+}
+
+// Seek with the SD lock held, counting failures
+bool sdSeek(SdBaseFile &file, uint32_t position) {
+  bool ok = file.seekSet(position);
+  if (!ok) countSdError(metrics.sdSeekErrorsTotal);
+  return ok;
+}
 
 // Function declarations
 void setupWebServer();
 void loadImage(uint16_t targetIndex);
-void decodeJpeg(const char *name);
-void displayMessageAndQRCode(String ip);
+void decodeJpeg(uint16_t index);
+void displayConnectInfo(String ip);
 void displayQRCode(String ip);
 void playWAV();
-void stopSlideshow();
-void restartSlideshow();
 void error(const char* msg);
 bool checkAndMountSDCard();
+bool checkMusicFile();
 void playWAVTask(void * parameter);
+void setCpuBusy(bool busy);
+void playOrderReset();
+void playOrderAdded(uint16_t index);
+void playOrderRemoved(uint16_t index);
 int X = 10;  // Default time in seconds (X * 1000 milliseconds)
 void onWebSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
                       void *arg, uint8_t *data, size_t len);
+void updateSlideInfo(uint16_t index);
+void sendSlideState(AsyncWebSocketClient *only);
 
-// Global variable to store the current image name
+// The slide on screen, guarded by xSpiMutex. Size and ETag describe the copy
+// /current_image sends, so WebSocket clients can tell whether to fetch it.
 String currentImageName = "";
+String currentImageETag = "";
+uint32_t currentImageSize = 0;
+uint16_t currentImageIndex = 0;
+volatile bool slideshowPaused = false;  // Set by loop() from the WebSocket, the timer stops
+int8_t slideRequest = 0;                // +1 next, -1 previous, from the WebSocket
+bool slideAbortOnInput = false;         // Set by loadImage: a gesture cuts the decode short
+volatile uint32_t touchEventsDropped = 0;
+
+// Frame commands
+// loop() is the one task that drives the panel, changes the slideshow and
+// changes what's on the card. The BOOT button interrupt, touchTask, the
+// WebSocket and web handlers and networkTask post a FrameCommand to
+// frameCommands instead and never wait on loop(), which blocks on the queue
+// until a command comes or the next slide is due (see runFrameCommand).
+#define FRAME_QUEUE_LENGTH 16
+
+enum FrameCommandType : uint8_t {
+  CMD_BUTTON,      // BOOT button edge, loop() then follows the pin
+  CMD_TOUCH,       // arg: TouchEvent
+  CMD_STEP,        // arg: +1 next slide, -1 previous
+  CMD_PAUSE,       // arg: 1 pause, 0 resume
+  CMD_SPEED,       // arg: seconds per slide
+  CMD_TRANSITION,  // arg: Transition
+  CMD_ORDER,       // arg: PlayOrder
+  CMD_OVERLAY,     // arg: Overlay, from networkTask
+  CMD_SEND_STATE,  // arg: WebSocket client id
+  CMD_ALBUM,       // text: album folder, "" for the root
+  CMD_DELETE,      // text: images in the album on show, one name per line
+  CMD_PLAY_MUSIC,  // Starts music.wav if it's on the card
+  CMD_BENCH,       // Runs the benchmark queued in benchState
+  CMD_POWER,       // arg: night schedule packed by /set-power, text: time zone or none to keep it
+  CMD_CLOSE_FILE,  // arg: SdBaseFile * a web handler is done with, see releaseWebFile
+  CMD_REMOVE_FILE, // arg: SdBaseFile * of a failed upload
+  CMD_RESTART,     // Into the firmware update just written
+  CMD_COLOR,       // arg: ColorSettings packed by packColorSettings
+  CMD_BRIGHTNESS,  // arg: backlight level, 1-255
+  CMD_SYNC_ROLE,   // arg: SyncRole
+  CMD_SYNC_SLIDE,  // arg: micros() to show it at, text: image the leader announced
+};
+
+struct FrameCommand {
+  FrameCommandType type;
+  int32_t arg;
+  char *text;  // Copied by postFrameCommand, freed by loop()
+};
+
+QueueHandle_t frameCommands = NULL;
+volatile uint32_t frameCommandsDropped = 0;
+
+// Queue a command for loop() without waiting, false if the queue is full
+bool postFrameCommand(FrameCommandType type, int32_t arg = 0, const char *text = nullptr) {
+  FrameCommand command = {type, arg, text ? strdup(text) : nullptr};
+  if ((!text || command.text) && xQueueSend(frameCommands, &command, 0) == pdTRUE) return true;
+  free(command.text);
+  frameCommandsDropped++;
+  return false;
+}
 
-// Button interrupt for slideshow control
-void IRAM_ATTR buttonInt() {
-  buttonPressed = true;
+// Failed uploads handed to loop() and not yet removed. Until then a new
+// upload is refused, since opening the same path again would give the card
+// two handles on one file and the late remove would unlink the new one.
+portMUX_TYPE webFileMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t webRemovesPending = 0;
+
+bool webRemovePending() {
+  portENTER_CRITICAL(&webFileMux);
+  bool pending = webRemovesPending > 0;
+  portEXIT_CRITICAL(&webFileMux);
+  return pending;
 }
 
-// JPG decoding functions
-int JPEGDraw(JPEGDRAW *pDraw) {
-  tft.pushImage(pDraw->x, pDraw->y, pDraw->iWidth, pDraw->iHeight, pDraw->pPixels);
-  return 1;
+void countWebRemove(int8_t change) {
+  portENTER_CRITICAL(&webFileMux);
+  webRemovesPending += change;
+  portEXIT_CRITICAL(&webFileMux);
+}
+
+// Close a heap file a web handler is done with (or remove it, for a failed
+// upload) without waiting on the card: on the spot if the lock comes free in
+// time, otherwise loop() does it. Takes the file over.
+void releaseWebFile(SdBaseFile *file, bool remove) {
+  if (!file->isOpen()) {
+    delete file;
+    return;
+  }
+  if (trySpiMutex()) {
+    if (remove) file->remove();
+    else file->close();
+    giveSpiMutex();
+    delete file;
+    return;
+  }
+  if (remove) countWebRemove(1);  // Kept if the post fails: the file stays open, so uploads stay off
+  if (!postFrameCommand(remove ? CMD_REMOVE_FILE : CMD_CLOSE_FILE, (int32_t)(intptr_t)file, nullptr)) {
+    Serial.println("Command queue full, leaving a web file open");  // Freeing it would close it unlocked
+  }
 }
 
-void *myOpen(const char *filename, int32_t *size) {
-  jpgFile = sd.open(filename);
-  *size = jpgFile.fileSize();
-  return &jpgFile;
+// True when the next command changes the slide, so the one drawing can stop
+bool slideInputPending() {
+  FrameCommand next;
+  return xQueuePeek(frameCommands, &next, 0) == pdTRUE && (next.type == CMD_TOUCH || next.type == CMD_STEP);
 }
 
-void myClose(void *handle) {
-  if (jpgFile) jpgFile.close();
+// Change the slide interval, kept in NVS so it survives a restart
+void setSlideSpeed(int seconds) {
+  seconds = max(1, seconds);
+  if (seconds == X) return;
+  X = seconds;
+  prefs.putInt("speed", X);
+  Serial.printf("Slideshow speed updated to: %d seconds\n", X);
+  sendSlideState(nullptr);
 }
 
-int32_t myRead(JPEGFILE *handle, uint8_t *buffer, int32_t length) {
-  return jpgFile.read(buffer, length);
+// Button interrupt for slideshow control
+void IRAM_ATTR buttonInt() {
+  FrameCommand command = {CMD_BUTTON, 0, nullptr};
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR(frameCommands, &command, &woken);
+  if (woken) portYIELD_FROM_ISR();
 }
 
-int32_t mySeek(JPEGFILE *handle, int32_t position) {
-  return jpgFile.seekSet(position);  // Use seekSet instead of seek
+#ifdef USE_TFT_DMA
+// Ping-pong buffers for DMA pushes from JPEGDraw: each block is copied into one
+// of them and sent in the background while JPEGDEC decodes the next block.
+#define DMA_MCU_COUNT 16                                // MCUs per JPEGDraw call
+#define DMA_BUFFER_PIXELS (320 * 16)                    // A panel-wide band of the tallest MCU row,
+                                                        // more than DMA_MCU_COUNT 16x16 MCUs
+uint16_t *dmaBuffer[2] = {nullptr, nullptr};
+uint8_t dmaBufferSel = 0;
+#endif
+
+// Slide transitions
+// Wipe and slide-in go out in line bands through the DMA buffers: from the
+// decoded frame when the slide was prefetched into PSRAM, otherwise a wipe
+// gathers JPEGDEC's blocks into panel-wide bands as they are decoded, so no
+// frame buffer is needed. Slide-in needs the whole frame and wipes without one.
+// Fade dims the backlight (LEDC PWM on TFT_BL) while any path draws the slide.
+enum Transition : uint8_t { TRANSITION_NONE, TRANSITION_WIPE, TRANSITION_SLIDE, TRANSITION_FADE, TRANSITION_COUNT };
+const char *const transitionNames[TRANSITION_COUNT] = {"none", "wipe", "slide", "fade"};
+#define TRANSITION_MS 300           // A wipe or slide-in, or each half of a fade
+#define TRANSITION_STEPS 16         // Bands of a wipe, moves of a slide-in, levels of a fade
+#define BACKLIGHT_LEDC_CHANNEL 7
+#define BACKLIGHT_PWM_HZ 5000
+
+Transition transition = TRANSITION_NONE;        // Chosen on /speed, kept in NVS
+Transition activeTransition = TRANSITION_NONE;  // Set by loadImage while it draws a slide
+uint8_t backlightLevel = 255;                   // Brightness when lit, set on /color and kept in NVS
+uint8_t backlightShown = 0;                     // Brightness now, faded through
+
+// Brightness to PWM duty, squared so a fade looks even to the eye
+void setBacklight(uint8_t level) {
+  backlightShown = level;
+#ifdef TFT_BL
+  ledcWrite(BACKLIGHT_LEDC_CHANNEL, (uint16_t)level * level / 255);
+#endif
 }
 
-// Stop the slideshow by releasing the resources and stopping the decoder
-void stopSlideshow() {
-  slideshowActive = false;
-  xSemaphoreTake(xSpiMutex, portMAX_DELAY);  // Lock SPI access for SD card
-  jpeg.close();  // Ensure that the JPEG decoder is closed
-  xSemaphoreGive(xSpiMutex);  // Unlock SPI access
-  delay(500);  // Add delay to ensure proper transition
-  Serial.println("Slideshow stopped.");
+// Take the backlight pin over from TFT_eSPI, which just drives it high
+void beginBacklight() {
+#ifdef TFT_BL
+  ledcSetup(BACKLIGHT_LEDC_CHANNEL, BACKLIGHT_PWM_HZ, 8);
+  ledcAttachPin(TFT_BL, BACKLIGHT_LEDC_CHANNEL);
+#endif
+  setBacklight(backlightLevel);
 }
 
-// Restart the slideshow after WAV playback
-void restartSlideshow() {
-  slideshowActive = true;
-  loadImage(currentIndex);
-  Serial.println("Slideshow restarted.");
+void setBrightness(uint8_t level) {
+  if (level == 0 || level == backlightLevel) return;
+  backlightLevel = level;
+  prefs.putUChar("brightness", level);
+  if (backlightShown > 0) setBacklight(level);  // Stays off at night
 }
 
-// Function to load and display an image
-void loadImage(uint16_t targetIndex) {
-  if (!slideshowActive) return;
+void fadeBacklight(uint8_t level) {
+  int from = backlightShown;
+  for (int i = 1; i <= TRANSITION_STEPS; i++) {
+    setBacklight(from + (level - from) * i / TRANSITION_STEPS);
+    delay(TRANSITION_MS / TRANSITION_STEPS);
+  }
+}
 
-  if (targetIndex >= fileCount) targetIndex = 0;
-  root.rewind();
-  uint16_t index = 0;
-  SdBaseFile entry;
-  char name[100];
-  while (entry.openNext(&root)) {
-    if (!entry.isDir()) {  // Use isDir instead of isDirectory
-      entry.getName(name, sizeof(name));
-      if (strcasecmp(name + strlen(name) - 3, "JPG") == 0) {
-        if (index == targetIndex) {
-          currentImageName = String(name);  // Set current image name
-          decodeJpeg(name);
-          entry.close();
+void setTransition(Transition style) {
+  if (style >= TRANSITION_COUNT || style == transition) return;
+  transition = style;
+  prefs.putUChar("transition", style);
+  Serial.printf("Slide transition set to %s\n", transitionNames[style]);
+}
 
-          // Send WebSocket message to notify clients
-          ws.textAll("update");
+// Transition by its name on the web page, TRANSITION_COUNT if unknown
+Transition transitionByName(const char *name) {
+  for (int i = 0; i < TRANSITION_COUNT; i++) {
+    if (strcmp(name, transitionNames[i]) == 0) return (Transition)i;
+  }
+  return TRANSITION_COUNT;
+}
 
-          return;
-        }
-        index++;
+// Hold each step of a transition until its share of TRANSITION_MS is up
+void waitTransitionStep(uint32_t start, int step) {
+  int32_t wait = (int32_t)(start + TRANSITION_MS * step / TRANSITION_STEPS - millis());
+  if (wait > 0) delay(wait);
+}
+
+// Push the rectangle of a full frame at (x, y) to the panel at (screenX, y),
+// in bands copied into the DMA buffers, or a row at a time without them.
+// Called between startWrite() and endFrameDraw().
+void pushFrameRect(uint16_t *frame, int x, int y, int width, int height, int screenX) {
+  uint32_t start = micros();
+#ifdef USE_TFT_DMA
+  if (dmaBuffer[1]) {
+    int rows = max(1, DMA_BUFFER_PIXELS / width);
+    for (int top = y; top < y + height; top += rows) {
+      int count = min(rows, y + height - top);
+      uint16_t *band = dmaBuffer[dmaBufferSel];
+      for (int row = 0; row < count; row++) {
+        memcpy(band + row * width, frame + (top + row) * frameWidth + x, width * sizeof(uint16_t));
       }
+      tft.pushImageDMA(screenX, top, width, count, band, band);  // The band it's in goes out as is
+      dmaBufferSel ^= 1;
     }
-    entry.close();
+    slidePushMicros += micros() - start;
+    return;
+  }
+#endif
+  for (int row = y; row < y + height; row++) {
+    tft.pushImage(screenX, row, width, 1, frame + row * frameWidth + x);
   }
+  slidePushMicros += micros() - start;
 }
 
-void decodeJpeg(const char *name) {
-  if (!slideshowActive) return;
+void endFrameDraw() {
+#ifdef USE_TFT_DMA
+  if (dmaBuffer[1]) tft.dmaWait();
+#endif
+  tft.endWrite();
+}
 
-  xSemaphoreTake(xSpiMutex, portMAX_DELAY);  // Lock SPI access for SD card
-  if (!jpeg.open(name, myOpen, myClose, myRead, mySeek, JPEGDraw)) {
-    xSemaphoreGive(xSpiMutex);  // Unlock SPI access
-    return;
+// Reveal a frame top to bottom, a band per step
+void wipeFrame(uint16_t *frame) {
+  uint32_t start = millis();
+  tft.startWrite();
+  for (int i = 0; i < TRANSITION_STEPS; i++) {
+    int top = frameHeight * i / TRANSITION_STEPS;
+    pushFrameRect(frame, 0, top, frameWidth, frameHeight * (i + 1) / TRANSITION_STEPS - top, 0);
+    waitTransitionStep(start, i + 1);
   }
-  tft.fillScreen(TFT_BLACK);  // Clear screen if the image doesn't fill it
-  jpeg.decode((tft.width() - jpeg.getWidth()) / 2, (tft.height() - jpeg.getHeight()) / 2, 0);
-  jpeg.close();
-  xSemaphoreGive(xSpiMutex);  // Unlock SPI access
+  endFrameDraw();
 }
 
-// Error handling function
-void error(const char* msg) {
-  tft.fillScreen(TFT_BLACK);
-  tft.setCursor(0, 0);
-  tft.setTextColor(TFT_WHITE);
-  tft.setTextSize(2);
-  tft.println(msg);
-  Serial.println(msg);  // Also print to Serial for debugging
-  
+// Slide a frame in from the right over the old slide
+void slideInFrame(uint16_t *frame) {
+  uint32_t start = millis();
+  tft.startWrite();
+  for (int i = 1; i <= TRANSITION_STEPS; i++) {
+    int shown = frameWidth * i / TRANSITION_STEPS;  // Columns of the new slide on screen
+    pushFrameRect(frame, 0, 0, shown, frameHeight, frameWidth - shown);
+    waitTransitionStep(start, i);
+  }
+  endFrameDraw();
 }
 
-// Function to check and mount SD card if not already mounted
-bool checkAndMountSDCard() {
-  if (!sdMounted) {  // Only try to mount if it's not already mounted
-    // Try to remount the SD card
-    if (!sd.begin(sdSpiConfig)) {
-      Serial.println("SD Card Mount Failed");
-      sdMounted = false;
-      return false;
-    } else {
-      sdMounted = true;  // Successfully mounted SD card
-      Serial.println("SD Card Mounted Successfully");
-    }
+#ifdef USE_TFT_DMA
+// Wipe without a frame: JPEGDraw copies blocks into a panel-wide band, which
+// goes out when the block at the image's right edge arrives. JPEGDEC draws
+// MCU rows top to bottom, so the bands make a wipe at the decoder's pace.
+bool bandDraw = false;
+int16_t bandRight = 0;   // Right edge of the image on the panel
+bool bandClear = false;  // The image is narrower than the panel, bands start black
+
+int drawBandBlock(JPEGDRAW *pDraw) {
+  uint16_t *band = dmaBuffer[dmaBufferSel];
+  int rows = min((int)pDraw->iHeight, min(frameHeight - pDraw->y, DMA_BUFFER_PIXELS / frameWidth));
+  int x0 = max(pDraw->x, 0);
+  int x1 = min(pDraw->x + pDraw->iWidth, (int)frameWidth);
+  for (int row = 0; row < rows && x1 > x0; row++) {
+    memcpy(&band[row * frameWidth + x0], &pDraw->pPixels[row * pDraw->iWidth + (x0 - pDraw->x)],
+           (x1 - x0) * sizeof(uint16_t));
+  }
+  if (rows > 0 && pDraw->x + pDraw->iWidth >= bandRight) {
+    uint32_t start = micros();
+    tft.pushImageDMA(0, pDraw->y, frameWidth, rows, band, band);
+    dmaBufferSel ^= 1;
+    if (bandClear) memset(dmaBuffer[dmaBufferSel], 0, DMA_BUFFER_PIXELS * sizeof(uint16_t));
+    slidePushMicros += micros() - start;
+  }
+  return 1;
+}
+#endif
+
+// Start drawing a JPEG at (x, y) as a wipe, with the letterbox above it. Returns
+// false where the slide is drawn as before.
+bool beginBandDraw(int x, int y, int width, int height) {
+#ifdef USE_TFT_DMA
+  if ((activeTransition != TRANSITION_WIPE && activeTransition != TRANSITION_SLIDE) || !dmaBuffer[1]) return false;
+  bandRight = x + width;
+  bandClear = width < frameWidth;
+  if (bandClear) {
+    memset(dmaBuffer[0], 0, DMA_BUFFER_PIXELS * sizeof(uint16_t));
+    memset(dmaBuffer[1], 0, DMA_BUFFER_PIXELS * sizeof(uint16_t));
   }
+  if (y > 0) tft.fillRect(0, 0, frameWidth, y, TFT_BLACK);
+  bandDraw = true;
   return true;
+#else
+  return false;
+#endif
 }
 
-// Play the WAV file (always "music.wav") with SD card reinitialization
-void playWAV() {
-  Serial.printf("Free heap before playback: %d bytes\n", esp_get_free_heap_size());
+// Finish a wipe with the letterbox below the image
+void endBandDraw(int bottom) {
+#ifdef USE_TFT_DMA
+  bandDraw = false;
+  if (bottom < frameHeight) tft.fillRect(0, bottom, frameWidth, frameHeight - bottom, TFT_BLACK);
+#endif
+}
 
-  xSemaphoreTake(xSpiMutex, portMAX_DELAY);  // Lock SPI access
+// Color correction
+// Panels differ between the CYD variants, so slides go through per-channel
+// lookup tables on their way to the panel: a gamma curve, then a white balance
+// gain per channel. Each table holds its channel already shifted into place in
+// an RGB565 word, so a pixel costs three loads and two ORs, a couple of ms over
+// a full slide against the tens of ms it takes to decode. With the identity
+// tables the pass is skipped. Copies on the card stay as decoded; prefetched
+// frames are corrected as they're filled and dropped when the settings change.
+#ifdef USE_GAMMA_CORRECTION
+#define COLOR_GAMMA_DEFAULT 120  // Darkens the washed-out midtones of the cyd2b panel
+#else
+#define COLOR_GAMMA_DEFAULT 100
+#endif
+#define COLOR_GAMMA_MIN 50       // Percent, the output is the input to the power gamma / 100
+#define COLOR_GAMMA_MAX 250
+#define COLOR_GAIN_MIN 50        // Percent of each channel
+#define COLOR_GAIN_MAX 150
+
+struct ColorSettings {
+  uint8_t gamma;
+  uint8_t red, green, blue;
+};
+
+ColorSettings colorSettings = {COLOR_GAMMA_DEFAULT, 100, 100, 100};  // Set on /color, kept in NVS
+DRAM_ATTR uint16_t redLut[32], greenLut[64], blueLut[32];
+bool colorCorrection = false;  // The tables aren't the identity
+
+// Settings in one word, for a FrameCommand's arg and NVS
+uint32_t packColorSettings(const ColorSettings &settings) {
+  return settings.gamma | settings.red << 8 | settings.green << 16 | (uint32_t)settings.blue << 24;
+}
 
-  // Unmount SdFat
-  sd.end();
-  sdMounted = false;
-  delay(500);  // Allow time to unmount
+ColorSettings unpackColorSettings(uint32_t packed) {
+  ColorSettings settings;
+  settings.gamma = constrain((int)(packed & 0xFF), COLOR_GAMMA_MIN, COLOR_GAMMA_MAX);
+  settings.red = constrain((int)(packed >> 8 & 0xFF), COLOR_GAIN_MIN, COLOR_GAIN_MAX);
+  settings.green = constrain((int)(packed >> 16 & 0xFF), COLOR_GAIN_MIN, COLOR_GAIN_MAX);
+  settings.blue = constrain((int)(packed >> 24), COLOR_GAIN_MIN, COLOR_GAIN_MAX);
+  return settings;
+}
 
-  // Initialize standard SD library
-  if (!SD.begin(SD_CS, sdSpi)) {  // Use the same SPI configuration
-    Serial.println("Failed to initialize standard SD library");
-    xSemaphoreGive(xSpiMutex);     // Unlock SPI access
-    return;
+// Fill the table of one channel, returns true if it isn't the identity
+bool buildChannelLut(uint16_t *lut, int bits, int shift, uint8_t gain) {
+  int top = (1 << bits) - 1;
+  float gamma = colorSettings.gamma / 100.0f;
+  bool changed = false;
+  for (int v = 0; v <= top; v++) {
+    int out = min((int)lroundf(powf((float)v / top, gamma) * gain / 100.0f * top), top);
+    lut[v] = out << shift;
+    changed |= out != v;
   }
+  return changed;
+}
 
-  xSemaphoreGive(xSpiMutex);       // Unlock SPI before starting playback
+void buildColorLuts() {
+  bool red = buildChannelLut(redLut, 5, 11, colorSettings.red);
+  bool green = buildChannelLut(greenLut, 6, 5, colorSettings.green);
+  bool blue = buildChannelLut(blueLut, 5, 0, colorSettings.blue);
+  colorCorrection = red || green || blue;
+}
 
-  // Open WAV file from SD card
-  file = new AudioFileSourceSD("/music.wav");
-  wav = new AudioGeneratorWAV();
+void setColorSettings(const ColorSettings &settings) {
+  colorSettings = settings;
+  prefs.putUInt("color", packColorSettings(settings));
+  buildColorLuts();
+  Serial.printf("Color: gamma %u%%, gains %u/%u/%u%%\n", settings.gamma, settings.red, settings.green,
+                settings.blue);
+}
 
-  if (wav->begin(file, out)) {
-    Serial.println("Started playing WAV file");
-  } else {
-    Serial.println("Failed to start WAV playback");
-    // Clean up
-    wav->stop();
-    delete wav;
-    delete file;
-    return;
+// Brightness in percent, for the color page
+void printColorJson(Print &out, const ColorSettings &settings, uint8_t brightness) {
+  out.printf("{\"gamma\":%u,\"red\":%u,\"green\":%u,\"blue\":%u,\"brightness\":%u}", settings.gamma,
+             settings.red, settings.green, settings.blue, (brightness * 100 + 127) / 255);
+}
+
+// Correct pixels in JPEGDEC's byte order, in place
+void correctPixels(uint16_t *pixels, int count) {
+  if (!colorCorrection) return;
+  for (int i = 0; i < count; i++) {
+    uint16_t p = pixels[i];
+    pixels[i] = redLut[p >> 11] | greenLut[(p >> 5) & 0x3F] | blueLut[p & 0x1F];
   }
+}
 
-  // Play the WAV file to completion
-  while (wav->isRunning()) {
-    if (!wav->loop()) {
-      wav->stop();
-      Serial.println("WAV playback finished");
-    }
-    delay(1);  // Yield to other tasks
+// The same for pixels in panel byte order
+void correctPanelPixels(uint16_t *pixels, int count) {
+  if (!colorCorrection) return;
+  for (int i = 0; i < count; i++) {
+    uint16_t p = __builtin_bswap16(pixels[i]);
+    pixels[i] = __builtin_bswap16(redLut[p >> 11] | greenLut[(p >> 5) & 0x3F] | blueLut[p & 0x1F]);
   }
+}
 
-  // Clean up
-  wav->stop();
-  delete wav;
-  delete file;
+// JPG decoding functions
+int JPEGDraw(JPEGDRAW *pDraw) {
+  // Returning 0 stops JPEGDEC, so a swipe mid-slide doesn't wait for the rest
+  if (slideAbortOnInput && slideInputPending()) return 0;
+  correctPixels(pDraw->pPixels, pDraw->iWidth * pDraw->iHeight);
+  uint32_t start = micros();
+#ifdef USE_TFT_DMA
+  if (bandDraw) return drawBandBlock(pDraw);
+  if (dmaBuffer[1]) {
+    tft.pushImageDMA(pDraw->x, pDraw->y, pDraw->iWidth, pDraw->iHeight, pDraw->pPixels, dmaBuffer[dmaBufferSel]);
+    dmaBufferSel ^= 1;
+    slidePushMicros += micros() - start;
+    return 1;
+  }
+#endif
+  tft.pushImage(pDraw->x, pDraw->y, pDraw->iWidth, pDraw->iHeight, pDraw->pPixels);
+  slidePushMicros += micros() - start;
+  return 1;
+}
+
+// Bracket a decode that draws through JPEGDraw; in DMA mode the TFT has to stay
+// selected until the last block has gone out
+void beginJpegDraw() {
+#ifdef USE_TFT_DMA
+  if (dmaBuffer[1]) {
+    jpeg.setMaxOutputSize(DMA_MCU_COUNT);  // Keep blocks within the DMA buffers
+    tft.startWrite();
+  }
+#endif
+}
+
+void endJpegDraw() {
+#ifdef USE_TFT_DMA
+  if (dmaBuffer[1]) {
+    uint32_t start = micros();
+    tft.dmaWait();
+    slidePushMicros += micros() - start;
+    tft.endWrite();
+  }
+#endif
+}
+
+// The file callbacks take the SD lock per call rather than for the whole
+// decode, so audio and uploads interleave with JPEG reads
+void myClose(void *handle) {
+  takeSpiMutex();
+  if (jpgFile) jpgFile.close();
+  giveSpiMutex();
+}
 
-  xSemaphoreTake(xSpiMutex, portMAX_DELAY);  // Lock SPI access again
+int32_t myRead(JPEGFILE *handle, uint8_t *buffer, int32_t length) {
+  takeSpiMutex();
+  int32_t n = sdRead(jpgFile, buffer, length);
+  giveSpiMutex();
+  return n;
+}
 
-  // Unmount SD and remount SdFat
-  SD.end();
-  delay(500);  // Allow time to unmount SD
+int32_t mySeek(JPEGFILE *handle, int32_t position) {
+  takeSpiMutex();
+  bool ok = sdSeek(jpgFile, position);
+  giveSpiMutex();
+  return ok ? position : -1;
+}
 
-  // Remount SdFat
-  if (!checkAndMountSDCard()) {
-    Serial.println("Failed to remount SdFat after WAV playback.");
-    xSemaphoreGive(xSpiMutex);
-    return;
+// Image index
+// Built once per album: one packed entry per image in the album folder,
+// holding its directory entry index (so a slide change can open the file
+// directly) and the offset of its name in a shared string arena.
+struct ImageEntry {
+  uint32_t dirIndex;    // Directory entry index inside albumDir
+  uint32_t nameOffset;  // Offset of the NUL-terminated name in imageNames
+  uint16_t cacheSlot;   // Directory entry of the pre-scaled copy in CACHE_DIR, or CACHE_NONE/CACHE_SKIP
+  uint16_t stamp;       // Hash of size and modify time, ties the cached copy to this version
+  uint16_t thumbSlot;   // Directory entry of the thumbnail in THUMB_DIR, or CACHE_NONE/CACHE_SKIP
+  uint16_t date;        // FAT modify date, for the recent playback order
+};
+
+#define CACHE_NONE 0xFFFF  // Not transcoded yet
+#define CACHE_SKIP 0xFFFE  // Fits the panel (or failed), the original is displayed
+
+ImageEntry *imageIndex = nullptr;
+uint16_t imageCapacity = 0;
+char *imageNames = nullptr;
+uint32_t imageNamesUsed = 0;
+uint32_t imageNamesCapacity = 0;
+uint16_t newestImageDate = 0;  // Latest modify date in the index
+uint32_t imageIndexGeneration = 0;  // Bumped whenever entries move, see fillFileListing
+
+// Raw images are headerless full-panel RGB565 in panel byte order
+bool isRawImageFile(const char *name) {
+  size_t len = strlen(name);
+  return len > 4 && strcasecmp(name + len - 4, ".RGB") == 0;
+}
+
+// Check the file extension of a candidate image
+bool isImageFile(const char *name) {
+  size_t len = strlen(name);
+  return (len > 4 && strcasecmp(name + len - 4, ".JPG") == 0) || isRawImageFile(name);
+}
+
+const char *imageName(uint16_t index) {
+  return imageNames + imageIndex[index].nameOffset;
+}
+
+// Fold a file's size and modify time into the 16-bit stamp kept in the index
+uint16_t imageStamp(SdBaseFile &file) {
+  uint16_t date = 0, time = 0;
+  file.getModifyDateTime(&date, &time);
+  uint32_t hash = (uint32_t)file.fileSize() ^ ((uint32_t)date << 16 | time);
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+uint16_t imageDate(SdBaseFile &file) {
+  uint16_t date = 0, time = 0;
+  file.getModifyDateTime(&date, &time);
+  return date;
+}
+
+// Append one image to the index, growing the entry array and name arena as needed
+bool addImageEntry(uint32_t dirIndex, const char *name, uint16_t stamp, uint16_t date) {
+  if (fileCount == UINT16_MAX) return false;
+
+  if (fileCount == imageCapacity) {
+    uint32_t newCapacity = imageCapacity ? (uint32_t)imageCapacity * 2 : 64;
+    if (newCapacity > UINT16_MAX) newCapacity = UINT16_MAX;
+    ImageEntry *grown = (ImageEntry *)realloc(imageIndex, newCapacity * sizeof(ImageEntry));
+    if (!grown) return false;
+    imageIndex = grown;
+    imageCapacity = newCapacity;
   }
 
-  xSemaphoreGive(xSpiMutex);  // Unlock SPI access
+  size_t len = strlen(name) + 1;
+  if (imageNamesUsed + len > imageNamesCapacity) {
+    uint32_t newCapacity = imageNamesCapacity ? imageNamesCapacity * 2 : 1024;
+    while (newCapacity < imageNamesUsed + len) newCapacity *= 2;
+    char *grown = (char *)realloc(imageNames, newCapacity);
+    if (!grown) return false;
+    imageNames = grown;
+    imageNamesCapacity = newCapacity;
+  }
 
-  Serial.printf("Free heap after playback: %d bytes\n", esp_get_free_heap_size());
+  memcpy(imageNames + imageNamesUsed, name, len);
+  imageIndex[fileCount].dirIndex = dirIndex;
+  imageIndex[fileCount].nameOffset = imageNamesUsed;
+  imageIndex[fileCount].cacheSlot = isRawImageFile(name) ? CACHE_SKIP : CACHE_NONE;
+  imageIndex[fileCount].stamp = stamp;
+  imageIndex[fileCount].thumbSlot = CACHE_NONE;
+  imageIndex[fileCount].date = date;
+  newestImageDate = max(newestImageDate, date);
+  imageNamesUsed += len;
+  fileCount++;
+  playOrderAdded(fileCount - 1);
+  return true;
 }
 
-// FreeRTOS task for WAV playback
-void playWAVTask(void * parameter) {
-  playWAV();
-  restartSlideshow();  // Restart the slideshow after playback
-  vTaskDelete(NULL);   // Delete this task when done
+// Find an indexed image by name, returns -1 if it is not in the index
+int32_t findImageEntry(const char *name) {
+  for (uint16_t i = 0; i < fileCount; i++) {
+    if (strcasecmp(imageName(i), name) == 0) return i;
+  }
+  return -1;
 }
 
-// Web server handler to play WAV file and show a "Go Back" button
-void handlePlayMusicRequest(AsyncWebServerRequest *request) {
-  // Stop the slideshow before playing music
-  stopSlideshow();
-
-  // Send the response with "Play Music" confirmation and a "Go Back" button
-  String html = R"rawliteral(
-  <!DOCTYPE html>
-  <html>
-  <head>
-    <title>Play Music</title>
-    <style>
-      body {
-        font-family: Arial, sans-serif;
-        background-color: #f0f0f0;
-        text-align: center;
-        margin: 0;
-        padding: 0;
-      }
-      h1 {
-        background-color: #333;
-        color: white;
-        padding: 20px;
-        margin: 0;
-      }
-      .container {
-        padding: 20px;
-      }
-      .button {
-        display: inline-block;
-        padding: 15px 25px;
-        font-size: 16px;
-        margin: 10px;
-        cursor: pointer;
-        text-align: center;
-        text-decoration: none;
-        outline: none;
-        color: #fff;
-        background-color: #4CAF50;
-        border: none;
-        border-radius: 15px;
-        box-shadow: 0 5px #999;
-      }
-      .button:hover {background-color: #3e8e41}
-      .button:active {
-        background-color: #3e8e41;
-        box-shadow: 0 3px #666;
-        transform: translateY(2px);
-      }
-    </style>
-  </head>
-  <body>
-    <h1>Playing Music</h1>
-    <div class="container">
-      <p>Now playing <strong>music.wav</strong></p>
-      <a href="/" class="button">Go Back to Main Page</a>
-    </div>
-  </body>
-  </html>
-  )rawliteral";
-
-  request->send(200, "text/html", html);
-
-  // Play "music.wav" in a separate task
-  xTaskCreatePinnedToCore(
-    playWAVTask,      // Function to implement the task
-    "playWAVTask",    // Name of the task
-    8192,             // Stack size in words
-    NULL,             // Task input parameter
-    1,                // Priority of the task
-    NULL,             // Task handle
-    1                 // Core where the task should run
-  );
+// Remove one image from the index, compacting the entries and the name arena
+// and keeping currentIndex on the same image
+void removeImageEntry(uint16_t index) {
+  uint32_t offset = imageIndex[index].nameOffset;
+  uint32_t len = strlen(imageNames + offset) + 1;
+
+  memmove(imageNames + offset, imageNames + offset + len, imageNamesUsed - offset - len);
+  imageNamesUsed -= len;
+  memmove(&imageIndex[index], &imageIndex[index + 1], (fileCount - index - 1) * sizeof(ImageEntry));
+  fileCount--;
+
+  for (uint16_t i = 0; i < fileCount; i++) {
+    if (imageIndex[i].nameOffset > offset) imageIndex[i].nameOffset -= len;
+  }
 
-  // No need to call restartSlideshow() here; it will be called after playback
+  if (index < currentIndex) currentIndex--;
+  if (currentIndex >= fileCount) currentIndex = 0;
+  playOrderRemoved(index);
+  imageIndexGeneration++;
 }
 
-// Function to handle file upload and play music.wav after any file upload
-void handleFileUpload(AsyncWebServerRequest *request) {
-  // Stop the slideshow before handling the upload
-  stopSlideshow();
-
-  String html = R"rawliteral(
-  <!DOCTYPE html>
-  <html>
-  <head>
-    <title>Upload Successful</title>
-    <style>
-      body {
-        font-family: Arial, sans-serif;
-        background-color: #f0f0f0;
-        text-align: center;
-        margin: 0;
-        padding: 0;
-      }
-      h1 {
-        background-color: #333;
-        color: white;
-        padding: 20px;
-        margin: 0;
-      }
-      .container {
-        padding: 20px;
-      }
-      .button {
-        display: inline-block;
-        padding: 15px 25px;
-        font-size: 16px;
-        margin: 10px;
-        cursor: pointer;
-        text-align: center;
-        text-decoration: none;
-        outline: none;
-        color: #fff;
-        background-color: #4CAF50;
-        border: none;
-        border-radius: 15px;
-        box-shadow: 0 5px #999;
-      }
-      .button:hover {background-color: #3e8e41}
-      .button:active {
-        background-color: #3e8e41;
-        box-shadow: 0 3px #666;
-        transform: translateY(2px);
-      }
-    </style>
-  </head>
-  <body>
-    <h1>Upload Successful</h1>
-    <div class="container">
-      <p>File uploaded successfully!</p>
-      <a href="/upload_file" class="button">Upload More Files</a>
-      <a href="/" class="button">Go Back to Main Page</a>
-    </div>
-  </body>
-  </html>
-  )rawliteral";
-
-  request->send(200, "text/html", html);
-
-  // Rebuild the file list after upload
-  root.rewind();
+// Walk the album folder once and rebuild the image index
+void buildImageIndex() {
   fileCount = 0;
-  SdBaseFile fileEntry;
+  imageNamesUsed = 0;
+
+  albumDir.rewind();
+  SdBaseFile entry;
   char name[100];
-  while (fileEntry.openNext(&root)) {
-    fileEntry.getName(name, sizeof(name));
-    if (strcasecmp(name + strlen(name) - 3, "JPG") == 0) {
-      fileCount++;
+  while (entry.openNext(&albumDir)) {
+    if (!entry.isDir()) {
+      entry.getName(name, sizeof(name));
+      if (isImageFile(name) && !addImageEntry(entry.dirIndex(), name, imageStamp(entry), imageDate(entry))) {
+        Serial.println("Image index full, skipping remaining files");
+        entry.close();
+        break;
+      }
     }
-    fileEntry.close();
+    entry.close();
   }
-  currentIndex = 0;
+  Serial.printf("Indexed %u images (%u bytes of names).\n", fileCount, imageNamesUsed);
+}
 
-  // Play "music.wav" after any file is uploaded
-  if (sd.exists("/music.wav")) {  // Use sd.exists() instead of SD.exists()
-    Serial.println("Playing music.wav after file upload.");
-    xTaskCreatePinnedToCore(
-      playWAVTask,      // Function to implement the task
-      "playWAVTask",    // Name of the task
-      8192,             // Stack size in words
-      NULL,             // Task input parameter
-      1,                // Priority of the task
-      NULL,             // Task handle
-      1                 // Core where the task should run
-    );
-  } else {
-    Serial.println("music.wav not found on the SD card.");
-    // Restart the slideshow immediately if WAV file is not found
-    restartSlideshow();
+// Open an indexed image directly from its directory entry. The index follows
+// every change made through the frame, so a failure is the card's.
+bool openImageFile(SdBaseFile &file, uint16_t index) {
+  if (file.open(&albumDir, imageIndex[index].dirIndex, O_RDONLY)) return true;
+  countSdError(metrics.sdOpenErrorsTotal);
+  return false;
+}
+
+// Find an indexed image by directory entry, returns -1 if it is not in the index
+int32_t findImageByDirIndex(uint32_t dirIndex) {
+  for (uint16_t i = 0; i < fileCount; i++) {
+    if (imageIndex[i].dirIndex == dirIndex) return i;
   }
+  return -1;
 }
 
-// WebSocket event handler
-void onWebSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
-                      void *arg, uint8_t *data, size_t len) {
-  if (type == WS_EVT_CONNECT) {
-    Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
-  } else if (type == WS_EVT_DISCONNECT) {
-    Serial.printf("WebSocket client #%u disconnected\n", client->id());
+// Pre-scaled image cache
+// Images larger than the panel are decoded once in the background with JPEGDEC's
+// 1/2, 1/4 or 1/8 scaling, resampled to fit the panel and stored in CACHE_DIR as
+// a top-down 16-bit BMP named after the original's directory entry. The pixels
+// are RGB565 exactly as JPEGDEC outputs them, so the display path pushes them
+// as-is and /current_image can send the file to a browser unchanged. The header
+// is padded to one sector so pixel reads stay sector-aligned. Thumbnails for the
+// web UI are made the same way, at a quarter of the panel size, into THUMB_DIR.
+// Both folders live inside the album folder, since entry numbers are per folder.
+#define CACHE_DIR ".cache"
+#define THUMB_DIR ".thumbs"
+#define INDEX_FILE_NAME "index.dat"     // Saved image index, kept beside the copies
+#define THUMB_SHIFT 2                   // Thumbnails fit in the panel size >> THUMB_SHIFT
+#define CACHE_HEADER_SIZE 512
+#define CACHE_INFO_SIZE 76              // BMP headers, bitfield masks and our stamp
+#define CACHE_MAGIC 0x31434650          // "PFC1"
+#define CACHE_STRIPE_ROWS 16            // A decoded MCU row never maps to more output rows
+
+const int jpegScaleOptions[4] = {0, JPEG_SCALE_HALF, JPEG_SCALE_QUARTER, JPEG_SCALE_EIGHTH};
+volatile bool cacheWorkPending = false;
+
+// Smallest JPEGDEC downscale that fits an image on the panel (1/8 at most)
+int jpegFitShift(int width, int height) {
+  int shift = 0;
+  while (shift < 3 && ((width >> shift) > frameWidth || (height >> shift) > frameHeight)) shift++;
+  return shift;
+}
+
+void putLE16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+void putLE32(uint8_t *p, uint32_t v) {
+  putLE16(p, v);
+  putLE16(p + 2, v >> 16);
+}
+
+uint16_t getLE16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t getLE32(const uint8_t *p) {
+  return getLE16(p) | ((uint32_t)getLE16(p + 2) << 16);
+}
+
+// Build the padded BMP header for a cached image
+void makeCacheHeader(uint8_t *header, int width, int height, uint16_t stamp) {
+  uint32_t pixelBytes = (uint32_t)width * height * 2;
+  memset(header, 0, CACHE_HEADER_SIZE);
+  header[0] = 'B';
+  header[1] = 'M';
+  putLE32(header + 2, CACHE_HEADER_SIZE + pixelBytes);  // File size
+  putLE32(header + 10, CACHE_HEADER_SIZE);              // Pixel data offset
+  putLE32(header + 14, 40);                             // BITMAPINFOHEADER
+  putLE32(header + 18, width);
+  putLE32(header + 22, (uint32_t)-height);              // Negative height: rows are top-down
+  putLE16(header + 26, 1);                              // Planes
+  putLE16(header + 28, 16);                             // Bits per pixel
+  putLE32(header + 30, 3);                              // BI_BITFIELDS
+  putLE32(header + 34, pixelBytes);
+  putLE32(header + 38, 2835);                           // 72 DPI
+  putLE32(header + 42, 2835);
+  putLE32(header + 54, 0xF800);                         // RGB565 masks
+  putLE32(header + 58, 0x07E0);
+  putLE32(header + 62, 0x001F);
+  putLE32(header + 66, CACHE_MAGIC);
+  putLE16(header + 70, stamp);
+}
+
+// Read and check a cached image's header, leaving the file at the first pixel
+bool readCacheHeader(SdBaseFile &file, uint16_t stamp, int *width, int *height) {
+  uint8_t info[CACHE_INFO_SIZE];
+  if (sdRead(file, info, sizeof(info)) != sizeof(info)) return false;
+  if (info[0] != 'B' || info[1] != 'M' || getLE32(info + 66) != CACHE_MAGIC) return false;
+  if (getLE16(info + 70) != stamp) return false;
+  *width = (int32_t)getLE32(info + 18);
+  *height = -(int32_t)getLE32(info + 22);
+  if (*width <= 0 || *width > frameWidth || *height <= 0 || *height > frameHeight) return false;
+  return file.seekSet(CACHE_HEADER_SIZE);
+}
+
+// Open the cached copy of an image by its slot in CACHE_DIR
+bool openCacheFile(SdBaseFile &file, uint16_t cacheSlot, oflag_t oflag = O_RDONLY) {
+  return cacheSlot < CACHE_SKIP && file.open(&cacheDir, cacheSlot, oflag);
+}
+
+// Open the thumbnail of an image by its slot in THUMB_DIR
+bool openThumbFile(SdBaseFile &file, uint16_t thumbSlot, oflag_t oflag = O_RDONLY) {
+  return thumbSlot < CACHE_SKIP && file.open(&thumbDir, thumbSlot, oflag);
+}
+
+// Delete a cached copy, called with xSpiMutex held
+void removeCacheFile(uint16_t cacheSlot) {
+  SdBaseFile file;
+  if (openCacheFile(file, cacheSlot, O_RDWR)) file.remove();
+}
+
+// Delete a thumbnail, called with xSpiMutex held
+void removeThumbFile(uint16_t thumbSlot) {
+  SdBaseFile file;
+  if (openThumbFile(file, thumbSlot, O_RDWR)) file.remove();
+}
+
+// Drop the cached copy and thumbnail of an image whose file was replaced or is
+// about to be removed, called with xSpiMutex held
+void resetImageCopies(uint16_t index) {
+  removeCacheFile(imageIndex[index].cacheSlot);
+  removeThumbFile(imageIndex[index].thumbSlot);
+  imageIndex[index].cacheSlot = isRawImageFile(imageName(index)) ? CACHE_SKIP : CACHE_NONE;
+  imageIndex[index].thumbSlot = CACHE_NONE;
+}
+
+// Open one of the album's cache folders, creating it if needed
+bool openCacheDir(SdBaseFile &dir, const char *name) {
+  if (dir.isOpen()) dir.close();
+  if (dir.open(&albumDir, name, O_RDONLY)) return true;
+  SdBaseFile created;
+  if (!created.mkdir(&albumDir, name)) {
+    Serial.printf("Failed to create %s in %s\n", name, albumPath);
+    return false;
   }
+  created.close();
+  return dir.open(&albumDir, name, O_RDONLY);
 }
 
-// Setup the web server, including routes for speed, upload, delete, and slideshow
-void setupWebServer() {
-  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
-    String html = R"rawliteral(
-    <!DOCTYPE html>
-    <html>
-    <head>
-      <title>PhotoFrame 2.0</title>
-      <style>
-        body {
-          font-family: Arial, sans-serif;
-          background-color: #f0f0f0;
-          text-align: center;
-          margin: 0;
-          padding: 0;
-        }
-        h1 {
-          background-color: #333;
-          color: white;
-          padding: 20px;
-          margin: 0;
-        }
-        .container {
-          padding: 20px;
-        }
-        .button {
-          display: inline-block;
-          padding: 15px 25px;
-          font-size: 16px;
-          margin: 10px;
-          cursor: pointer;
-          text-align: center;
-          text-decoration: none;
-          outline: none;
-          color: #fff;
-          background-color: #4CAF50;
-          border: none;
-          border-radius: 15px;
-          box-shadow: 0 5px #999;
-        }
-        .button:hover {background-color: #3e8e41}
-        .button:active {
-          background-color: #3e8e41;
-          box-shadow: 0 3px #666;
-          transform: translateY(2px);
+// Attach the copies in one cache folder to the index, removing orphans. Runs
+// right after the index is built or loaded, while the entries are in ascending
+// directory order, so each lookup is a binary search.
+uint16_t linkCacheDir(SdBaseFile &dir, bool thumbs) {
+  if (!dir.isOpen()) return 0;
+  dir.rewind();
+  uint16_t linked = 0;
+  SdBaseFile entry;
+  char name[32];
+  while (entry.openNext(&dir, O_RDWR)) {
+    entry.getName(name, sizeof(name));
+    if (!thumbs && strcasecmp(name, INDEX_FILE_NAME) == 0) {
+      entry.close();
+      continue;
+    }
+    char *end;
+    uint32_t dirIndex = strtoul(name, &end, 10);
+    int32_t found = -1;
+    if (end != name && strcasecmp(end, ".bmp") == 0) {
+      int32_t lo = 0, hi = (int32_t)fileCount - 1;
+      while (lo <= hi) {
+        int32_t mid = (lo + hi) / 2;
+        if (imageIndex[mid].dirIndex == dirIndex) {
+          found = mid;
+          break;
         }
-      </style>
-    </head>
-    <body>
-      <h1>PhotoFrame 2.0</h1>
-      <div class="container">
-        <p>Use the following options:</p>
-        <a href="/upload_file" class="button">Upload a New Image</a>
-        <a href="/delete" class="button">Delete Images</a>
-        <a href="/play-music" class="button">Play Music</a>
-        <a href="/speed" class="button">Set Slideshow Speed</a>
-        <a href="/slideshow" class="button">View Slideshow</a>
-        <a href="/about" class="button">About</a>
-      </div>
-    </body>
-    </html>
-    )rawliteral";
-    request->send(200, "text/html", html);
+        if (imageIndex[mid].dirIndex < dirIndex) lo = mid + 1;
+        else hi = mid - 1;
+      }
+    }
+    if (found >= 0 && entry.dirIndex() < CACHE_SKIP) {
+      if (thumbs) imageIndex[found].thumbSlot = entry.dirIndex();
+      else imageIndex[found].cacheSlot = entry.dirIndex();
+      linked++;
+    } else if (!entry.isDir()) {
+      entry.remove();  // Orphaned copy of a file that no longer exists
+    }
+    entry.close();
+  }
+  return linked;
+}
+
+// Attach the pre-scaled copies and thumbnails already on the card
+void linkImageCache() {
+  uint16_t copies = linkCacheDir(cacheDir, false);
+  uint16_t thumbs = linkCacheDir(thumbDir, true);
+  cacheWorkPending = true;  // Let the transcoder look for images without a copy
+  Serial.printf("Image cache: %u pre-scaled copies and %u thumbnails linked.\n", copies, thumbs);
+}
+
+// Saved image index
+// A copy of each album's index is kept in its CACHE_DIR so a warm boot or an
+// album switch needn't walk the folder again. FAT keeps no modify time for the
+// root folder (and doesn't update it on others), so the copy is tied to a hash
+// of the raw directory entries instead, which any added, removed, renamed or
+// rewritten file changes. Reading that is much cheaper than opening every
+// entry. Uploads and deletes mark the copy stale and loop() writes it again
+// once the card has been quiet for INDEX_SAVE_DELAY_MS.
+#define INDEX_MAGIC 0x32494650           // "PFI2", with modify dates
+#define INDEX_SAVE_DELAY_MS 10000
+
+struct IndexFileHeader {
+  uint32_t magic;
+  uint32_t entrySize;   // sizeof(ImageEntry) of the firmware that wrote it
+  uint32_t dirStamp;    // albumDirStamp() when it was written
+  uint32_t count;
+  uint32_t namesUsed;
+};
+
+volatile bool indexChanged = false;
+volatile uint32_t indexChangedAt = 0;
+
+// Note a change to the album folder, the saved index no longer matches
+void markIndexChanged() {
+  indexChangedAt = millis();
+  indexChanged = true;
+}
+
+// FNV-1a of the album folder's entries up to the end marker, called with
+// xSpiMutex held
+uint32_t albumDirStamp() {
+  uint8_t buffer[512];
+  uint32_t hash = 2166136261UL;
+  bool end = false;
+  albumDir.rewind();
+  int32_t n;
+  while (!end && (n = sdRead(albumDir, buffer, sizeof(buffer))) > 0) {
+    for (int32_t i = 0; i < n; i++) {
+      if (i % 32 == 0 && buffer[i] == 0) {
+        end = true;  // Unused entry, nothing follows
+        break;
+      }
+      hash = (hash ^ buffer[i]) * 16777619UL;
+    }
+  }
+  albumDir.rewind();
+  return hash;
+}
+
+// Make room for a whole index at once
+bool reserveImageIndex(uint32_t entries, uint32_t nameBytes) {
+  if (entries > imageCapacity) {
+    ImageEntry *grown = (ImageEntry *)realloc(imageIndex, entries * sizeof(ImageEntry));
+    if (!grown) return false;
+    imageIndex = grown;
+    imageCapacity = entries;
+  }
+  if (nameBytes > imageNamesCapacity) {
+    char *grown = (char *)realloc(imageNames, nameBytes);
+    if (!grown) return false;
+    imageNames = grown;
+    imageNamesCapacity = nameBytes;
+  }
+  return true;
+}
+
+int compareDirIndex(const void *a, const void *b) {
+  uint32_t x = ((const ImageEntry *)a)->dirIndex;
+  uint32_t y = ((const ImageEntry *)b)->dirIndex;
+  return x < y ? -1 : x > y;
+}
+
+// Load the saved index if it still matches the album folder. Uploads append
+// out of directory order, so the entries are sorted back into the order a scan
+// gives, which linkCacheDir relies on.
+bool loadImageIndex() {
+  SdBaseFile file;
+  IndexFileHeader header;
+  if (!file.open(&cacheDir, INDEX_FILE_NAME, O_RDONLY)) return false;
+  bool ok = sdRead(file, &header, sizeof(header)) == sizeof(header) &&
+            header.magic == INDEX_MAGIC && header.entrySize == sizeof(ImageEntry) &&
+            header.count <= UINT16_MAX && header.dirStamp == albumDirStamp() &&
+            file.fileSize() == sizeof(header) + header.count * sizeof(ImageEntry) + header.namesUsed &&
+            reserveImageIndex(header.count, header.namesUsed);
+  if (ok && header.count > 0) {
+    int32_t entryBytes = header.count * sizeof(ImageEntry);
+    ok = sdRead(file, imageIndex, entryBytes) == entryBytes &&
+         sdRead(file, imageNames, header.namesUsed) == (int32_t)header.namesUsed &&
+         imageNames[header.namesUsed - 1] == '\0';
+    for (uint32_t i = 0; ok && i < header.count; i++) ok = imageIndex[i].nameOffset < header.namesUsed;
+  }
+  file.close();
+  if (!ok) return false;
+
+  fileCount = header.count;
+  imageNamesUsed = header.namesUsed;
+  for (uint16_t i = 0; i < fileCount; i++) {
+    imageIndex[i].cacheSlot = isRawImageFile(imageName(i)) ? CACHE_SKIP : CACHE_NONE;
+    imageIndex[i].thumbSlot = CACHE_NONE;
+    newestImageDate = max(newestImageDate, imageIndex[i].date);
+  }
+  qsort(imageIndex, fileCount, sizeof(ImageEntry), compareDirIndex);
+  Serial.printf("Loaded saved index of %u images.\n", fileCount);
+  return true;
+}
+
+// Write the index with the current stamp, called with xSpiMutex held. It is a
+// few KB per hundred images, well within what the audio buffer covers.
+void writeImageIndex() {
+  indexChanged = false;
+  IndexFileHeader header = {INDEX_MAGIC, sizeof(ImageEntry), albumDirStamp(), fileCount, imageNamesUsed};
+  size_t entryBytes = fileCount * sizeof(ImageEntry);
+  SdBaseFile file;
+  bool ok = file.open(&cacheDir, INDEX_FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC) &&
+            file.write(&header, sizeof(header)) == sizeof(header) &&
+            (entryBytes == 0 || file.write(imageIndex, entryBytes) == entryBytes) &&
+            (imageNamesUsed == 0 || file.write(imageNames, imageNamesUsed) == imageNamesUsed);
+  ok = file.close() && ok;
+  if (!ok) {
+    Serial.printf("Failed to save the image index of %s\n", albumPath);
+    if (file.open(&cacheDir, INDEX_FILE_NAME, O_RDWR)) file.remove();
+  }
+}
+
+void saveImageIndex() {
+  takeSpiMutex();
+  writeImageIndex();
+  giveSpiMutex();
+}
+
+// State of the transcode in progress, used by its JPEGDEC callbacks
+struct CacheWriter {
+  SdBaseFile source;
+  SdBaseFile file;
+  uint16_t *stripe;     // Output rows for the MCU row being decoded
+  int srcWidth, srcHeight;  // Size after JPEGDEC scaling
+  int outWidth, outHeight;
+  int stripeY;          // Source y of the MCU row in the stripe, -1 before the first
+  int rowFirst, rowEnd;
+  bool ok;
+};
+
+CacheWriter cacheWriter;
+
+// First output row/column whose nearest-neighbour source is at or after src
+int firstOutput(int src, int srcSize, int outSize) {
+  return (src * outSize + srcSize - 1) / srcSize;
+}
+
+void cacheClose(void *handle) {
+  // The transcoder closes its source itself, under the SD lock
+}
+
+// Source reads take the SD lock per call so the slideshow is never held off
+int32_t cacheRead(JPEGFILE *handle, uint8_t *buffer, int32_t length) {
+  takeSpiMutex();
+  int32_t n = sdRead(cacheWriter.source, buffer, length);
+  giveSpiMutex();
+  return n;
+}
+
+int32_t cacheSeek(JPEGFILE *handle, int32_t position) {
+  takeSpiMutex();
+  bool ok = sdSeek(cacheWriter.source, position);
+  giveSpiMutex();
+  return ok ? position : -1;
+}
+
+// Write the finished output rows of the current stripe
+bool flushCacheStripe() {
+  CacheWriter &cw = cacheWriter;
+  if (cw.stripeY < 0 || cw.rowEnd <= cw.rowFirst) return true;
+  size_t bytes = (size_t)(cw.rowEnd - cw.rowFirst) * cw.outWidth * sizeof(uint16_t);
+  takeSpiMutex();
+  bool ok = cw.file.write(cw.stripe, bytes) == bytes;
+  giveSpiMutex();
+  return ok;
+}
+
+// JPEGDEC callback for the transcoder, resamples each block into the stripe
+int JPEGDrawToCache(JPEGDRAW *pDraw) {
+  CacheWriter &cw = cacheWriter;
+  if (pDraw->y != cw.stripeY) {
+    if (!flushCacheStripe()) {
+      cw.ok = false;
+      return 0;  // Abort the decode
+    }
+    cw.stripeY = pDraw->y;
+    cw.rowFirst = firstOutput(pDraw->y, cw.srcHeight, cw.outHeight);
+    cw.rowEnd = min(firstOutput(pDraw->y + pDraw->iHeight, cw.srcHeight, cw.outHeight), cw.outHeight);
+  }
+
+  int colFirst = firstOutput(pDraw->x, cw.srcWidth, cw.outWidth);
+  int colEnd = min(firstOutput(pDraw->x + pDraw->iWidth, cw.srcWidth, cw.outWidth), cw.outWidth);
+  for (int oy = cw.rowFirst; oy < cw.rowEnd; oy++) {
+    const uint16_t *src = pDraw->pPixels + (oy * cw.srcHeight / cw.outHeight - pDraw->y) * pDraw->iWidth;
+    uint16_t *dst = cw.stripe + (oy - cw.rowFirst) * cw.outWidth;
+    for (int ox = colFirst; ox < colEnd; ox++) {
+      dst[ox] = src[ox * cw.srcWidth / cw.outWidth - pDraw->x];
+    }
+  }
+  return 1;
+}
+
+// Fit width x height inside maxWidth x maxHeight keeping the aspect ratio, with
+// an even width for BMP rows
+void fitCacheSize(int width, int height, int maxWidth, int maxHeight) {
+  CacheWriter &cw = cacheWriter;
+  if ((int32_t)width * maxHeight > (int32_t)height * maxWidth) {
+    cw.outWidth = maxWidth;
+    cw.outHeight = max(1, (int)((int32_t)height * maxWidth / width));
+  } else {
+    cw.outHeight = maxHeight;
+    cw.outWidth = max(2, (int)((int32_t)width * maxHeight / height));
+  }
+  cw.outWidth &= ~1;
+}
+
+// Create <dir>/<dirIndex>.bmp for the output size in cacheWriter and write its header
+bool beginCacheFile(SdBaseFile &dir, uint32_t dirIndex, uint16_t stamp) {
+  CacheWriter &cw = cacheWriter;
+  cw.stripeY = -1;
+  cw.stripe = (uint16_t *)malloc(cw.outWidth * CACHE_STRIPE_ROWS * sizeof(uint16_t));
+
+  char name[16];
+  snprintf(name, sizeof(name), "%lu.bmp", (unsigned long)dirIndex);
+  uint8_t header[CACHE_HEADER_SIZE];
+  makeCacheHeader(header, cw.outWidth, cw.outHeight, stamp);
+
+  takeSpiMutex();
+  cw.ok = cw.stripe && cw.file.open(&dir, name, O_RDWR | O_CREAT | O_TRUNC);
+  if (cw.ok) {
+    cw.file.preAllocate(CACHE_HEADER_SIZE + (uint32_t)cw.outWidth * cw.outHeight * 2);
+    cw.ok = cw.file.write(header, sizeof(header)) == sizeof(header);
+  }
+  giveSpiMutex();
+  return cw.ok;
+}
+
+// Close the file started by beginCacheFile, keeping it only if every row was
+// written. Returns its slot, or CACHE_NONE on failure.
+uint16_t endCacheFile(uint32_t dirIndex) {
+  CacheWriter &cw = cacheWriter;
+  uint16_t result = CACHE_NONE;
+  takeSpiMutex();
+  if (cw.file.isOpen()) {
+    uint16_t slot = cw.file.dirIndex();
+    if (cw.ok && slot < CACHE_SKIP) {
+      cw.file.close();
+      result = slot;
+    } else {
+      cw.file.remove();
+    }
+  }
+  giveSpiMutex();
+  free(cw.stripe);
+  cw.stripe = nullptr;
+  if (result == CACHE_NONE) Serial.printf("Transcode failed for entry %lu\n", (unsigned long)dirIndex);
+  return result;
+}
+
+// Transcode one image into dir, fitted inside maxWidth x maxHeight. Returns its
+// cache slot, CACHE_SKIP if it already fits or can't be decoded, or CACHE_NONE
+// on an SD error.
+uint16_t transcodeImage(uint32_t dirIndex, uint16_t stamp, SdBaseFile &dir, int maxWidth, int maxHeight) {
+  CacheWriter &cw = cacheWriter;
+  uint16_t result = CACHE_SKIP;
+
+  takeSpiMutex();
+  bool opened = cw.source.open(&albumDir, dirIndex, O_RDONLY);
+  uint32_t size = opened ? cw.source.fileSize() : 0;
+  giveSpiMutex();
+  if (!opened) return CACHE_NONE;
+
+  if (jpegAhead->open(&cw.source, size, cacheClose, cacheRead, cacheSeek, JPEGDrawToCache)) {
+    int width = jpegAhead->getWidth();
+    int height = jpegAhead->getHeight();
+
+    if (width > maxWidth || height > maxHeight) {
+      fitCacheSize(width, height, maxWidth, maxHeight);
+
+      // Let JPEGDEC do as much of the reduction as possible without going below the target
+      int shift = 0;
+      while (shift < 3 && (width >> (shift + 1)) >= cw.outWidth && (height >> (shift + 1)) >= cw.outHeight) shift++;
+      cw.srcWidth = width >> shift;
+      cw.srcHeight = height >> shift;
+
+      if (beginCacheFile(dir, dirIndex, stamp)) {
+        if (!jpegAhead->decode(0, 0, jpegScaleOptions[shift])) cw.ok = false;
+        cw.ok = cw.ok && flushCacheStripe();
+      }
+      result = endCacheFile(dirIndex);
+    }
+    jpegAhead->close();
+  }
+
+  takeSpiMutex();
+  cw.source.close();
+  giveSpiMutex();
+  return result;
+}
+
+// Thumbnail a raw .rgb image into THUMB_DIR, reading only the rows it samples
+uint16_t thumbnailRawImage(uint32_t dirIndex, uint16_t stamp) {
+  CacheWriter &cw = cacheWriter;
+  size_t rowBytes = frameWidth * sizeof(uint16_t);
+
+  takeSpiMutex();
+  bool opened = cw.source.open(&albumDir, dirIndex, O_RDONLY);
+  bool valid = opened && cw.source.fileSize() == (uint32_t)rowBytes * frameHeight;
+  giveSpiMutex();
+
+  uint16_t result = opened ? CACHE_SKIP : CACHE_NONE;
+  uint16_t *row = valid ? (uint16_t *)malloc(rowBytes) : nullptr;
+  if (row) {
+    fitCacheSize(frameWidth, frameHeight, frameWidth >> THUMB_SHIFT, frameHeight >> THUMB_SHIFT);
+    if (beginCacheFile(thumbDir, dirIndex, stamp)) {
+      cw.stripeY = 0;
+      cw.rowFirst = 0;
+      for (int oy = 0; oy < cw.outHeight && cw.ok; oy++) {
+        takeSpiMutex();
+        cw.ok = cw.source.seekSet((uint32_t)(oy * frameHeight / cw.outHeight) * rowBytes) &&
+                sdRead(cw.source, row, rowBytes) == (int)rowBytes;
+        giveSpiMutex();
+
+        // Sample the row into the stripe, from panel order to JPEGDEC order
+        uint16_t *dst = cw.stripe + (oy - cw.rowFirst) * cw.outWidth;
+        for (int ox = 0; ox < cw.outWidth; ox++) {
+          dst[ox] = __builtin_bswap16(row[ox * frameWidth / cw.outWidth]);
+        }
+        cw.rowEnd = oy + 1;
+        if (cw.rowEnd - cw.rowFirst == CACHE_STRIPE_ROWS || cw.rowEnd == cw.outHeight) {
+          cw.ok = cw.ok && flushCacheStripe();
+          cw.rowFirst = cw.rowEnd;
+        }
+      }
+    }
+    result = endCacheFile(dirIndex);
+    free(row);
+  }
+
+  takeSpiMutex();
+  cw.source.close();
+  giveSpiMutex();
+  return result;
+}
+
+// Make the next missing pre-scaled copy, then the next missing thumbnail.
+// Returns false when there is nothing left to do.
+bool transcodeNextImage() {
+  takeSpiMutex();
+  int32_t next = -1;
+  bool thumb = false;
+  for (uint16_t i = 0; i < fileCount; i++) {
+    if (imageIndex[i].cacheSlot == CACHE_NONE) {
+      next = i;
+      break;
+    }
+  }
+  for (uint16_t i = 0; next < 0 && i < fileCount; i++) {
+    if (imageIndex[i].thumbSlot == CACHE_NONE) {
+      next = i;
+      thumb = true;
+    }
+  }
+  uint32_t dirIndex = next >= 0 ? imageIndex[next].dirIndex : 0;
+  uint16_t stamp = next >= 0 ? imageIndex[next].stamp : 0;
+  bool raw = next >= 0 && isRawImageFile(imageName(next));
+  uint32_t album = albumGeneration;
+  giveSpiMutex();
+  if (next < 0) return false;
+
+  uint16_t slot;
+  if (!thumb) slot = transcodeImage(dirIndex, stamp, cacheDir, frameWidth, frameHeight);
+  else if (raw) slot = thumbnailRawImage(dirIndex, stamp);
+  else slot = transcodeImage(dirIndex, stamp, thumbDir, frameWidth >> THUMB_SHIFT, frameHeight >> THUMB_SHIFT);
+  if (slot == CACHE_NONE) slot = CACHE_SKIP;  // Don't retry a failing file until the next mount
+
+  // The index may have changed while decoding, so look the image up again. After
+  // an album switch the copy is left for the old album to link when it's back.
+  takeSpiMutex();
+  if (album == albumGeneration) {
+    int32_t index = findImageByDirIndex(dirIndex);
+    if (index >= 0 && imageIndex[index].stamp == stamp) {
+      if (thumb) imageIndex[index].thumbSlot = slot;
+      else imageIndex[index].cacheSlot = slot;
+    } else if (thumb) {
+      removeThumbFile(slot);
+    } else {
+      removeCacheFile(slot);
+    }
+  }
+  giveSpiMutex();
+  return true;
+}
+
+// Raw image streaming
+// Raw .rgb files and the cached BMPs are streamed to the panel without decoding,
+// through a two-slot ring of sector-multiple buffers. Every chunk is one large
+// aligned read, and in DMA mode it goes out on the TFT bus while the next chunk
+// is read from the card. At most one DMA transfer is in flight, so two slots
+// are enough to never overwrite a buffer that is still being sent.
+#define RAW_RING_SLOTS 2
+#define RAW_CHUNK 4096  // Bytes per slot without DMA (8 sectors)
+
+// Stream width x height pixels from the file's current, sector-aligned
+// position into a window on the panel
+bool streamRawImage(SdBaseFile &file, int x, int y, int width, int height, bool panelOrder) {
+  uint8_t *ring[RAW_RING_SLOTS];
+  uint8_t *owned = nullptr;
+  size_t chunk = RAW_CHUNK;
+  bool useDma = false;
+
+#ifdef USE_TFT_DMA
+  if (dmaBuffer[1]) {  // Stream through the DMA buffers themselves
+    ring[0] = (uint8_t *)dmaBuffer[0];
+    ring[1] = (uint8_t *)dmaBuffer[1];
+    chunk = DMA_BUFFER_PIXELS * sizeof(uint16_t);
+    useDma = true;
+  }
+#endif
+  if (!useDma) {
+    owned = (uint8_t *)malloc(RAW_CHUNK * RAW_RING_SLOTS);
+    if (!owned) return false;
+    for (int i = 0; i < RAW_RING_SLOTS; i++) ring[i] = owned + i * RAW_CHUNK;
+  }
+
+  bool swap = tft.getSwapBytes();
+  tft.setSwapBytes(!panelOrder);
+  tft.startWrite();
+  tft.setAddrWindow(x, y, width, height);
+
+  uint32_t remaining = (uint32_t)width * height * sizeof(uint16_t);
+  bool ok = true;
+  for (int n = 0; remaining > 0; n = (n + 1) % RAW_RING_SLOTS) {
+    size_t bytes = min((uint32_t)chunk, remaining);
+    takeSpiMutex();
+    int got = sdRead(file, ring[n], bytes);
+    giveSpiMutex();
+    ok = got == (int)bytes;
+    if (!ok) break;
+    if (panelOrder) correctPanelPixels((uint16_t *)ring[n], bytes / 2);
+    else correctPixels((uint16_t *)ring[n], bytes / 2);
+    uint32_t start = micros();
+#ifdef USE_TFT_DMA
+    if (useDma) tft.pushPixelsDMA((uint16_t *)ring[n], bytes / 2);
+    else
+#endif
+    tft.pushPixels(ring[n], bytes / 2);
+    slidePushMicros += micros() - start;
+    remaining -= bytes;
+  }
+
+#ifdef USE_TFT_DMA
+  uint32_t start = micros();
+  if (useDma) tft.dmaWait();
+  slidePushMicros += micros() - start;
+#endif
+  tft.endWrite();
+  tft.setSwapBytes(swap);
+  free(owned);
+  return ok;
+}
+
+// Stream a .rgb image straight from the card
+bool showRawImage(uint16_t index) {
+  SdBaseFile file;
+
+  takeSpiMutex();
+  uint32_t start = micros();
+  bool ok = index < fileCount && openImageFile(file, index) &&
+            file.fileSize() == (uint32_t)frameWidth * frameHeight * sizeof(uint16_t);
+  slideOpenMicros += micros() - start;
+  giveSpiMutex();
+
+  if (ok) ok = streamRawImage(file, 0, 0, frameWidth, frameHeight, true);
+
+  if (file.isOpen()) {
+    takeSpiMutex();
+    file.close();
+    giveSpiMutex();
+  }
+  return ok;
+}
+
+// Read a .rgb image into a full frame (PSRAM prefetch), converting it to the
+// byte order JPEGDEC produces so every frame is pushed the same way
+bool readRawFrame(uint16_t index, uint32_t dirIndex, uint16_t *frame) {
+  SdBaseFile file;
+  uint32_t size = (uint32_t)frameWidth * frameHeight * sizeof(uint16_t);
+
+  takeSpiMutex();
+  bool ok = index < fileCount && imageIndex[index].dirIndex == dirIndex &&
+            openImageFile(file, index) && file.fileSize() == size;
+  giveSpiMutex();
+
+  for (uint32_t pos = 0; ok && pos < size; pos += RAW_CHUNK) {
+    size_t bytes = min((uint32_t)RAW_CHUNK, size - pos);
+    takeSpiMutex();
+    ok = sdRead(file, (uint8_t *)frame + pos, bytes) == (int)bytes;
+    giveSpiMutex();
+  }
+  if (ok) {
+    for (uint32_t i = 0; i < size / 2; i++) frame[i] = __builtin_bswap16(frame[i]);
+    correctPixels(frame, size / 2);
+  }
+
+  if (file.isOpen()) {
+    takeSpiMutex();
+    file.close();
+    giveSpiMutex();
+  }
+  return ok;
+}
+
+// Draw a cached copy centered on the panel, returns false if it is missing or stale
+bool showCachedImage(uint16_t cacheSlot, uint16_t stamp) {
+  SdBaseFile file;
+  int width = 0, height = 0;
+
+  takeSpiMutex();
+  uint32_t start = micros();
+  bool ok = openCacheFile(file, cacheSlot) && readCacheHeader(file, stamp, &width, &height);
+  slideOpenMicros += micros() - start;
+  giveSpiMutex();
+
+  if (ok) {
+    if (width < tft.width() || height < tft.height()) tft.fillScreen(TFT_BLACK);
+    ok = streamRawImage(file, (tft.width() - width) / 2, (tft.height() - height) / 2, width, height, false);
+  }
+
+  if (file.isOpen()) {
+    takeSpiMutex();
+    file.close();
+    giveSpiMutex();
+  }
+  return ok;
+}
+
+// Read a cached copy into a full frame (PSRAM prefetch)
+bool readCachedFrame(uint16_t cacheSlot, uint16_t stamp, uint16_t *frame, bool *fillsScreen) {
+  SdBaseFile file;
+  int width = 0, height = 0;
+
+  takeSpiMutex();
+  bool ok = openCacheFile(file, cacheSlot) && readCacheHeader(file, stamp, &width, &height);
+  giveSpiMutex();
+
+  if (ok) {
+    *fillsScreen = width == frameWidth && height == frameHeight;
+    if (!*fillsScreen) memset(frame, 0, frameWidth * frameHeight * sizeof(uint16_t));
+    uint16_t *dst = frame + ((frameHeight - height) / 2) * frameWidth + (frameWidth - width) / 2;
+    for (int y = 0; y < height && ok; y++, dst += frameWidth) {
+      takeSpiMutex();
+      ok = sdRead(file, dst, width * sizeof(uint16_t)) == (int)(width * sizeof(uint16_t));
+      giveSpiMutex();
+      correctPixels(dst, width);
+    }
+  }
+
+  if (file.isOpen()) {
+    takeSpiMutex();
+    file.close();
+    giveSpiMutex();
+  }
+  return ok;
+}
+
+// Draw the image opened in jpeg, scaled down to fit and centered on the panel
+void drawOpenedJpeg() {
+  int shift = jpegFitShift(jpeg.getWidth(), jpeg.getHeight());
+  int width = jpeg.getWidth() >> shift;
+  int height = jpeg.getHeight() >> shift;
+  int x = (tft.width() - width) / 2;
+  int y = (tft.height() - height) / 2;
+  bool bands = beginBandDraw(x, y, width, height);
+  if (!bands && (width < tft.width() || height < tft.height())) {
+    tft.fillScreen(TFT_BLACK);  // Clear screen if the image doesn't fill it
+  }
+  uint32_t start = micros();
+  beginJpegDraw();
+  jpeg.decode(x, y, jpegScaleOptions[shift]);
+  endJpegDraw();
+  slideDecodeMicros += micros() - start;
+  if (bands) endBandDraw(y + height);
+  jpeg.close();
+}
+
+// Decode-ahead pipeline
+// While a slide is on screen, a task on core 0 reads the next file into RAM and,
+// on boards with PSRAM, decodes it into a full frame. The slide change then does
+// no SD I/O, and with a decoded frame it is a single push to the panel. Two slots
+// let the next image load while the current one is still being shown.
+#define PREFETCH_SLOTS 2
+#define PREFETCH_CHUNK 8192                 // Bytes read per SD lock
+#define PREFETCH_MAX_INTERNAL (64 * 1024)   // Largest file buffered without PSRAM
+#define PREFETCH_HEAP_RESERVE (48 * 1024)   // Internal heap kept free for Wi-Fi and the web server
+
+enum PrefetchState : uint8_t { SLOT_FREE, SLOT_LOADING, SLOT_READY, SLOT_SHOWING };
+
+struct PrefetchSlot {
+  volatile PrefetchState state;
+  uint16_t index;        // Image index held by this slot
+  uint32_t dirIndex;     // Directory entry, to detect index changes since the read
+  uint32_t generation;   // prefetchGeneration when the read started
+  uint8_t *data;         // Raw JPEG file
+  uint32_t size;
+  uint32_t capacity;
+  uint16_t *frame;       // Decoded frame, PSRAM boards only
+  bool fillsScreen;
+};
+
+PrefetchSlot prefetchSlots[PREFETCH_SLOTS];
+QueueHandle_t prefetchQueue = NULL;
+portMUX_TYPE prefetchMux = portMUX_INITIALIZER_UNLOCKED;
+volatile uint32_t prefetchGeneration = 0;
+uint16_t *aheadFrame = nullptr;  // Frame jpegAhead is drawing into
+
+// JPEGDEC callback for the prefetch task, copies each block into aheadFrame
+int JPEGDrawToFrame(JPEGDRAW *pDraw) {
+  int x0 = max(pDraw->x, 0);
+  int x1 = min(pDraw->x + pDraw->iWidth, (int)frameWidth);
+  if (x1 <= x0) return 1;
+
+  correctPixels(pDraw->pPixels, pDraw->iWidth * pDraw->iHeight);
+  for (int row = 0; row < pDraw->iHeight; row++) {
+    int y = pDraw->y + row;
+    if (y < 0 || y >= frameHeight) continue;
+    memcpy(&aheadFrame[y * frameWidth + x0], &pDraw->pPixels[row * pDraw->iWidth + (x0 - pDraw->x)],
+           (x1 - x0) * sizeof(uint16_t));
+  }
+  return 1;
+}
+
+// Make sure a slot can hold a file of the given size
+bool reserveSlotBuffer(PrefetchSlot *slot, uint32_t size) {
+  if (slot->frame) {  // PSRAM: keep one growing buffer per slot
+    if (size <= slot->capacity) return true;
+    uint8_t *grown = (uint8_t *)ps_realloc(slot->data, size);
+    if (!grown) return false;
+    slot->data = grown;
+    slot->capacity = size;
+    return true;
+  }
+
+  // Internal RAM: only small files, and only while the heap has room to spare
+  if (size > PREFETCH_MAX_INTERNAL) return false;
+  if (esp_get_free_heap_size() < size + PREFETCH_HEAP_RESERVE) return false;
+  if (heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) < size) return false;
+  slot->data = (uint8_t *)malloc(size);
+  slot->capacity = slot->data ? size : 0;
+  return slot->data != nullptr;
+}
+
+// Hand a slot back, freeing its buffer unless it lives in PSRAM
+void releasePrefetchSlot(PrefetchSlot *slot) {
+  if (!slot->frame && slot->data) {
+    free(slot->data);
+    slot->data = nullptr;
+    slot->capacity = 0;
+  }
+  slot->state = SLOT_FREE;
+}
+
+// Pick a slot for the requested image, or nullptr if it is already loaded
+PrefetchSlot *claimPrefetchSlot(uint16_t index) {
+  PrefetchSlot *claimed = nullptr;
+  portENTER_CRITICAL(&prefetchMux);
+  for (int i = 0; i < PREFETCH_SLOTS; i++) {
+    PrefetchSlot *slot = &prefetchSlots[i];
+    if (slot->state == SLOT_READY && slot->index == index && slot->generation == prefetchGeneration) {
+      portEXIT_CRITICAL(&prefetchMux);
+      return nullptr;
+    }
+  }
+  for (int i = 0; i < PREFETCH_SLOTS && !claimed; i++) {
+    if (prefetchSlots[i].state == SLOT_FREE) claimed = &prefetchSlots[i];
+  }
+  for (int i = 0; i < PREFETCH_SLOTS && !claimed; i++) {
+    if (prefetchSlots[i].state == SLOT_READY) claimed = &prefetchSlots[i];  // Reuse a stale slot
+  }
+  if (claimed) {
+    claimed->state = SLOT_LOADING;
+    claimed->generation = prefetchGeneration;
+  }
+  portEXIT_CRITICAL(&prefetchMux);
+  return claimed;
+}
+
+// Read (and where possible decode) one image into a claimed slot
+void fillPrefetchSlot(PrefetchSlot *slot, uint16_t index) {
+  SdBaseFile file;
+  uint32_t size = 0;
+  uint16_t cacheSlot = CACHE_NONE;
+  uint16_t stamp = 0;
+  bool raw = false;
+
+  takeSpiMutex();
+  bool ok = index < fileCount;
+  if (ok) {
+    slot->dirIndex = imageIndex[index].dirIndex;
+    cacheSlot = imageIndex[index].cacheSlot;
+    stamp = imageIndex[index].stamp;
+    raw = isRawImageFile(imageName(index));
+  }
+  giveSpiMutex();
+
+  // Raw images are already streamed at full speed, they are only worth
+  // prefetching into a frame
+  if (ok && raw) {
+    if (slot->frame && readRawFrame(index, slot->dirIndex, slot->frame)) {
+      slot->index = index;
+      slot->size = 0;
+      slot->fillsScreen = true;
+      slot->state = SLOT_READY;
+    } else {
+      releasePrefetchSlot(slot);
+    }
+    return;
+  }
+
+  // With a frame to fill, a pre-scaled copy is much less to read than the original
+  if (ok && slot->frame && cacheSlot < CACHE_SKIP &&
+      readCachedFrame(cacheSlot, stamp, slot->frame, &slot->fillsScreen)) {
+    slot->index = index;
+    slot->size = 0;
+    slot->state = SLOT_READY;
+    return;
+  }
+
+  takeSpiMutex();
+  ok = ok && index < fileCount && imageIndex[index].dirIndex == slot->dirIndex && openImageFile(file, index);
+  if (ok) size = file.fileSize();
+  giveSpiMutex();
+
+  if (ok && !reserveSlotBuffer(slot, size)) ok = false;
+
+  // Read in chunks so uploads and the web server get the card in between
+  uint32_t pos = 0;
+  while (ok && pos < size) {
+    takeSpiMutex();
+    int32_t n = sdRead(file, slot->data + pos, min((uint32_t)PREFETCH_CHUNK, size - pos));
+    giveSpiMutex();
+    if (n <= 0) ok = false;
+    else pos += n;
+  }
+
+  if (file.isOpen()) {
+    takeSpiMutex();
+    file.close();
+    giveSpiMutex();
+  }
+
+  if (!ok) {
+    releasePrefetchSlot(slot);
+    return;
+  }
+  slot->index = index;
+  slot->size = size;
+
+  if (slot->frame && jpegAhead->openRAM(slot->data, size, JPEGDrawToFrame)) {
+    int shift = jpegFitShift(jpegAhead->getWidth(), jpegAhead->getHeight());
+    int width = jpegAhead->getWidth() >> shift;
+    int height = jpegAhead->getHeight() >> shift;
+    slot->fillsScreen = width >= frameWidth && height >= frameHeight;
+    if (!slot->fillsScreen) memset(slot->frame, 0, frameWidth * frameHeight * sizeof(uint16_t));
+    aheadFrame = slot->frame;
+    jpegAhead->decode((frameWidth - width) / 2, (frameHeight - height) / 2, jpegScaleOptions[shift]);
+    jpegAhead->close();
+  } else if (slot->frame) {
+    releasePrefetchSlot(slot);
+    return;
+  }
+  slot->state = SLOT_READY;
+}
+
+// FreeRTOS task on core 0 that services prefetch requests, and fills the
+// pre-scaled cache whenever no prefetch is waiting
+void prefetchTask(void *parameter) {
+  uint16_t index;
+  while (true) {
+    // Keep the card quiet for the benchmark, and the CPU for an update
+    bool transcode = cacheWorkPending && sdMounted && !benchRunning && !otaRunning;
+    TickType_t wait = transcode ? 0 : pdMS_TO_TICKS(1000);
+    if (xQueueReceive(prefetchQueue, &index, wait) == pdTRUE) {
+      PrefetchSlot *slot = claimPrefetchSlot(index);
+      if (slot) fillPrefetchSlot(slot, index);
+    } else if (transcode && !transcodeNextImage()) {
+      cacheWorkPending = false;
+    }
+  }
+}
+
+// Ask the prefetch task to load an image, replacing any pending request
+void prefetchImage(uint16_t index) {
+  if (prefetchQueue) xQueueOverwrite(prefetchQueue, &index);
+}
+
+// Drop prefetched images after the files on the card have changed
+void invalidatePrefetch() {
+  prefetchGeneration++;
+  for (int i = 0; i < PREFETCH_SLOTS; i++) {
+    PrefetchSlot *slot = &prefetchSlots[i];
+    bool stale = false;
+    portENTER_CRITICAL(&prefetchMux);
+    if (slot->state == SLOT_READY) {
+      slot->state = SLOT_LOADING;
+      stale = true;
+    }
+    portEXIT_CRITICAL(&prefetchMux);
+    if (stale) releasePrefetchSlot(slot);
+  }
+}
+
+// Show an image from the pipeline, returns false if it was not prefetched
+bool showPrefetched(uint16_t index, uint32_t dirIndex) {
+  PrefetchSlot *slot = nullptr;
+  portENTER_CRITICAL(&prefetchMux);
+  for (int i = 0; i < PREFETCH_SLOTS; i++) {
+    PrefetchSlot *candidate = &prefetchSlots[i];
+    if (candidate->state == SLOT_READY && candidate->index == index &&
+        candidate->dirIndex == dirIndex && candidate->generation == prefetchGeneration) {
+      candidate->state = SLOT_SHOWING;
+      slot = candidate;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&prefetchMux);
+  if (!slot) return false;
+
+  bool shown = true;
+  if (slot->frame && activeTransition == TRANSITION_WIPE) {
+    wipeFrame(slot->frame);
+  } else if (slot->frame && activeTransition == TRANSITION_SLIDE) {
+    slideInFrame(slot->frame);
+  } else if (slot->frame) {
+    uint32_t start = micros();
+    tft.pushImage(0, 0, frameWidth, frameHeight, slot->frame);
+    slidePushMicros += micros() - start;
+  } else if (jpeg.openRAM(slot->data, slot->size, JPEGDraw)) {
+    drawOpenedJpeg();
+  } else {
+    shown = false;
+  }
+  releasePrefetchSlot(slot);
+  return shown;
+}
+
+// Allocate the pipeline buffers and start the prefetch task
+void startPrefetchTask() {
+  jpegAhead = new JPEGDEC();
+  if (psramFound()) {
+    for (int i = 0; i < PREFETCH_SLOTS; i++) {
+      prefetchSlots[i].frame = (uint16_t *)ps_malloc(frameWidth * frameHeight * sizeof(uint16_t));
+      if (!prefetchSlots[i].frame) {
+        Serial.println("PSRAM frame allocation failed, prefetching files only");
+        for (int j = 0; j < i; j++) {
+          free(prefetchSlots[j].frame);
+          prefetchSlots[j].frame = nullptr;
+        }
+        break;
+      }
+    }
+  }
+
+  prefetchQueue = xQueueCreate(1, sizeof(uint16_t));
+  xTaskCreatePinnedToCore(
+    prefetchTask,     // Function to implement the task
+    "prefetchTask",   // Name of the task
+    8192,             // Stack size in words
+    NULL,             // Task input parameter
+    1,                // Priority of the task
+    NULL,             // Task handle
+    0                 // Core where the task should run
+  );
+  Serial.printf("Prefetch pipeline started (%s).\n", prefetchSlots[0].frame ? "decoded frames in PSRAM" : "file buffers");
+}
+
+// Playback order
+// Sequential walks the index. Shuffle shows every image once per cycle, in a
+// permutation of the index (two bytes per image) drawn with Fisher-Yates and
+// drawn again at the end of each cycle; uploads are slotted in among the
+// images still to come and deletes taken out, so a cycle survives index
+// changes. Recent draws each slide at random, with rejection sampling that
+// weights images by how close their modify date is to the newest one, so new
+// uploads come round up to ORDER_RECENT_WEIGHT times as often. Each advance is
+// O(1) apart from the reshuffle once per cycle. All of it is guarded by
+// xSpiMutex, with the index.
+enum PlayOrder : uint8_t { ORDER_SEQUENTIAL, ORDER_SHUFFLE, ORDER_RECENT, ORDER_COUNT };
+const char *const playOrderNames[ORDER_COUNT] = {"sequential", "shuffle", "recent"};
+#define ORDER_RECENT_WEIGHT 4  // Weight of the newest images, older ones go down to 1
+#define ORDER_RECENT_DAYS 30   // Age at which the weight is down to 1
+#define ORDER_RECENT_TRIES 16  // Draws before taking whatever came up
+
+PlayOrder playOrder = ORDER_SEQUENTIAL;  // Chosen on /speed, kept in NVS
+uint16_t *shuffleOrder = nullptr;        // This cycle's permutation of the index
+uint16_t shuffleCapacity = 0;
+int32_t shufflePosition = -1;            // Position of the slide on show, -1 before the first
+bool shuffleValid = false;
+int32_t recentNext = -1;                 // Slide drawn to come next, so it can be prefetched
+int32_t recentLast = -1;                 // Slide before the one on show, for previous
+
+// Forget the orders after the whole index changed
+void playOrderReset() {
+  shuffleValid = false;
+  recentNext = recentLast = -1;
+}
+
+// Make room in shuffleOrder for the whole index
+bool reserveShuffleOrder() {
+  if (fileCount <= shuffleCapacity) return true;
+  uint16_t *grown = (uint16_t *)realloc(shuffleOrder, imageCapacity * sizeof(uint16_t));
+  if (!grown) return false;
+  shuffleOrder = grown;
+  shuffleCapacity = imageCapacity;
+  return true;
+}
+
+// Start a new cycle, which doesn't open with the slide on show
+void shuffleCycle() {
+  for (int32_t i = fileCount - 1; i > 0; i--) {
+    int32_t j = random(i + 1);
+    uint16_t swapped = shuffleOrder[i];
+    shuffleOrder[i] = shuffleOrder[j];
+    shuffleOrder[j] = swapped;
+  }
+  if (fileCount > 1 && shuffleOrder[0] == currentIndex) {
+    int32_t j = 1 + random(fileCount - 1);
+    shuffleOrder[0] = shuffleOrder[j];
+    shuffleOrder[j] = currentIndex;
+  }
+  shufflePosition = -1;
+}
+
+bool ensureShuffleOrder() {
+  if (shuffleValid) return true;
+  if (!reserveShuffleOrder()) return false;
+  for (uint16_t i = 0; i < fileCount; i++) shuffleOrder[i] = i;
+  shuffleCycle();
+  shuffleValid = true;
+  return true;
+}
+
+// An image was appended to the index at index
+void playOrderAdded(uint16_t index) {
+  recentNext = -1;
+  if (!shuffleValid) return;
+  if (!reserveShuffleOrder()) {
+    shuffleValid = false;
+    return;
+  }
+  // Somewhere among the slides still to come this cycle
+  int32_t slot = shufflePosition + 1 + random(index - shufflePosition);
+  shuffleOrder[index] = shuffleOrder[slot];
+  shuffleOrder[slot] = index;
+}
+
+// The image at index was taken out of the index, the ones after it moved down
+void playOrderRemoved(uint16_t index) {
+  recentNext = -1;
+  if (recentLast == index) recentLast = -1;
+  else if (recentLast > index) recentLast--;
+  if (!shuffleValid) return;
+  uint16_t at = 0;
+  for (uint16_t i = 0; i <= fileCount; i++) {  // fileCount is already one down
+    if (shuffleOrder[i] == index) at = i;
+    else if (shuffleOrder[i] > index) shuffleOrder[i]--;
+  }
+  memmove(&shuffleOrder[at], &shuffleOrder[at + 1], (fileCount - at) * sizeof(uint16_t));
+  if (at <= shufflePosition) shufflePosition--;
+}
+
+// A FAT date as a day number, near enough for ages of a few months
+int32_t fatDays(uint16_t date) {
+  return (date >> 9) * 372 + ((date >> 5) & 15) * 31 + (date & 31);
+}
+
+// Keep an image with probability weight / ORDER_RECENT_WEIGHT, where the
+// weight falls from ORDER_RECENT_WEIGHT for the newest to 1 at ORDER_RECENT_DAYS
+bool keepRecentDraw(uint16_t index) {
+  int32_t age = constrain(fatDays(newestImageDate) - fatDays(imageIndex[index].date), 0, ORDER_RECENT_DAYS);
+  int32_t weight = ORDER_RECENT_DAYS + (ORDER_RECENT_WEIGHT - 1) * (ORDER_RECENT_DAYS - age);
+  return random(ORDER_RECENT_WEIGHT * ORDER_RECENT_DAYS) < weight;
+}
+
+// Draw the slide to follow the one on show, not repeating it or the one before
+uint16_t drawRecentSlide() {
+  uint16_t pick = 0;
+  for (int tries = 0; tries < ORDER_RECENT_TRIES; tries++) {
+    pick = random(fileCount);
+    if (fileCount > 1 && pick == currentIndex) continue;
+    if (fileCount > 2 && pick == recentLast) continue;
+    if (keepRecentDraw(pick)) break;
+  }
+  if (fileCount > 1 && pick == currentIndex) pick = (pick + 1) % fileCount;
+  return pick;
+}
+
+// Move currentIndex one slide on (step > 0) or back in the chosen order
+void advanceSlide(int8_t step) {
+  uint16_t count = fileCount;
+  if (count == 0) return;
+  if (playOrder == ORDER_SHUFFLE && ensureShuffleOrder()) {
+    if (step < 0) {
+      shufflePosition = shufflePosition > 0 ? shufflePosition - 1 : count - 1;
+    } else if (++shufflePosition >= count) {
+      shuffleCycle();
+      shufflePosition = 0;
+    }
+    currentIndex = shuffleOrder[shufflePosition];
+    return;
+  }
+  if (playOrder == ORDER_RECENT) {
+    if (step < 0 && recentLast >= 0) {
+      recentNext = currentIndex;  // Forward again comes back here
+      currentIndex = recentLast;
+      recentLast = -1;
+      return;
+    }
+    uint16_t next = recentNext >= 0 ? recentNext : drawRecentSlide();
+    recentLast = currentIndex;
+    currentIndex = next;
+    recentNext = drawRecentSlide();
+    return;
+  }
+  currentIndex = (currentIndex + (step < 0 ? count - 1 : 1)) % count;
+}
+
+// The slide that comes after the one on show, -1 if it isn't known yet
+int32_t upcomingSlide() {
+  if (fileCount == 0) return -1;
+  if (playOrder == ORDER_SHUFFLE && ensureShuffleOrder()) {
+    return shufflePosition + 1 < fileCount ? shuffleOrder[shufflePosition + 1] : -1;
+  }
+  if (playOrder == ORDER_RECENT) {
+    if (recentNext < 0) recentNext = drawRecentSlide();
+    return recentNext;
+  }
+  return (currentIndex + 1) % fileCount;
+}
+
+// Start reading the slide that comes next while this one is on screen
+void prefetchNextSlide() {
+  takeSpiMutex();
+  int32_t next = upcomingSlide();
+  giveSpiMutex();
+  if (next >= 0) prefetchImage(next);
+}
+
+void setPlayOrder(PlayOrder order) {
+  if (order >= ORDER_COUNT || order == playOrder) return;
+  takeSpiMutex();
+  playOrder = order;
+  playOrderReset();
+  giveSpiMutex();
+  prefs.putUChar("order", order);
+  Serial.printf("Playback order set to %s\n", playOrderNames[order]);
+  prefetchNextSlide();
+}
+
+// Order by its name on the web page, ORDER_COUNT if unknown
+PlayOrder playOrderByName(const char *name) {
+  for (int i = 0; i < ORDER_COUNT; i++) {
+    if (strcmp(name, playOrderNames[i]) == 0) return (PlayOrder)i;
+  }
+  return ORDER_COUNT;
+}
+
+// Albums
+// A switch is asked for from the web server or the WebSocket and carried out by
+// loop(), which holds xSpiMutex through it: the index and cache folders change
+// together, and with a saved index that is current it only takes a few reads.
+#define ALBUM_LIST_LIMIT 100
+
+char albumRequest[ALBUM_NAME_MAX + 1];  // Set by loop() from CMD_ALBUM
+bool albumRequested = false;
+
+// Album folders are the visible folders directly under the card's root
+bool isAlbumName(const char *name) {
+  return name[0] && name[0] != '.' && strlen(name) <= ALBUM_NAME_MAX && !strchr(name, '/') &&
+         strcasecmp(name, "System Volume Information") != 0;
+}
+
+// Name of the album on show, "" for the root folder
+const char *albumName() {
+  return albumPath + 1;
+}
+
+// Make the folder at path the album on show: save the old album's index if it
+// has changes, then load or build the new one and link its copies. Leaves the
+// old album in place if the folder can't be opened. Called with xSpiMutex held.
+bool openAlbum(const char *path) {
+  SdBaseFile probe;
+  if (!probe.open(path, O_RDONLY) || !probe.isDir()) return false;
+  probe.close();
+
+  if (indexChanged && albumDir.isOpen()) writeImageIndex();
+  albumDir.close();
+  strlcpy(albumPath, path, sizeof(albumPath));
+  if (!albumDir.open(albumPath, O_RDONLY)) return false;
+  openCacheDir(cacheDir, CACHE_DIR);
+  openCacheDir(thumbDir, THUMB_DIR);
+
+  albumGeneration++;
+  imageIndexGeneration++;
+  invalidatePrefetch();
+  fileCount = 0;
+  imageNamesUsed = 0;
+  newestImageDate = 0;
+  playOrderReset();
+  currentIndex = 0;
+  currentImageName = "";
+  if (!loadImageIndex()) {
+    buildImageIndex();
+    markIndexChanged();  // Saved from loop() once the slideshow is going
+  }
+  linkImageCache();
+  Serial.printf("Album %s: %u images\n", albumPath, fileCount);
+  return true;
+}
+
+// Ask loop() to switch to an album by name, "" for the root folder
+bool requestAlbum(const char *name) {
+  if (name[0] && !isAlbumName(name)) return false;
+  return postFrameCommand(CMD_ALBUM, 0, name);
+}
+
+// Carry out a requested switch and show the new album's first image
+void switchAlbum() {
+  takeSpiMutex();
+  albumRequested = false;
+  char path[ALBUM_NAME_MAX + 2];
+  snprintf(path, sizeof(path), "/%s", albumRequest);
+  bool same = strcmp(path, albumPath) == 0;
+  bool ok = same || openAlbum(path);
+  giveSpiMutex();
+  if (same) return;
+  if (!ok) {
+    Serial.printf("Album %s not found\n", path);
+    return;
+  }
+
+  prefs.putString("album", albumName());
+  if (fileCount > 0) {
+    loadImage(0);
+  } else {
+    error("No .JPG or .RGB images in this album");
+    updateSlideInfo(0);
+    sendSlideState(nullptr);
+  }
+  timer = millis();
+}
+
+// Function to load and display an image
+void loadImage(uint16_t targetIndex) {
+  if (!slideshowActive || fileCount == 0) return;
+
+  setCpuBusy(true);  // Back down once loop() goes idle
+  uint32_t start = micros();
+  takeSpiMutex();  // The index may be patched by the web server
+  if (fileCount == 0) {
+    giveSpiMutex();
+    return;
+  }
+  if (targetIndex >= fileCount) targetIndex = 0;
+  currentImageName = String(imageName(targetIndex));  // Set current image name
+  uint32_t dirIndex = imageIndex[targetIndex].dirIndex;
+  uint16_t cacheSlot = imageIndex[targetIndex].cacheSlot;
+  uint16_t stamp = imageIndex[targetIndex].stamp;
+  bool raw = isRawImageFile(imageName(targetIndex));
+  giveSpiMutex();
+  metrics.slideLookup.record(micros() - start);
+  slideOpenMicros = slideDecodeMicros = slidePushMicros = 0;
+
+  // Use the prefetched copy when there is one, then the pre-scaled cache,
+  // otherwise decode the original from the card
+  Transition style = transition;
+  if (style == TRANSITION_FADE && backlightShown == 0) style = TRANSITION_NONE;  // The display is off for the night
+  if (style == TRANSITION_FADE) fadeBacklight(0);
+  activeTransition = style;
+  slideAbortOnInput = true;
+  if (raw) {
+    if (!showPrefetched(targetIndex, dirIndex)) showRawImage(targetIndex);
+  } else if (!showPrefetched(targetIndex, dirIndex)) {
+    if (cacheSlot < CACHE_SKIP && !showCachedImage(cacheSlot, stamp)) {
+      takeSpiMutex();
+      if (targetIndex < fileCount && imageIndex[targetIndex].dirIndex == dirIndex) {
+        imageIndex[targetIndex].cacheSlot = CACHE_NONE;  // Stale copy, transcode it again
+        cacheWorkPending = true;
+      }
+      giveSpiMutex();
+      cacheSlot = CACHE_NONE;
+    }
+    if (cacheSlot >= CACHE_SKIP) decodeJpeg(targetIndex);
+  }
+  slideAbortOnInput = false;
+  activeTransition = TRANSITION_NONE;
+  if (style == TRANSITION_FADE) fadeBacklight(backlightLevel);
+
+  if (slideOpenMicros) metrics.slideOpen.record(slideOpenMicros);
+  if (slideDecodeMicros) metrics.slideDecode.record(slideDecodeMicros - min(slidePushMicros, slideDecodeMicros));
+  metrics.slidePush.record(slidePushMicros);
+
+  // Tell WebSocket clients what is on screen now
+  updateSlideInfo(targetIndex);
+  sendSlideState(nullptr);
+
+  prefetchNextSlide();
+}
+
+void decodeJpeg(uint16_t index) {
+  if (!slideshowActive) return;
+
+  takeSpiMutex();  // Lock SPI access for SD card
+  uint32_t start = micros();
+  bool opened = index < fileCount && openImageFile(jpgFile, index);
+  slideOpenMicros += micros() - start;
+  giveSpiMutex();  // Unlock SPI access
+  if (!opened) {
+    Serial.printf("Can't open %s\n", currentImageName.c_str());
+    return;
+  }
+
+  if (jpeg.open(&jpgFile, jpgFile.fileSize(), myClose, myRead, mySeek, JPEGDraw)) {
+    drawOpenedJpeg();
+  } else {
+    Serial.printf("Can't decode %s (error %d)\n", currentImageName.c_str(), jpeg.getLastError());
+    myClose(&jpgFile);
+  }
+}
+
+// Error handling function
+void error(const char* msg) {
+  tft.fillScreen(TFT_BLACK);
+  tft.setCursor(0, 0);
+  tft.setTextColor(TFT_WHITE);
+  tft.setTextSize(2);
+  tft.println(msg);
+  Serial.println(msg);  // Also print to Serial for debugging
+  
+}
+
+// Read the first sectors twice and compare them, then time a longer run of
+// reads. Catches clocks the card or wiring can't keep up with even when the
+// card accepted the mount.
+bool probeSdCard() {
+  uint8_t *buffer = (uint8_t *)malloc(2 * SD_PROBE_SECTORS * 512);
+  if (!buffer) return true;  // Can't probe, trust the mount
+  uint8_t *second = buffer + SD_PROBE_SECTORS * 512;
+
+  SdCard *card = sd.card();
+  bool ok = card->readSectors(0, buffer, SD_PROBE_SECTORS) &&
+            card->readSectors(0, second, SD_PROBE_SECTORS) &&
+            memcmp(buffer, second, SD_PROBE_SECTORS * 512) == 0;
+
+  if (ok) {
+    const int runs = 16;
+    uint32_t start = micros();
+    for (int i = 0; i < runs && ok; i++) {
+      ok = card->readSectors(i * SD_PROBE_SECTORS, buffer, SD_PROBE_SECTORS);
+    }
+    uint32_t elapsed = micros() - start;
+    if (elapsed == 0) elapsed = 1;
+    sdReadKBps = (uint64_t)runs * SD_PROBE_SECTORS * 512 * 1000000 / 1024 / elapsed;
+  }
+  free(buffer);
+  return ok;
+}
+
+// Mount at the fastest clock that passes the probe, starting from the last good one
+bool mountSdCard() {
+  for (uint8_t step = sdSpeedStep; step < sizeof(sdSpeedsMHz); step++) {
+    SdSpiConfig config(SD_CS, DEDICATED_SPI, SD_SCK_MHZ(sdSpeedsMHz[step]), &sdSpi);
+    if (sd.begin(config) && probeSdCard()) {
+      sdSpeedStep = step;
+      sdSpiMHz = sdSpeedsMHz[step];
+      sdReadErrors = 0;
+      Serial.printf("SD card running at %u MHz, %u KB/s raw read\n", sdSpiMHz, sdReadKBps);
+      return true;
+    }
+    Serial.printf("SD card failed at %u MHz (error 0x%02X)\n", sdSpeedsMHz[step], sd.sdErrorCode());
+    sd.end();
+  }
+  sdSpiMHz = 0;
+  return false;
+}
+
+// Function to check and mount SD card if not already mounted
+bool checkAndMountSDCard() {
+  if (!sdMounted) {  // Only try to mount if it's not already mounted
+    // Try to remount the SD card
+    if (!mountSdCard()) {
+      Serial.println("SD Card Mount Failed");
+      sdMounted = false;
+      return false;
+    } else {
+      sdMounted = true;  // Successfully mounted SD card
+      Serial.println("SD Card Mounted Successfully");
+    }
+  }
+  return true;
+}
+
+// Remount at the clock of sdSpeedStep and reopen the directories, called with
+// xSpiMutex held
+void remountSdCard() {
+  albumDir.close();
+  cacheDir.close();
+  thumbDir.close();
+  sd.end();
+  sdMounted = false;
+  if (checkAndMountSDCard()) {
+    albumDir.open(albumPath, O_RDONLY);
+    cacheDir.open(&albumDir, CACHE_DIR, O_RDONLY);
+    thumbDir.open(&albumDir, THUMB_DIR, O_RDONLY);
+  }
+}
+
+// SD health
+// Card errors (failed reads, seeks and opens, and reads past SD_READ_TIMEOUT_MS)
+// add up in sdReadErrors. At SD_ERROR_LIMIT loop() remounts the card one clock
+// step slower, or at the slowest clock again, since a reseated card only
+// answers after a fresh init. A card that doesn't come back is lost: the slide
+// stays on screen, the slideshow, transcodes and card-backed web requests wait,
+// and loop() tries to mount it again after a delay that doubles from
+// SD_RETRY_MIN_MS up to SD_RETRY_MAX_MS.
+uint32_t sdRetryDelay = SD_RETRY_MIN_MS;
+uint32_t sdRetryAt = 0;
+
+void scheduleSdRetry() {
+  sdRetryAt = millis() + sdRetryDelay;
+  Serial.printf("SD card lost, retrying in %lu s\n", (unsigned long)(sdRetryDelay / 1000));
+  sdRetryDelay = min(sdRetryDelay * 2, (uint32_t)SD_RETRY_MAX_MS);
+}
+
+bool sdRetryDue() {
+  return !sdMounted && (int32_t)(millis() - sdRetryAt) >= 0;
+}
+
+// Reindex the album on show after a remount. The card may have been swapped or
+// written elsewhere meanwhile, so changes not saved yet are dropped and the
+// saved index is only used if it still matches the folder. The slide on screen
+// stays up if it's still in the album, otherwise the first one is shown.
+void reopenAlbum() {
+  takeSpiMutex();
+  String shown = currentImageName;
+  char path[sizeof(albumPath)];
+  strlcpy(path, albumPath, sizeof(path));
+  indexChanged = false;
+  albumDir.close();
+  if (!openAlbum(path)) openAlbum("/");
+  int32_t index = shown.length() > 0 ? findImageEntry(shown.c_str()) : -1;
+  if (index >= 0) {
+    currentIndex = index;
+    currentImageName = shown;
+  }
+  giveSpiMutex();
+
+  if (!prefetchQueue) startPrefetchTask();  // The card was missing at boot
+  if (index >= 0) {
+    updateSlideInfo(index);
+  } else if (fileCount > 0) {
+    loadImage(currentIndex);
+  } else {
+    error("No .JPG or .RGB images found");
+    updateSlideInfo(0);
+  }
+  sendSlideState(nullptr);
+  timer = millis();
+}
+
+// Remount after SD_ERROR_LIMIT errors, from loop()
+void recoverSdCard() {
+  takeSpiMutex();
+  Serial.printf("%u SD errors at %u MHz, remounting\n", sdReadErrors, sdSpiMHz);
+  if (sdSpeedStep + 1 < sizeof(sdSpeedsMHz)) sdSpeedStep++;
+  remountSdCard();
+  sdReadErrors = 0;
+  metrics.sdRemountsTotal++;
+  giveSpiMutex();
+  if (sdMounted) reopenAlbum();
+  else scheduleSdRetry();
+}
+
+// Mount a lost card again, from the fastest clock since it may be another card
+void retrySdCard() {
+  takeSpiMutex();
+  sdSpeedStep = 0;
+  bool mounted = checkAndMountSDCard();
+  if (!mounted) metrics.sdMountFailuresTotal++;
+  giveSpiMutex();
+  if (!mounted) {
+    scheduleSdRetry();
+    return;
+  }
+  sdRetryDelay = SD_RETRY_MIN_MS;
+  checkMusicFile();
+  reopenAlbum();
+}
+
+// Audio playback runs beside the slideshow. Its task reads ahead into an
+// AudioFileSourceBuffer and takes xSpiMutex for at most AUDIO_READ_CHUNK bytes
+// at a time. Every other SD user also locks per bounded chunk, and the audio
+// task runs at a higher priority, so mutex priority inheritance pushes the
+// current holder through its chunk and neither side starves.
+#define AUDIO_BUFFER_SIZE (16 * 1024)  // About 180 ms of 44.1 kHz mono
+#define AUDIO_READ_CHUNK 2048          // Bytes read per SD lock
+#define AUDIO_TASK_PRIORITY 2          // Above loop() and the prefetch task
+
+volatile bool audioPlaying = false;
+
+// AudioFileSource on top of the mounted SdFat volume, so playback shares the
+// card with the slideshow under xSpiMutex instead of remounting it with the
+// SD library
+class AudioFileSourceSdFat : public AudioFileSource {
+  public:
+    AudioFileSourceSdFat(const char *filename) { open(filename); }
+    virtual ~AudioFileSourceSdFat() override { close(); }
+
+    virtual bool open(const char *filename) override {
+      takeSpiMutex();
+      bool ok = audioFile.open(filename, O_RDONLY);
+      giveSpiMutex();
+      return ok;
+    }
+
+    virtual uint32_t read(void *data, uint32_t len) override {
+      uint32_t total = 0;
+      while (total < len) {
+        uint32_t want = min(len - total, (uint32_t)AUDIO_READ_CHUNK);
+        takeSpiMutex();
+        int n = sdRead(audioFile, (uint8_t *)data + total, want);
+        giveSpiMutex();
+        if (n < 0) break;
+        total += n;
+        if ((uint32_t)n < want) break;  // End of file
+      }
+      return total;
+    }
+
+    virtual bool seek(int32_t pos, int dir) override {
+      takeSpiMutex();
+      if (dir == SEEK_CUR) pos += audioFile.curPosition();
+      else if (dir == SEEK_END) pos += audioFile.fileSize();
+      bool ok = pos >= 0 && audioFile.seekSet(pos);
+      giveSpiMutex();
+      return ok;
+    }
+
+    virtual bool close() override {
+      if (!audioFile.isOpen()) return true;
+      takeSpiMutex();
+      audioFile.close();
+      giveSpiMutex();
+      return true;
+    }
+
+    virtual bool isOpen() override { return audioFile.isOpen(); }
+    virtual uint32_t getSize() override { return audioFile.fileSize(); }
+    virtual uint32_t getPos() override { return audioFile.curPosition(); }
+
+  private:
+    SdBaseFile audioFile;
+};
+
+// Play the WAV file (always "music.wav") from the shared SdFat volume
+void playWAV() {
+  Serial.printf("Free heap before playback: %d bytes\n", esp_get_free_heap_size());
+
+  // Open WAV file from SD card, reading ahead so SD contention doesn't stall the DAC
+  file = new AudioFileSourceSdFat("/music.wav");
+  AudioFileSourceBuffer *buffer = new AudioFileSourceBuffer(file, AUDIO_BUFFER_SIZE);
+  wav = new AudioGeneratorWAV();
+
+  if (file->isOpen() && wav->begin(buffer, out)) {
+    Serial.println("Started playing WAV file");
+  } else {
+    Serial.println("Failed to start WAV playback");
+    // Clean up
+    wav->stop();
+    delete wav;
+    delete buffer;
+    delete file;
+    return;
+  }
+
+  // Play the WAV file to completion
+  while (wav->isRunning()) {
+    if (!wav->loop()) {
+      wav->stop();
+      Serial.println("WAV playback finished");
+    }
+    delay(1);  // Yield to other tasks
+  }
+
+  // Clean up
+  wav->stop();
+  delete wav;
+  delete buffer;
+  delete file;
+
+  Serial.printf("Free heap after playback: %d bytes\n", esp_get_free_heap_size());
+}
+
+// FreeRTOS task for WAV playback
+void playWAVTask(void * parameter) {
+  playWAV();
+  audioPlaying = false;
+  vTaskDelete(NULL);   // Delete this task when done
+}
+
+// Start music.wav in the background unless it is already playing
+void startAudioPlayback() {
+  if (audioPlaying) return;
+  audioPlaying = true;
+  xTaskCreatePinnedToCore(
+    playWAVTask,          // Function to implement the task
+    "playWAVTask",        // Name of the task
+    8192,                 // Stack size in words
+    NULL,                 // Task input parameter
+    AUDIO_TASK_PRIORITY,  // Priority of the task
+    NULL,                 // Task handle
+    1                     // Core where the task should run
+  );
+}
+
+// Look for music.wav on the card, from loop()
+volatile bool musicFound = false;
+
+bool checkMusicFile() {
+  takeSpiMutex();
+  musicFound = sd.exists("/music.wav");
+  giveSpiMutex();
+  return musicFound;
+}
+
+// Web server handler to play WAV file, answers whether music.wav is there to play
+void handlePlayMusicRequest(AsyncWebServerRequest *request) {
+  // loop() looks again and plays "music.wav" in a separate task, the slideshow keeps running
+  postFrameCommand(CMD_PLAY_MUSIC);
+  request->send(200, "application/json", musicFound ? "{\"playing\":true}" : "{\"playing\":false}");
+}
+
+// An image being sent to one browser. Each fill reads straight into the
+// response buffer under its own xSpiMutex hold, so a slow or stalled client
+// never keeps the card from the slideshow. The stream is freed from the
+// request's onDisconnect handler, which runs on completion and on abort alike.
+struct ImageStream {
+  SdBaseFile *file = new SdBaseFile();  // On the heap so loop() can close it, see releaseWebFile
+  AsyncClient *client = nullptr;       // Dropped if the card is lost mid-image
+  uint32_t length = 0;                 // Content-Length of the response
+  bool rawToBmp = false;               // Prefix a BMP header and swap to BMP byte order
+  uint8_t header[CACHE_HEADER_SIZE];   // Only used when rawToBmp is set
+
+  ~ImageStream() { releaseWebFile(file, false); }
+
+  size_t fill(uint8_t *buffer, size_t maxLen, size_t index) {
+    if (rawToBmp && index < CACHE_HEADER_SIZE) {
+      size_t n = min(maxLen, (size_t)(CACHE_HEADER_SIZE - index));
+      memcpy(buffer, header + index, n);
+      return n;
+    }
+    if (rawToBmp) {
+      maxLen &= ~(size_t)1;
+      if (maxLen == 0) return RESPONSE_TRY_AGAIN;
+    }
+
+    if (!sdMounted) {
+      // Returning 0 doesn't end a response with a Content-Length, so let the
+      // connection time out on the next poll instead of polling forever
+      client->setRxTimeout(1);
+      return 0;
+    }
+    if (!trySpiMutex(0)) return RESPONSE_TRY_AGAIN;
+    int n = sdRead(*file, buffer, maxLen);
+    giveSpiMutex();
+    if (n < 0) return 0;
+
+    if (rawToBmp) {
+      for (int i = 0; i + 1 < n; i += 2) {  // Panel order to BMP order
+        uint8_t high = buffer[i];
+        buffer[i] = buffer[i + 1];
+        buffer[i + 1] = high;
+      }
+    }
+    return n;
+  }
+};
+
+// Answer a conditional GET with 304 when the browser's copy is still current
+bool sendNotModified(AsyncWebServerRequest *request, const String &etag, const char *cacheControl) {
+  if (!request->hasHeader("If-None-Match") || request->header("If-None-Match") != etag) return false;
+  AsyncWebServerResponse *response = request->beginResponse(304);
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", cacheControl);
+  request->send(response);
+  return true;
+}
+
+// Browsers revalidate images on every use; a matching ETag costs one directory
+// lookup and a 304 instead of the pixels
+#define IMAGE_CACHE_CONTROL "no-cache"
+
+// Open a pre-scaled copy or thumbnail at its start, if it matches the image's stamp
+bool openImageCopy(SdBaseFile &file, uint16_t slot, uint16_t stamp, bool thumb) {
+  int width, height;
+  bool ok = (thumb ? openThumbFile(file, slot) : openCacheFile(file, slot)) &&
+            readCacheHeader(file, stamp, &width, &height) && file.seekSet(0);
+  if (!ok && file.isOpen()) file.close();
+  return ok;
+}
+
+// Entity tag of one representation ('t'humbnail, 'c'ached copy, 'r'aw as BMP or
+// 'o'riginal) of an image version, identified by its name, size and modify time
+String imageETag(const char *name, uint32_t size, uint16_t date, uint16_t time, char variant) {
+  uint32_t hash = 2166136261UL;  // FNV-1a of the name
+  for (const char *p = name; *p; p++) hash = (hash ^ (uint8_t)tolower(*p)) * 16777619UL;
+  char tag[40];
+  snprintf(tag, sizeof(tag), "\"%08lx-%lx-%04x%04x-%c\"",
+           (unsigned long)hash, (unsigned long)size, date, time, variant);
+  return String(tag);
+}
+
+// Format a FAT timestamp as an HTTP date. FAT times have no zone, so this is
+// informational next to the ETag, which is what revalidation relies on.
+String httpDate(uint16_t date, uint16_t time) {
+  static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  static const uint8_t monthOffsets[] = {0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4};
+  int year = FS_YEAR(date);
+  int month = FS_MONTH(date);
+  int day = FS_DAY(date);
+  if (month < 1 || month > 12 || day < 1) return String();
+  int y = year - (month < 3);
+  int weekday = (y + y / 4 - y / 100 + y / 400 + monthOffsets[month - 1] + day) % 7;
+  char text[32];
+  snprintf(text, sizeof(text), "%s, %02d %s %04d %02d:%02d:%02d GMT", days[weekday], day,
+           months[month - 1], year, FS_HOUR(time), FS_MINUTE(time), FS_SECOND(time));
+  return String(text);
+}
+
+// Send an indexed image: its thumbnail when asked for and made, else the
+// pre-scaled copy, else the original. A request whose If-None-Match still
+// matches gets a 304 without any pixel data being read.
+void sendImage(AsyncWebServerRequest *request, const String &name, bool thumb) {
+  ImageStream *stream = new ImageStream();
+  stream->client = request->client();
+  const char *contentType = "image/bmp";
+  char variant = 'o';
+  uint32_t size = 0;
+  uint16_t date = 0, time = 0;
+
+  if (!trySpiMutex()) {
+    delete stream;
+    sendBusy(request);
+    return;
+  }
+  int32_t entry = findImageEntry(name.c_str());
+  SdBaseFile original;
+  bool found = entry >= 0 && openImageFile(original, entry);
+  if (found) {
+    size = original.fileSize();
+    original.getModifyDateTime(&date, &time);
+    original.close();
+
+    uint16_t stamp = imageIndex[entry].stamp;
+    if (thumb && openImageCopy(*stream->file, imageIndex[entry].thumbSlot, stamp, true)) {
+      variant = 't';
+    } else {
+      if (thumb && imageIndex[entry].thumbSlot < CACHE_SKIP) {
+        imageIndex[entry].thumbSlot = CACHE_NONE;  // Stale thumbnail, make it again
+        cacheWorkPending = true;
+      }
+      if (openImageCopy(*stream->file, imageIndex[entry].cacheSlot, stamp, false)) {
+        variant = 'c';
+      } else if (!openImageFile(*stream->file, entry)) {
+        found = false;
+      } else if (isRawImageFile(name.c_str())) {
+        // Browsers can't show raw RGB565, so wrap it as a BMP on the fly
+        makeCacheHeader(stream->header, frameWidth, frameHeight, 0);
+        stream->rawToBmp = true;
+        variant = 'r';
+      } else {
+        contentType = "image/jpeg";
+      }
+    }
+    stream->length = stream->file->fileSize() + (stream->rawToBmp ? CACHE_HEADER_SIZE : 0);
+  }
+  giveSpiMutex();
+
+  if (!found) {
+    delete stream;
+    request->send(404, "text/plain", "Image not found");
+    return;
+  }
+
+  String etag = imageETag(name.c_str(), size, date, time, variant);
+  if (sendNotModified(request, etag, IMAGE_CACHE_CONTROL)) {
+    delete stream;
+    return;
+  }
+
+  request->onDisconnect([stream]() { delete stream; });
+  AsyncWebServerResponse *response = request->beginResponse(contentType, stream->length,
+    [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return stream->fill(buffer, maxLen, index);
+    });
+
+  String modified = httpDate(date, time);
+  if (modified.length()) response->addHeader("Last-Modified", modified);
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", IMAGE_CACHE_CONTROL);
+  response->addHeader("Content-Disposition", "inline; filename=" + name);
+  response->addHeader("Access-Control-Allow-Origin", "*");
+  request->send(response);
+}
+
+// WebSocket protocol
+// Binary frames, little-endian. The frame sends one state message after every
+// slide change, on connect and when a control changes something:
+//   u8 WS_MSG_STATE, u8 flags (WS_FLAG_*), u16 index, u16 image count,
+//   u16 speed in seconds, u32 image size, u8 ETag length + ETag,
+//   u8 name length + name, u8 album length + album ("" for the root folder)
+// The ETag is the one /current_image answers with, so a client only fetches
+// the image when it changed. Clients send commands as a type byte and payload:
+//   WS_CMD_NEXT, WS_CMD_PREV, WS_CMD_STATE (no payload),
+//   WS_CMD_PAUSE + u8 paused, WS_CMD_SPEED + u16 seconds,
+//   WS_CMD_ALBUM + album name (the rest of the message, empty for the root folder)
+// A client whose send queue is full when the next state goes out is dropped,
+// so a stalled browser can't pile messages up on the heap. Connected clients
+// are tracked by id, since AsyncWebSocket only hands out copies of its list.
+#define WS_MSG_STATE 0x01
+#define WS_FLAG_PAUSED 0x01
+#define WS_FLAG_AUDIO 0x02
+#define WS_CMD_NEXT 0x10
+#define WS_CMD_PREV 0x11
+#define WS_CMD_PAUSE 0x12
+#define WS_CMD_SPEED 0x13
+#define WS_CMD_STATE 0x14
+#define WS_CMD_ALBUM 0x15
+#define WS_STATE_MAX (15 + 2 * 256 + ALBUM_NAME_MAX)
+
+uint32_t wsClientIds[DEFAULT_MAX_WS_CLIENTS];
+uint8_t wsClientCount = 0;
+portMUX_TYPE wsClientMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t wsClientsDropped = 0;
+
+bool addWebSocketClient(uint32_t id) {
+  bool added = false;
+  portENTER_CRITICAL(&wsClientMux);
+  if (wsClientCount < DEFAULT_MAX_WS_CLIENTS) {
+    wsClientIds[wsClientCount++] = id;
+    added = true;
+  }
+  portEXIT_CRITICAL(&wsClientMux);
+  return added;
+}
+
+void removeWebSocketClient(uint32_t id) {
+  portENTER_CRITICAL(&wsClientMux);
+  for (uint8_t i = 0; i < wsClientCount; i++) {
+    if (wsClientIds[i] == id) {
+      wsClientIds[i] = wsClientIds[--wsClientCount];
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&wsClientMux);
+}
+
+// Work out the size and ETag of the slide on screen, the same way sendImage
+// picks the copy it sends
+void updateSlideInfo(uint16_t index) {
+  uint32_t size = 0;
+  uint16_t date = 0, time = 0;
+  char variant = 'o';
+  takeSpiMutex();
+  SdBaseFile original;
+  if (index < fileCount && openImageFile(original, index)) {
+    size = original.fileSize();
+    original.getModifyDateTime(&date, &time);
+    original.close();
+    if (imageIndex[index].cacheSlot < CACHE_SKIP) variant = 'c';
+    else if (isRawImageFile(imageName(index))) variant = 'r';
+  }
+  currentImageIndex = index;
+  currentImageSize = size;
+  currentImageETag = size ? imageETag(currentImageName.c_str(), size, date, time, variant) : String();
+  giveSpiMutex();
+}
+
+size_t putShortString(uint8_t *p, const char *text) {
+  size_t len = min(strlen(text), (size_t)255);
+  p[0] = len;
+  memcpy(p + 1, text, len);
+  return len + 1;
+}
+
+size_t buildSlideState(uint8_t *frame) {
+  takeSpiMutex();
+  frame[0] = WS_MSG_STATE;
+  frame[1] = (slideshowPaused ? WS_FLAG_PAUSED : 0) | (audioPlaying ? WS_FLAG_AUDIO : 0);
+  putLE16(frame + 2, currentImageIndex);
+  putLE16(frame + 4, fileCount);
+  putLE16(frame + 6, X);
+  putLE32(frame + 8, currentImageSize);
+  size_t len = 12;
+  len += putShortString(frame + len, currentImageETag.c_str());
+  len += putShortString(frame + len, currentImageName.c_str());
+  len += putShortString(frame + len, albumName());
+  giveSpiMutex();
+  return len;
+}
+
+// Send the state to one client, or to every connected one when only is nullptr
+void sendSlideState(AsyncWebSocketClient *only) {
+  uint8_t frame[WS_STATE_MAX];
+  size_t len = buildSlideState(frame);
+  if (only) {
+    if (!only->queueIsFull()) only->binary(frame, len);
+    return;
+  }
+  uint32_t ids[DEFAULT_MAX_WS_CLIENTS];
+  portENTER_CRITICAL(&wsClientMux);
+  uint8_t count = wsClientCount;
+  memcpy(ids, wsClientIds, count * sizeof(ids[0]));
+  portEXIT_CRITICAL(&wsClientMux);
+
+  for (uint8_t i = 0; i < count; i++) {
+    AsyncWebSocketClient *client = ws.client(ids[i]);
+    if (!client || client->status() != WS_CONNECTED) continue;
+    if (client->queueIsFull()) {
+      Serial.printf("WebSocket client #%u is not keeping up, dropping it\n", client->id());
+      wsClientsDropped++;
+      client->close();
+      continue;
+    }
+    client->binary(frame, len);
+  }
+}
+
+void handleWebSocketCommand(AsyncWebSocketClient *client, const uint8_t *data, size_t len) {
+  switch (data[0]) {
+    case WS_CMD_NEXT:
+      postFrameCommand(CMD_STEP, 1);  // loop() changes the slide and sends the new state
+      break;
+    case WS_CMD_PREV:
+      postFrameCommand(CMD_STEP, -1);
+      break;
+    case WS_CMD_PAUSE:
+      if (len < 2) return;
+      postFrameCommand(CMD_PAUSE, data[1] != 0);
+      break;
+    case WS_CMD_SPEED:
+      if (len < 3) return;
+      postFrameCommand(CMD_SPEED, data[1] | data[2] << 8);
+      break;
+    case WS_CMD_STATE:
+      postFrameCommand(CMD_SEND_STATE, client->id());
+      break;
+    case WS_CMD_ALBUM: {
+      char name[ALBUM_NAME_MAX + 1];
+      size_t nameLen = min(len - 1, (size_t)ALBUM_NAME_MAX);
+      memcpy(name, data + 1, nameLen);
+      name[nameLen] = '\0';
+      requestAlbum(name);  // loop() switches and sends the new state
+      break;
+    }
+  }
+}
+
+// WebSocket event handler
+void onWebSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type,
+                      void *arg, uint8_t *data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    Serial.printf("WebSocket client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
+    if (!addWebSocketClient(client->id())) {
+      client->close();  // More viewers than AsyncWebSocket keeps
+      return;
+    }
+    postFrameCommand(CMD_SEND_STATE, client->id());
+  } else if (type == WS_EVT_DISCONNECT) {
+    Serial.printf("WebSocket client #%u disconnected\n", client->id());
+    removeWebSocketClient(client->id());
+  } else if (type == WS_EVT_DATA) {
+    // Commands are a few bytes, so only whole single-frame messages are taken
+    AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    if (info->final && info->index == 0 && info->len == len && info->opcode == WS_BINARY && len > 0) {
+      handleWebSocketCommand(client, data, len);
+    }
+  }
+}
+
+// Send a page or other asset of the web UI straight from flash. The browser
+// revalidates it, so a firmware update shows up without a stale copy.
+void sendWebAsset(AsyncWebServerRequest *request, const WebAsset &asset) {
+  if (sendNotModified(request, asset.etag, "no-cache")) return;
+  AsyncWebServerResponse *response = request->beginResponse_P(200, asset.contentType, asset.data, asset.length);
+  response->addHeader("Content-Encoding", "gzip");
+  response->addHeader("ETag", asset.etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+// Write text as a quoted JSON string
+void printJsonString(Print &out, const char *text) {
+  out.print('"');
+  for (const char *p = text; *p; p++) {
+    if (*p == '"' || *p == '\\') out.print('\\');
+    if ((uint8_t)*p < 0x20) out.printf("\\u%04x", *p);
+    else out.print(*p);
+  }
+  out.print('"');
+}
+
+// Write the album list as JSON, called with xSpiMutex held
+void printAlbumList(Print &out) {
+  out.print("{\"current\":");
+  printJsonString(out, albumName());
+  out.print(",\"albums\":[\"\"");  // The root folder is always there
+  SdBaseFile cardRoot, entry;
+  char name[ALBUM_NAME_MAX + 1];
+  uint16_t listed = 0;
+  if (cardRoot.open("/", O_RDONLY)) {
+    while (listed < ALBUM_LIST_LIMIT && entry.openNext(&cardRoot, O_RDONLY)) {
+      if (entry.isDir() && entry.getName(name, sizeof(name)) && isAlbumName(name)) {
+        out.print(',');
+        printJsonString(out, name);
+        listed++;
+      }
+      entry.close();
+    }
+    cardRoot.close();
+  }
+  out.print("]}");
+}
+
+// Print into a fixed buffer, noting when something didn't fit
+class BufferPrint : public Print {
+  public:
+    BufferPrint(uint8_t *buffer, size_t size) : buffer(buffer), size(size) {}
+
+    size_t write(uint8_t c) override {
+      if (used == size) {
+        overflow = true;
+        return 0;
+      }
+      buffer[used++] = c;
+      return 1;
+    }
+
+    uint8_t *buffer;
+    size_t size;
+    size_t used = 0;
+    bool overflow = false;
+};
+
+// /api/files streams the image index through a chunked response. All of its
+// state is this small struct held by the response, so a listing costs the same
+// memory however many images the card holds. Each chunk takes the SD lock only
+// while it copies names out of the index.
+// Deletes between chunks move entries down, so when imageIndexGeneration has
+// changed a chunk finds its place again by the directory index of the last
+// entry it looked at: removals keep the others in order and uploads are
+// appended. If that entry went too, or the album changed, the listing ends
+// with "changed":true and the page asks again.
+#define FILE_LIST_LIMIT 100  // Entries per page when no limit is given
+
+struct FileListing {
+  String prefix;           // Only list names starting with this (case-insensitive)
+  uint16_t total = 0;      // Matching images
+  uint16_t offset = 0;
+  uint16_t skip = 0;       // Matches still to pass over before the offset
+  uint16_t remaining = 0;  // Entries still to send
+  uint16_t next = 0;       // Index position to look at next
+  uint32_t lastDirIndex = 0;  // Directory index of the entry before next
+  uint32_t album = 0;      // albumGeneration the listing started on
+  uint32_t generation = 0; // imageIndexGeneration next belongs to
+  uint8_t part = 0;        // 0: header, 1: entries, 2: closing, 3: done
+  bool first = true;
+  bool changed = false;    // Cut short by an index change
+};
+
+// Find the listing's place again after entries moved, false if it's lost
+bool resumeFileListing(FileListing &listing) {
+  if (listing.album != albumGeneration) return false;
+  if (listing.next > 0) {
+    uint16_t i = 0;
+    while (i < fileCount && imageIndex[i].dirIndex != listing.lastDirIndex) i++;
+    if (i == fileCount) return false;
+    listing.next = i + 1;
+  }
+  listing.generation = imageIndexGeneration;
+  return true;
+}
+
+bool listingMatches(const FileListing &listing, uint16_t index) {
+  return strncasecmp(imageName(index), listing.prefix.c_str(), listing.prefix.length()) == 0;
+}
+
+// Chunk filler for /api/files, writes whole entries only
+size_t fillFileListing(FileListing &listing, uint8_t *buffer, size_t maxLen) {
+  BufferPrint out(buffer, maxLen);
+  if (listing.part == 0) {
+    out.printf("{\"total\":%u,\"offset\":%u,\"files\":[", listing.total, listing.offset);
+    if (out.overflow) return RESPONSE_TRY_AGAIN;
+    listing.part = 1;
+  }
+
+  if (listing.part == 1) {
+    if (!sdMounted) return out.used;  // Ends the listing short, the page reports the error
+    if (!trySpiMutex(0)) return out.used ? out.used : RESPONSE_TRY_AGAIN;
+    if (listing.generation != imageIndexGeneration && !resumeFileListing(listing)) {
+      listing.changed = true;
+      listing.remaining = 0;
+    }
+    while (listing.remaining > 0 && listing.next < fileCount) {
+      if (!listingMatches(listing, listing.next)) {
+        listing.lastDirIndex = imageIndex[listing.next++].dirIndex;
+        continue;
+      }
+      if (listing.skip > 0) {
+        listing.skip--;
+        listing.lastDirIndex = imageIndex[listing.next++].dirIndex;
+        continue;
+      }
+      size_t mark = out.used;
+      out.print(listing.first ? "{\"name\":" : ",{\"name\":");
+      printJsonString(out, imageName(listing.next));
+      out.print('}');
+      if (out.overflow) {
+        out.used = mark;
+        break;
+      }
+      listing.first = false;
+      listing.lastDirIndex = imageIndex[listing.next++].dirIndex;
+      listing.remaining--;
+    }
+    bool more = listing.remaining > 0 && listing.next < fileCount;
+    giveSpiMutex();
+    if (more) return out.used ? out.used : RESPONSE_TRY_AGAIN;
+    listing.part = 2;
+  }
+
+  if (listing.part == 2) {
+    size_t mark = out.used;
+    out.print(listing.changed ? "],\"changed\":true}" : "]}");
+    if (out.overflow) {
+      out.used = mark;
+      return out.used ? out.used : RESPONSE_TRY_AGAIN;
+    }
+    listing.part = 3;
+  }
+  return out.used;  // 0 once everything has been sent
+}
+
+// Uploads
+// Each upload request keeps an UploadState in its _tempObject, so interleaved
+// uploads never share a file. Data is gathered into a buffer and written a
+// whole number of sectors at a time, after preallocating contiguous clusters
+// from the request's Content-Length; any surplus is truncated when the file is
+// closed. A multipart body can carry several files, each reported separately.
+#define UPLOAD_BUFFER_SIZE (16 * 1024)  // 32 sectors per SD write
+#define UPLOAD_BUFFER_SLACK (16 * 1024) // Keeps taking data while the card is held
+#define UPLOAD_STALL_WAIT_MS 500        // Wait for the card once the slack is full too
+
+struct UploadState {
+  SdBaseFile *file = new SdBaseFile();  // On the heap so loop() can remove it, see releaseWebFile
+  String name;              // File being written, without the leading slash
+  uint32_t album = 0;       // albumGeneration when the file was opened
+  uint8_t *buffer = nullptr;
+  size_t buffered = 0;
+  uint32_t received = 0;    // Body bytes seen so far, over all files
+  bool ok = false;          // Current file still good
+  bool allOk = true;
+  bool busy = false;        // A file failed because the card stayed locked
+  String results;           // JSON objects of the finished files
+
+  // A request that ends mid-file (client gone) leaves no partial file behind
+  ~UploadState() {
+    releaseWebFile(file, true);
+    free(buffer);
+  }
+};
+
+// The request's upload state, created with its first file
+UploadState *uploadState(AsyncWebServerRequest *request) {
+  if (!request->_tempObject) {
+    UploadState *state = new UploadState();
+    request->_tempObject = state;
+    request->onDisconnect([request, state]() {
+      request->_tempObject = nullptr;  // The request would free() it otherwise
+      delete state;
+    });
+  }
+  return (UploadState *)request->_tempObject;
+}
+
+// Write out the buffered data, whole sectors only unless the file is done.
+// Called with xSpiMutex held.
+bool flushUploadBuffer(UploadState &up, bool all) {
+  size_t n = all ? up.buffered : up.buffered & ~(size_t)511;
+  if (n && up.file->write(up.buffer, n) != n) return false;
+  memmove(up.buffer, up.buffer + n, up.buffered - n);
+  up.buffered -= n;
+  return true;
+}
+
+void beginUploadFile(UploadState &up, const String &filename, uint32_t sizeHint) {
+  up.name = filename;
+  if (!up.buffer) up.buffer = (uint8_t *)malloc(UPLOAD_BUFFER_SIZE + UPLOAD_BUFFER_SLACK);
+  up.buffered = 0;
+
+  // Never wait on the card from the network task: a file that can't get it
+  // fails, and the response asks the browser to try again
+  if (webRemovePending() || !trySpiMutex()) {
+    Serial.printf("SD card busy, upload of %s failed\n", filename.c_str());
+    up.ok = false;
+    up.busy = true;
+    return;
+  }
+  up.album = albumGeneration;
+  up.ok = up.buffer && up.file->open(albumFilePath(filename.c_str()).c_str(), O_WRITE | O_CREAT | O_TRUNC);
+  if (up.ok && sizeHint) up.file->preAllocate(sizeHint);  // Best effort, needs a contiguous run
+  giveSpiMutex();
+  if (!up.ok) Serial.printf("Upload failed to open %s\n", filename.c_str());
+}
+
+// Close the current file. A complete one is trimmed to size and added to the
+// image index; a failed one is removed, by loop() if the card is busy.
+void endUploadFile(UploadState &up) {
+  if (up.file->isOpen() && !trySpiMutex()) {
+    Serial.printf("SD card busy, upload of %s failed\n", up.name.c_str());
+    markIndexChanged();
+    releaseWebFile(up.file, true);
+    up.file = new SdBaseFile();
+    up.ok = false;
+    up.busy = true;
+  } else if (up.file->isOpen()) {
+    markIndexChanged();  // The album folder changes either way
+    up.ok = up.ok && flushUploadBuffer(up, true) && up.file->truncate();
+    if (!up.ok) {
+      Serial.printf("Write failed for %s\n", up.name.c_str());
+      up.file->remove();
+    } else {
+      // Add the new image to the index (an overwritten file keeps its entry)
+      uint32_t dirIndex = up.file->dirIndex();
+      uint16_t stamp = imageStamp(*up.file);
+      uint16_t date = imageDate(*up.file);
+      up.file->close();
+      invalidatePrefetch();
+      const char *filename = up.name.c_str();
+      // After an album switch mid-upload the file belongs to the old album,
+      // whose saved index no longer matches and is rebuilt when it's back
+      if (isImageFile(filename) && up.album == albumGeneration) {
+        int32_t entry = findImageEntry(filename);
+        if (entry >= 0) {
+          // Overwritten: the old pre-scaled copy and thumbnail no longer match
+          resetImageCopies(entry);
+          imageIndex[entry].stamp = stamp;
+          imageIndex[entry].date = date;
+          newestImageDate = max(newestImageDate, date);
+        } else if (addImageEntry(dirIndex, filename, stamp, date)) {
+          Serial.printf("Indexed uploaded image: %s\n", filename);
+        } else {
+          Serial.println("Image index full, upload not indexed");
+        }
+        cacheWorkPending = true;  // Transcode it in the background
+      }
+    }
+    giveSpiMutex();
+  }
+
+  StreamString result;
+  result.print(up.results.length() ? ",{\"name\":" : "{\"name\":");
+  printJsonString(result, up.name.c_str());
+  result.print(up.ok ? ",\"ok\":true}" : ",\"ok\":false}");
+  up.results += result;
+  up.allOk = up.allOk && up.ok;
+  up.ok = false;
+}
+
+// Upload body handler: called for each piece of each file in the request
+void handleUploadData(AsyncWebServerRequest *request, const String &filename, size_t index,
+                      uint8_t *data, size_t len, bool final) {
+  UploadState &up = *uploadState(request);
+  if (index == 0) {
+    if (up.file->isOpen()) endUploadFile(up);  // Previous part never got its final call
+    uint32_t remaining = request->contentLength() > up.received ? request->contentLength() - up.received : 0;
+    beginUploadFile(up, filename, remaining);
+  }
+  up.received += len;
+
+  while (up.ok && len > 0) {
+    size_t n = min(len, (size_t)(UPLOAD_BUFFER_SIZE + UPLOAD_BUFFER_SLACK - up.buffered));
+    memcpy(up.buffer + up.buffered, data, n);
+    up.buffered += n;
+    data += n;
+    len -= n;
+    if (up.buffered >= UPLOAD_BUFFER_SIZE) {
+      // Write once the card is free; until then the slack takes the next
+      // pieces, and only a full slack makes the network task wait a while
+      bool full = up.buffered == UPLOAD_BUFFER_SIZE + UPLOAD_BUFFER_SLACK;
+      if (trySpiMutex(full ? UPLOAD_STALL_WAIT_MS : 0)) {
+        up.ok = flushUploadBuffer(up, false);
+        giveSpiMutex();
+      } else if (full) {
+        up.ok = false;  // endUploadFile gets the partial file removed
+        up.busy = true;
+      }
+    }
+  }
+
+  if (final) endUploadFile(up);
+}
+
+// Upload request complete: report each file, then play music.wav if it is there
+void handleFileUpload(AsyncWebServerRequest *request) {
+  UploadState *up = (UploadState *)request->_tempObject;
+  if (up && up->file->isOpen()) endUploadFile(*up);
+  bool ok = up && up->allOk;
+  String json = String("{\"ok\":") + (ok ? "true" : "false") + ",\"files\":[" + (up ? up->results : "") + "]}";
+  if (!ok && up && up->busy) {
+    AsyncWebServerResponse *response = request->beginResponse(503, "application/json", json);
+    response->addHeader("Retry-After", "1");
+    request->send(response);
+  } else {
+    request->send(ok ? 200 : 500, "application/json", json);
+  }
+
+  // Play "music.wav" after any file is uploaded
+  postFrameCommand(CMD_PLAY_MUSIC);
+}
+
+// Write one histogram in Prometheus text format, in seconds
+void printHistogram(Print &out, const char *name, const char *help, const Histogram &h) {
+  out.printf("# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  uint32_t cumulative = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    cumulative += h.buckets[i];
+    out.printf("%s_bucket{le=\"%g\"} %lu\n", name, histogramBoundsMicros[i] / 1e6, (unsigned long)cumulative);
+  }
+  out.printf("%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)h.count);
+  out.printf("%s_sum %.6f\n%s_count %lu\n", name, h.sumMicros / 1e6, name, (unsigned long)h.count);
+}
+
+// Write one counter or gauge in Prometheus text format
+void printMetric(Print &out, const char *name, const char *type, const char *help, int64_t value) {
+  out.printf("# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type, name, (long long)value);
+}
+
+// Stack high-water marks of the tasks that do the work, by FreeRTOS task name
+void printTaskStacks(Print &out) {
+  static const char *tasks[] = {"loopTask", "prefetchTask", "playWAVTask", "async_tcp"};
+  out.print("# HELP photoframe_task_stack_free_bytes Smallest free stack seen for each task\n"
+            "# TYPE photoframe_task_stack_free_bytes gauge\n");
+  for (const char *task : tasks) {
+    TaskHandle_t handle = xTaskGetHandle(task);
+    if (!handle) continue;  // Not running (playWAVTask only exists while playing)
+    out.printf("photoframe_task_stack_free_bytes{task=\"%s\"} %lu\n", task,
+               (unsigned long)uxTaskGetStackHighWaterMark(handle));
+  }
+}
+
+// Benchmark
+// A fixed suite for comparing board variants and firmware releases: POST /bench
+// queues a run for loop(), GET /bench returns the last results as JSON (also
+// printed on Serial). The slideshow stands still while it runs. Reference JPEGs
+// are the first BENCH_MAX_FILES in BENCH_DIR on the card, or the first slide if
+// there is no such folder, plus the splash image in SPIFFS.
+#ifndef BOARD_VARIANT
+#define BOARD_VARIANT "unknown"
+#endif
+#define BENCH_DIR "/bench"
+#define BENCH_FLASH_FILE "/vanity.jpg"
+#define BENCH_MAX_FILES 4
+#define BENCH_READ_BYTES (128 * 1024)  // Read per SD clock and buffer size
+#define BENCH_QR_RUNS 20
+const uint16_t benchBufferSizes[] = {512, 4096, 16384, 32768};
+
+enum BenchState : uint8_t { BENCH_IDLE, BENCH_QUEUED, BENCH_DONE };
+#ifdef BENCH_AT_BOOT
+volatile BenchState benchState = BENCH_QUEUED;
+#else
+volatile BenchState benchState = BENCH_IDLE;
+#endif
+String benchResult;  // JSON of the last run, guarded by xSpiMutex
+
+struct BenchFile {
+  char path[64];
+  bool flash;  // In SPIFFS rather than on the card
+};
+
+fs::File benchFlashFile;
+
+// Decode target that only counts the time spent in JPEGDEC
+int JPEGDrawDiscard(JPEGDRAW *pDraw) {
+  return 1;
+}
+
+bool openBenchJpeg(const BenchFile &file, JPEG_DRAW_CALLBACK *draw) {
+  if (file.flash) {
+    benchFlashFile = SPIFFS.open(file.path, "r");
+    if (benchFlashFile && jpeg.open(benchFlashFile, draw)) return true;
+    if (benchFlashFile) benchFlashFile.close();
+    return false;
+  }
+  takeSpiMutex();
+  bool opened = jpgFile.open(file.path, O_RDONLY);
+  giveSpiMutex();
+  if (opened && jpeg.open(&jpgFile, jpgFile.fileSize(), myClose, myRead, mySeek, draw)) return true;
+  if (opened) myClose(&jpgFile);
+  return false;
+}
+
+void closeBenchJpeg() {
+  jpeg.close();
+  if (benchFlashFile) benchFlashFile.close();
+}
+
+// Time one decode at a JPEGDEC scale, either discarded or drawn on the panel
+// through JPEGDraw, which adds its own share to slidePushMicros. Returns the
+// microseconds taken, or -1 if the file didn't decode.
+int32_t benchDecode(const BenchFile &file, int shift, bool toPanel) {
+  if (!openBenchJpeg(file, toPanel ? JPEGDraw : JPEGDrawDiscard)) return -1;
+  slidePushMicros = 0;
+  uint32_t start = micros();
+  if (toPanel) beginJpegDraw();
+  bool ok = jpeg.decode(0, 0, jpegScaleOptions[shift]) == 1;
+  if (toPanel) endJpegDraw();
+  uint32_t elapsed = micros() - start;
+  closeBenchJpeg();
+  return ok ? (int32_t)elapsed : -1;
+}
+
+void printBenchDraw(Print &out, const char *name, const BenchFile &file, int shift) {
+  int32_t elapsed = benchDecode(file, shift, true);
+  out.printf(",\"%s\":{\"us\":%ld,\"pushUs\":%lu}", name, (long)elapsed, (unsigned long)slidePushMicros);
+}
+
+// Decode a reference JPEG at every scale, then draw it at the scale that fits
+// with blocking pushes and with DMA
+void benchJpegFile(Print &out, const BenchFile &file) {
+  out.print("{\"file\":");
+  printJsonString(out, file.path);
+  out.printf(",\"source\":\"%s\"", file.flash ? "spiffs" : "sd");
+  if (!openBenchJpeg(file, JPEGDrawDiscard)) {
+    out.print(",\"error\":\"open\"}");
+    return;
+  }
+  int width = jpeg.getWidth();
+  int height = jpeg.getHeight();
+  closeBenchJpeg();
+
+  out.printf(",\"width\":%d,\"height\":%d,\"decodeUs\":[", width, height);
+  for (int shift = 0; shift < 4; shift++) {
+    out.printf("%s%ld", shift ? "," : "", (long)benchDecode(file, shift, false));
+  }
+  int shift = jpegFitShift(width, height);
+  out.printf("],\"drawScale\":%d", 1 << shift);
+  tft.fillScreen(TFT_BLACK);
+#ifdef USE_TFT_DMA
+  uint16_t *dmaSaved = dmaBuffer[1];
+  dmaBuffer[1] = nullptr;  // Hidden buffers send JPEGDraw down the blocking path
+  printBenchDraw(out, "blocking", file, shift);
+  dmaBuffer[1] = dmaSaved;
+  if (dmaSaved) printBenchDraw(out, "dma", file, shift);
+#else
+  printBenchDraw(out, "blocking", file, shift);
+#endif
+  out.print('}');
+}
+
+// Read BENCH_READ_BYTES in buffer-sized chunks, starting over at the end of a
+// short file. Returns KB/s, or 0 on a read error. Called with xSpiMutex held.
+uint32_t benchReadSpeed(const char *path, uint8_t *buffer, uint16_t size) {
+  SdBaseFile file;
+  if (!file.open(path, O_RDONLY) || file.fileSize() == 0) return 0;
+  uint32_t total = 0;
+  bool ok = true;
+  uint32_t start = micros();
+  while (ok && total < BENCH_READ_BYTES) {
+    int32_t n = sdRead(file, buffer, size);
+    if (n > 0) total += n;
+    else ok = n == 0 && file.seekSet(0);
+  }
+  uint32_t elapsed = micros() - start;
+  file.close();
+  if (!ok) return 0;
+  if (elapsed == 0) elapsed = 1;
+  return (uint64_t)total * 1000000 / 1024 / elapsed;
+}
+
+// Remount at each clock in sdSpeedsMHz and time file reads with each buffer
+// size. The lock is held per remount and per read test, so audio gets the card
+// in between; web requests are turned away for the whole sweep (benchSweeping)
+// since the album directories stay closed until the final remount.
+void benchSdReads(Print &out, const char *path) {
+  uint8_t *buffer = (uint8_t *)malloc(benchBufferSizes[sizeof(benchBufferSizes) / sizeof(benchBufferSizes[0]) - 1]);
+  out.print("\"sdRead\":[");
+  if (!buffer) {
+    out.print(']');
+    return;
+  }
+  takeSpiMutex();
+  benchSweeping = true;
+  albumDir.close();
+  cacheDir.close();
+  thumbDir.close();
+  giveSpiMutex();
+  for (uint8_t step = 0; step < sizeof(sdSpeedsMHz); step++) {
+    takeSpiMutex();
+    sd.end();
+    SdSpiConfig config(SD_CS, DEDICATED_SPI, SD_SCK_MHZ(sdSpeedsMHz[step]), &sdSpi);
+    bool mounted = sd.begin(config);
+    giveSpiMutex();
+    out.printf("%s{\"mhz\":%u,\"mounted\":%s,\"kbps\":[", step ? "," : "", sdSpeedsMHz[step],
+               mounted ? "true" : "false");
+    for (size_t i = 0; mounted && i < sizeof(benchBufferSizes) / sizeof(benchBufferSizes[0]); i++) {
+      takeSpiMutex();
+      uint32_t kbps = benchReadSpeed(path, buffer, benchBufferSizes[i]);
+      giveSpiMutex();
+      out.printf("%s{\"buffer\":%u,\"kbps\":%lu}", i ? "," : "", benchBufferSizes[i], (unsigned long)kbps);
+    }
+    out.print("]}");
+  }
+  takeSpiMutex();
+  remountSdCard();  // Back to the clock the slideshow was running at
+  benchSweeping = false;
+  giveSpiMutex();
+  free(buffer);
+  out.print(']');
+}
+
+// Time QR encoding the way displayQRCode does it, then one draw of the code
+void benchQRCode(Print &out) {
+  const char *url = "http://192.168.100.100:8080";  // A long LAN address, like displayQRCode builds
+  FrameQRCode qrcode;
+  uint8_t qrcodeTemp[FrameQRCode::BUFFER_LEN];
+  uint32_t start = micros();
+  for (int i = 0; i < BENCH_QR_RUNS; i++) {
+    qrcode.encodeText(url, qrcodegen::QrCode::Ecc::MEDIUM, qrcodeTemp);
+  }
+  uint32_t encodeMicros = (micros() - start) / BENCH_QR_RUNS;
+  start = micros();
+  displayQRCode("192.168.100.100");
+  out.printf("\"qr\":{\"version\":%d,\"encodeUs\":%lu,\"drawUs\":%lu}", (qrcode.getSize() - 17) / 4,
+             (unsigned long)encodeMicros, (unsigned long)(micros() - start));
+}
+
+// Run the suite from loop(), which owns the panel and the main decoder
+void runBenchmark() {
+  BenchFile files[BENCH_MAX_FILES + 1];
+  int count = 0;
+  uint32_t start = millis();
+  setCpuBusy(true);
+  benchRunning = true;
+  Serial.println("Running benchmark...");
+
+  takeSpiMutex();
+  SdBaseFile dir, entry;
+  char name[48];
+  if (dir.open(BENCH_DIR, O_RDONLY)) {
+    while (count < BENCH_MAX_FILES && entry.openNext(&dir, O_RDONLY)) {
+      if (!entry.isDir() && entry.getName(name, sizeof(name)) && isImageFile(name) && !isRawImageFile(name)) {
+        snprintf(files[count].path, sizeof(files[count].path), BENCH_DIR "/%s", name);
+        files[count++].flash = false;
+      }
+      entry.close();
+    }
+    dir.close();
+  }
+  for (uint16_t i = 0; count == 0 && i < fileCount; i++) {
+    if (isRawImageFile(imageName(i))) continue;
+    strlcpy(files[count].path, albumFilePath(imageName(i)).c_str(), sizeof(files[count].path));
+    files[count++].flash = false;
+  }
+  giveSpiMutex();
+  char sdPath[sizeof(files[0].path)] = "";
+  if (count > 0) strcpy(sdPath, files[0].path);
+  strcpy(files[count].path, BENCH_FLASH_FILE);
+  files[count++].flash = true;
+
+  StreamString json;
+  json.printf("{\"board\":\"%s\",\"cpuMHz\":%lu,\"psram\":%s,\"sdMHz\":%u,\"jpeg\":[", BOARD_VARIANT,
+              (unsigned long)ESP.getCpuFreqMHz(), psramFound() ? "true" : "false", sdSpiMHz);
+  for (int i = 0; i < count; i++) {
+    if (i) json.print(',');
+    benchJpegFile(json, files[i]);
+  }
+  json.print("],");
+  if (sdPath[0]) {
+    benchSdReads(json, sdPath);
+    json.print(',');
+  }
+  benchQRCode(json);
+  json.printf(",\"totalMs\":%lu}", (unsigned long)(millis() - start));
+  Serial.println(json);
+
+  takeSpiMutex();
+  benchResult = json;
+  giveSpiMutex();
+  benchState = BENCH_DONE;
+  benchRunning = false;
+
+  tft.fillScreen(TFT_BLACK);
+  loadImage(currentIndex);  // Put the slideshow back
+  timer = millis();
+}
+
+// Power management
+// loop() sleeps on frameCommands until the next slide is due or a command
+// comes, so the idle task has the CPU in between. The clock is at
+// POWER_CPU_BUSY_MHZ while a slide is drawn or a background job (prefetch,
+// transcode, audio, benchmark) runs and at POWER_CPU_IDLE_MHZ otherwise. Builds with CONFIG_PM_ENABLE hand the clock to
+// the IDF power manager, which with tickless idle also light-sleeps the chip;
+// the LEDC backlight stops in light sleep, so that's only allowed while the
+// night schedule has the display off. Wi-Fi stays in modem sleep and wakes for
+// every DTIM beacon, so the web server still answers, a little slower.
+// The board has no current sensor: the metrics report an estimate from the
+// state of each part and the POWER_MA_* figures.
+#define POWER_CPU_BUSY_MHZ 240
+#define POWER_CPU_IDLE_MHZ 80         // Lowest clock that keeps the APB, and so SPI and LEDC, at 80 MHz
+#define POWER_IDLE_WAIT_MS 1000       // Longest loop() sleep, for the jobs it polls
+#define POWER_POLL_MS 10              // loop() sleep while the button or an overlay is followed
+#define POWER_WAKE_DISPLAY_MS 300000  // A touch at night lights the display this long
+#define POWER_CLOCK_VALID 1600000000  // Earlier times mean NTP hasn't answered yet
+#define POWER_NTP_SERVER "pool.ntp.org"
+#define POWER_MA_CPU_BUSY 68
+#define POWER_MA_CPU_IDLE 30
+#define POWER_MA_CPU_SLEEP 3          // Light sleep between DTIM wakeups
+#define POWER_MA_WIFI 20              // Average in modem sleep
+#define POWER_MA_WIFI_AWAKE 110       // Connecting or running the portal
+#define POWER_MA_PANEL 10
+#define POWER_MA_BACKLIGHT 80         // At full duty
+
+bool cpuBusy = true;      // Boots at full speed
+bool pmManaged = false;   // The IDF power manager has the clock
+bool pmLightSleep = false;
+#if CONFIG_PM_ENABLE
+esp_pm_lock_handle_t cpuLock = NULL;      // Held while busy
+esp_pm_lock_handle_t displayLock = NULL;  // Held while the backlight is lit
+#endif
+
+bool nightEnabled = false;
+uint16_t nightFrom = 23 * 60;  // Minute of the day the display goes off
+uint16_t nightTo = 7 * 60;     // and comes back on
+#define POWER_TZ_MAX 64
+char nightTz[POWER_TZ_MAX] = "UTC0";  // POSIX TZ string for local time
+bool displayOn = true;
+bool displayWoken = false;     // Lit by a touch during the night
+uint32_t displayWokenAt = 0;
+
+uint32_t powerAccountedAt = 0;
+uint64_t chargeMicroCoulombs = 0;  // mA times ms
+
+uint32_t powerEstimateMilliamps() {
+  uint32_t mA = cpuBusy ? POWER_MA_CPU_BUSY : pmLightSleep && !displayOn ? POWER_MA_CPU_SLEEP : POWER_MA_CPU_IDLE;
+  mA += WiFi.status() == WL_CONNECTED ? POWER_MA_WIFI : POWER_MA_WIFI_AWAKE;
+  if (displayOn) mA += POWER_MA_PANEL;
+  mA += POWER_MA_BACKLIGHT * backlightShown * backlightShown / (255 * 255);
+  return mA;
+}
+
+// Charge the time since the last call at the current estimate, before any change of state
+void accountPower() {
+  uint32_t now = millis();
+  chargeMicroCoulombs += (uint64_t)powerEstimateMilliamps() * (now - powerAccountedAt);
+  powerAccountedAt = now;
+}
+
+void beginPower() {
+  nightEnabled = prefs.getBool("nightOn", false);
+  nightFrom = prefs.getUShort("nightFrom", nightFrom) % 1440;
+  nightTo = prefs.getUShort("nightTo", nightTo) % 1440;
+  strlcpy(nightTz, prefs.getString("nightTz", nightTz).c_str(), sizeof(nightTz));
+  setenv("TZ", nightTz, 1);
+  tzset();
+
+#if CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t config = {};
+  config.max_freq_mhz = POWER_CPU_BUSY_MHZ;
+  config.min_freq_mhz = POWER_CPU_IDLE_MHZ;
+#ifdef CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  config.light_sleep_enable = true;
+#endif
+  if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "busy", &cpuLock) == ESP_OK &&
+      esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "display", &displayLock) == ESP_OK &&
+      esp_pm_lock_acquire(cpuLock) == ESP_OK && esp_pm_lock_acquire(displayLock) == ESP_OK &&
+      esp_pm_configure(&config) == ESP_OK) {
+    pmManaged = true;
+    pmLightSleep = config.light_sleep_enable;
+  }
+#endif
+  powerAccountedAt = millis();
+  Serial.printf("Power: %s%s\n", pmManaged ? "IDF power manager" : "clock scaling",
+                pmLightSleep ? " with light sleep" : "");
+}
+
+// Date and time for files written to the card, local time once NTP has set
+// the clock. Uploads then carry their real date, which the recent order uses.
+void sdDateTime(uint16_t *fatDate, uint16_t *fatTime) {
+  time_t now = time(NULL);
+  if (now < POWER_CLOCK_VALID) {
+    *fatDate = FS_DEFAULT_DATE;
+    *fatTime = FS_DEFAULT_TIME;
+    return;
+  }
+  struct tm local;
+  localtime_r(&now, &local);
+  *fatDate = FS_DATE(local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+  *fatTime = FS_TIME(local.tm_hour, local.tm_min, local.tm_sec);
+}
+
+// Modem sleep and NTP once Wi-Fi is up, from networkTask
+void beginNetworkPower() {
+  WiFi.setSleep(WIFI_PS_MIN_MODEM);
+  configTzTime(nightTz, POWER_NTP_SERVER);
+}
+
+void setCpuBusy(bool busy) {
+  if (busy == cpuBusy) return;
+  accountPower();
+  cpuBusy = busy;
+#if CONFIG_PM_ENABLE
+  if (pmManaged) {
+    if (busy) esp_pm_lock_acquire(cpuLock);
+    else esp_pm_lock_release(cpuLock);
+    return;
+  }
+#endif
+  setCpuFrequencyMhz(busy ? POWER_CPU_BUSY_MHZ : POWER_CPU_IDLE_MHZ);
+}
+
+// True while any task besides loop() has work that wants the full clock
+bool backgroundBusy() {
+  if (audioPlaying || benchRunning || otaRunning || cacheWorkPending) return true;
+  if (prefetchQueue && uxQueueMessagesWaiting(prefetchQueue)) return true;
+  for (int i = 0; i < PREFETCH_SLOTS; i++) {
+    if (prefetchSlots[i].state == SLOT_LOADING) return true;
+  }
+  return false;
+}
+
+// Backlight and panel off for the night, or back on. The panel keeps its
+// memory in sleep mode, so waking shows the slide it had.
+void setDisplayPower(bool on) {
+  accountPower();
+  displayOn = on;
+  if (on) {
+#if CONFIG_PM_ENABLE
+    if (pmManaged) esp_pm_lock_acquire(displayLock);
+#endif
+    tft.writecommand(TFT_SLPOUT);
+    delay(120);  // The controller needs this long out of sleep before it takes commands
+    tft.writecommand(TFT_DISPON);
+    setBacklight(backlightLevel);
+  } else {
+    setBacklight(0);
+    tft.writecommand(TFT_DISPOFF);
+    tft.writecommand(TFT_SLPIN);
+#if CONFIG_PM_ENABLE
+    if (pmManaged) esp_pm_lock_release(displayLock);
+#endif
+  }
+  Serial.printf("Display %s\n", on ? "on" : "off for the night");
+}
+
+bool nightTime() {
+  time_t now = time(NULL);
+  if (!nightEnabled || now < POWER_CLOCK_VALID) return false;
+  struct tm local;
+  localtime_r(&now, &local);
+  uint16_t minute = local.tm_hour * 60 + local.tm_min;
+  if (nightFrom <= nightTo) return minute >= nightFrom && minute < nightTo;
+  return minute >= nightFrom || minute < nightTo;  // Across midnight
+}
+
+// Follow the night schedule from loop(). input is a tap, swipe or hold, which
+// lights the display for POWER_WAKE_DISPLAY_MS at night. Returns true when it
+// woke the display, so it doesn't also change the slide.
+bool updateDisplayPower(bool input) {
+  bool night = nightTime();
+  bool woke = input && night && !displayOn;
+  if (input && night) {
+    displayWoken = true;
+    displayWokenAt = millis();
+  }
+  if (displayWoken && (!night || millis() - displayWokenAt > POWER_WAKE_DISPLAY_MS)) displayWoken = false;
+  bool on = !night || displayWoken;
+  if (on != displayOn) setDisplayPower(on);
+  return woke;
+}
+
+// "HH:MM" to the minute of the day, -1 if it isn't one
+int parseClockMinutes(const String &text) {
+  int colon = text.indexOf(':');
+  if (colon < 1) return -1;
+  int hours = text.substring(0, colon).toInt();
+  int minutes = text.substring(colon + 1).toInt();
+  if (hours < 0 || hours > 23 || minutes < 0 || minutes > 59) return -1;
+  return hours * 60 + minutes;
+}
+
+// The night schedule in one word for a FrameCommand's arg: the two minutes of
+// the day in 11 bits each, then the enabled flag
+int32_t packNightSchedule(bool enabled, uint16_t from, uint16_t to) {
+  return from | to << 11 | enabled << 22;
+}
+
+// Apply and keep a schedule from /set-power, from loop(). A null or empty tz
+// keeps the time zone.
+void setNightSchedule(int32_t packed, const char *tz) {
+  nightFrom = (packed & 0x7FF) % 1440;
+  nightTo = (packed >> 11 & 0x7FF) % 1440;
+  nightEnabled = packed >> 22 & 1;
+  prefs.putUShort("nightFrom", nightFrom);
+  prefs.putUShort("nightTo", nightTo);
+  prefs.putBool("nightOn", nightEnabled);
+  if (tz && tz[0]) {
+    strlcpy(nightTz, tz, sizeof(nightTz));
+    prefs.putString("nightTz", nightTz);
+    setenv("TZ", nightTz, 1);
+    tzset();
+  }
+}
+
+void printPowerJson(Print &out, bool enabled, uint16_t from, uint16_t to, const char *tz) {
+  out.printf("{\"enabled\":%s,\"from\":\"%02u:%02u\",\"to\":\"%02u:%02u\",\"tz\":",
+             enabled ? "true" : "false", from / 60, from % 60, to / 60, to % 60);
+  printJsonString(out, tz);
+  out.printf(",\"clock\":%s,\"displayOn\":%s,\"estimatedMilliamps\":%lu,\"cpuMHz\":%lu}",
+             time(NULL) >= POWER_CLOCK_VALID ? "true" : "false", displayOn ? "true" : "false",
+             (unsigned long)powerEstimateMilliamps(), (unsigned long)getCpuFrequencyMhz());
+}
+
+void printPowerMetrics(Print &out) {
+  printMetric(out, "photoframe_supply_current_estimated_ma", "gauge", "Supply current estimated from the state of each part, not measured",
+              powerEstimateMilliamps());
+  printMetric(out, "photoframe_supply_charge_estimated_mc_total", "counter", "Charge drawn since boot, estimated, not measured",
+              chargeMicroCoulombs / 1000);
+  printMetric(out, "photoframe_cpu_mhz", "gauge", "CPU clock", getCpuFrequencyMhz());
+  printMetric(out, "photoframe_display_on", "gauge", "1 unless the night schedule has the display off", displayOn);
+}
+
+// Frame sync
+// Frames on one LAN can change slides together: one leads and the others follow
+// over UDP multicast on syncGroup. The leader announces each change SYNC_LEAD_MS
+// ahead, as the image name (indexes differ between cards) and the time to show
+// it on its esp_timer clock, and shows it then itself. Followers ping the
+// leader and take its clock offset from the answer with the shortest round trip
+// among the last SYNC_OFFSET_SAMPLES, so a late packet doesn't skew it. They
+// prefetch each announced image as it comes and show it at the same instant.
+// A follower that hasn't heard from the leader for SYNC_LEADER_TIMEOUT_MS goes
+// back to its own timer. One leader per LAN.
+// Only frames with PSRAM hold the slide decoded, and start one push to the
+// panel at the instant. Without it a full frame doesn't fit in RAM, so the
+// prefetch holds the file and the JPEG is still decoded as it's drawn: frames
+// start together but finish apart by the difference in decode time, which can
+// be a few hundred ms between images and cards.
+#define SYNC_PORT 45045
+#define SYNC_MAGIC 0x31535046          // "PFS1"
+#define SYNC_LEAD_MS 1500              // Time followers get to read and decode the slide
+#define SYNC_PING_MS 2000
+#define SYNC_LEADER_TIMEOUT_MS 10000
+#define SYNC_OFFSET_SAMPLES 8
+#define SYNC_MAX_ROUND_TRIP_US 500000  // Slower answers aren't worth a sample
+#define SYNC_NAME_MAX 100              // As buildImageIndex reads names
+
+const IPAddress syncGroup(239, 255, 80, 70);
+
+enum SyncRole : uint8_t { SYNC_OFF, SYNC_LEADER, SYNC_FOLLOWER, SYNC_ROLE_COUNT };
+const char *const syncRoleNames[SYNC_ROLE_COUNT] = {"off", "leader", "follower"};
+
+enum SyncMessage : uint8_t { SYNC_SLIDE, SYNC_PING, SYNC_PONG };
+
+struct __attribute__((packed)) SyncPacket {
+  uint32_t magic;
+  SyncMessage type;
+  int64_t sent;  // PING and PONG: the follower's clock when it pinged
+  int64_t at;    // SLIDE: the leader's clock to show it at, PONG: when it answered
+  char name[SYNC_NAME_MAX];  // SLIDE only, sent up to its NUL
+};
+
+#define SYNC_HEADER_SIZE offsetof(SyncPacket, name)
+
+struct SyncSample {
+  int64_t roundTrip;
+  int64_t offset;  // Leader clock less ours
+};
+
+AsyncUDP syncUdp;
+volatile SyncRole syncRole = SYNC_OFF;  // Chosen on /speed, kept in NVS
+volatile bool syncListening = false;
+volatile uint32_t syncLeaderSeenAt = 0;
+volatile bool syncOffsetValid = false;
+SyncSample syncSamples[SYNC_OFFSET_SAMPLES];  // Only touched by the UDP task
+uint8_t syncSampleCount = 0;
+uint8_t syncSampleNext = 0;
+int64_t syncOffset = 0;
+volatile int64_t syncRoundTrip = 0;  // Of the sample in use
+uint32_t syncPingAt = 0;
+
+// The slide loop() shows at syncPresentAt, announced or followed
+bool syncPending = false;
+uint16_t syncIndex = 0;
+uint32_t syncPresentAt = 0;
+
+bool syncFollowing() {
+  return syncRole == SYNC_FOLLOWER && syncOffsetValid && millis() - syncLeaderSeenAt < SYNC_LEADER_TIMEOUT_MS;
+}
+
+// Keep the answer with the shortest round trip of the last few
+void addSyncSample(const SyncPacket &pong) {
+  int64_t now = esp_timer_get_time();
+  int64_t roundTrip = now - pong.sent;
+  if (roundTrip < 0 || roundTrip > SYNC_MAX_ROUND_TRIP_US) return;
+  syncSamples[syncSampleNext] = {roundTrip, pong.at - (pong.sent + now) / 2};
+  syncSampleNext = (syncSampleNext + 1) % SYNC_OFFSET_SAMPLES;
+  if (syncSampleCount < SYNC_OFFSET_SAMPLES) syncSampleCount++;
+
+  const SyncSample *best = &syncSamples[0];
+  for (uint8_t i = 1; i < syncSampleCount; i++) {
+    if (syncSamples[i].roundTrip < best->roundTrip) best = &syncSamples[i];
+  }
+  syncOffset = best->offset;
+  syncRoundTrip = best->roundTrip;
+  syncOffsetValid = true;
+  syncLeaderSeenAt = millis();
+}
+
+// Runs in the AsyncUDP task: answer pings as the leader, hand announced slides
+// to loop() as a follower
+void handleSyncPacket(AsyncUDPPacket &packet) {
+  SyncPacket message;
+  size_t length = packet.length();
+  if (length < SYNC_HEADER_SIZE || length > sizeof(message)) return;
+  memcpy(&message, packet.data(), length);
+  if (message.magic != SYNC_MAGIC) return;
+
+  if (syncRole == SYNC_LEADER && message.type == SYNC_PING) {
+    message.type = SYNC_PONG;
+    message.at = esp_timer_get_time();
+    packet.write((const uint8_t *)&message, SYNC_HEADER_SIZE);
+  } else if (syncRole == SYNC_FOLLOWER && message.type == SYNC_PONG) {
+    addSyncSample(message);
+  } else if (syncRole == SYNC_FOLLOWER && message.type == SYNC_SLIDE && syncOffsetValid &&
+             length > SYNC_HEADER_SIZE && message.name[length - SYNC_HEADER_SIZE - 1] == '\0') {
+    syncLeaderSeenAt = millis();
+    uint32_t at = (uint32_t)(message.at - syncOffset);  // On our micros() clock
+    postFrameCommand(CMD_SYNC_SLIDE, (int32_t)at, message.name);
+  }
+}
+
+// Join the group once Wi-Fi is up, from networkTask
+void beginSync() {
+  if (!syncUdp.listenMulticast(syncGroup, SYNC_PORT)) {
+    Serial.println("Frame sync unavailable, can't join the multicast group");
+    return;
+  }
+  syncUdp.onPacket(handleSyncPacket);
+  syncListening = true;
+}
+
+// From loop(): the follower's pings, at most every SYNC_PING_MS
+void pollSync() {
+  if (syncRole != SYNC_FOLLOWER || !syncListening || millis() - syncPingAt < SYNC_PING_MS) return;
+  syncPingAt = millis();
+  SyncPacket ping = {SYNC_MAGIC, SYNC_PING, esp_timer_get_time(), 0};
+  syncUdp.writeTo((const uint8_t *)&ping, SYNC_HEADER_SIZE, syncGroup, SYNC_PORT);
+}
+
+void setSyncRole(SyncRole role) {
+  if (role >= SYNC_ROLE_COUNT || role == syncRole) return;
+  syncRole = role;
+  syncPending = false;
+  prefs.putUChar("sync", role);
+  Serial.printf("Frame sync: %s\n", syncRoleNames[role]);
+}
+
+// Sync role by its name on the web page, SYNC_ROLE_COUNT if unknown
+SyncRole syncRoleByName(const char *name) {
+  for (int i = 0; i < SYNC_ROLE_COUNT; i++) {
+    if (strcmp(name, syncRoleNames[i]) == 0) return (SyncRole)i;
+  }
+  return SYNC_ROLE_COUNT;
+}
+
+// As the leader, announce the slide loop() just moved to and schedule it.
+// Returns false when not leading, and the slide is shown straight away.
+bool announceSyncedSlide(uint16_t index) {
+  if (syncRole != SYNC_LEADER || !syncListening) return false;
+  SyncPacket slide = {SYNC_MAGIC, SYNC_SLIDE, 0, esp_timer_get_time() + SYNC_LEAD_MS * 1000LL};
+  takeSpiMutex();
+  bool ok = index < fileCount;
+  if (ok) strlcpy(slide.name, imageName(index), sizeof(slide.name));
+  giveSpiMutex();
+  if (!ok) return false;
+
+  syncUdp.writeTo((const uint8_t *)&slide, SYNC_HEADER_SIZE + strlen(slide.name) + 1, syncGroup, SYNC_PORT);
+  prefetchImage(index);
+  syncIndex = index;
+  syncPresentAt = (uint32_t)slide.at;
+  syncPending = true;
+  return true;
+}
+
+// As a follower, move to the slide the leader announced, or to the next one
+// if this card doesn't have it, and read it ahead for the agreed instant
+void followSyncedSlide(const char *name, uint32_t at) {
+  if (syncRole != SYNC_FOLLOWER || slideshowPaused || fileCount == 0) return;
+  takeSpiMutex();
+  int32_t index = findImageEntry(name);
+  if (index >= 0) currentIndex = index;
+  else advanceSlide(1);
+  uint16_t next = currentIndex;
+  giveSpiMutex();
+  prefetchImage(next);
+  syncIndex = next;
+  syncPresentAt = at;
+  syncPending = true;
+}
+
+// Sleep through the wait but its last ms, which is spun out so every frame
+// starts drawing on the same tick
+void presentSyncedSlide() {
+  syncPending = false;
+  int32_t left = (int32_t)(syncPresentAt - micros());
+  if (left > 2000) vTaskDelay(pdMS_TO_TICKS(left / 1000 - 1));
+  while ((int32_t)(syncPresentAt - micros()) > 0) {
+  }
+  loadImage(syncIndex);
+  timer = millis();
+}
+
+// Firmware update
+// POST /update takes the firmware.bin PlatformIO builds (the same image web/
+// flashes over USB) as a multipart upload and streams it into the OTA slot
+// that isn't running, through the Update library's one-sector buffer, so the
+// image is never held in RAM. min_spiffs.csv already has two 1.9 MB app
+// slots, which is the firmware's size limit. The slideshow keeps going while
+// it's written: background transcodes wait and Wi-Fi leaves modem sleep for
+// the transfer. Once the image checks out, loop() restarts into it. Builds
+// with -DOTA_PASSWORD="..." ask for it as user "admin".
+#define OTA_RESTART_DELAY_MS 1000  // Lets the answer reach the browser first
+#define OTA_LOG_STEP (256 * 1024)  // Progress on the serial monitor
+
+AsyncWebServerRequest *otaRequest = nullptr;  // The one request writing the update
+uint32_t otaWritten = 0;
+
+bool otaAuthorized(AsyncWebServerRequest *request) {
+#ifdef OTA_PASSWORD
+  return request->authenticate("admin", OTA_PASSWORD);
+#else
+  return true;
+#endif
+}
+
+void endOta() {
+  otaRequest = nullptr;
+  otaRunning = false;
+  WiFi.setSleep(WIFI_PS_MIN_MODEM);
+}
+
+// Body handler: called for each piece of the firmware file, in order
+void handleUpdateData(AsyncWebServerRequest *request, const String &filename, size_t index,
+                      uint8_t *data, size_t len, bool final) {
+  if (index == 0) {
+    if (otaRequest || !otaAuthorized(request)) return;  // Another update has the slot
+    otaRequest = request;
+    otaRunning = true;
+    otaWritten = 0;
+    request->onDisconnect([request]() {
+      if (otaRequest != request) return;  // Finished, or never started
+      Serial.println("Firmware update aborted");
+      Update.abort();
+      endOta();
+    });
+    WiFi.setSleep(false);  // Full speed for the transfer
+    Serial.printf("Firmware update from %s\n", filename.c_str());
+    if (!Update.begin(UPDATE_SIZE_UNKNOWN, U_FLASH)) return;
+    if (request->hasParam("md5")) Update.setMD5(request->getParam("md5")->value().c_str());
+  }
+  if (otaRequest != request || Update.hasError()) return;
+
+  if (Update.write(data, len) != len) return;
+  if ((otaWritten + len) / OTA_LOG_STEP != otaWritten / OTA_LOG_STEP) {
+    Serial.printf("Firmware update: %lu KB written\n", (unsigned long)(otaWritten + len) / 1024);
+  }
+  otaWritten += len;
+  if (final) Update.end(true);  // Checks the image, and the MD5 if one was given
+}
+
+// Update request complete: answer, then have loop() restart into the new image
+void handleUpdateRequest(AsyncWebServerRequest *request) {
+  if (!otaAuthorized(request)) {
+    request->requestAuthentication();
+    return;
+  }
+  if (otaRequest != request) {
+    request->send(otaRequest ? 409 : 400, "application/json", otaRequest ?
+                  "{\"ok\":false,\"error\":\"Another update is running\"}" :
+                  "{\"ok\":false,\"error\":\"No firmware in the request\"}");
+    return;
+  }
+
+  bool ok = Update.isFinished() && !Update.hasError();
+  StreamString json;
+  json.printf("{\"ok\":%s,\"bytes\":%lu,\"error\":", ok ? "true" : "false", (unsigned long)otaWritten);
+  printJsonString(json, ok ? "" : Update.errorString());
+  json.print('}');
+  if (!ok) {
+    Serial.printf("Firmware update failed: %s\n", Update.errorString());
+    Update.abort();
+  }
+  endOta();
+  request->send(ok ? 200 : 500, "application/json", json);
+  if (ok) postFrameCommand(CMD_RESTART);
+}
+
+// What's running, for the update page
+void printFirmwareJson(Print &out) {
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  out.printf("{\"board\":\"%s\",\"built\":\"%s %s\",\"partition\":\"%s\",\"md5\":\"%s\",\"updating\":%s}",
+             BOARD_VARIANT, __DATE__, __TIME__, running ? running->label : "", ESP.getSketchMD5().c_str(),
+             otaRunning ? "true" : "false");
+}
+
+// Setup the web server: the web UI, its JSON API, uploads, deletes and images
+void setupWebServer() {
+  // Pages, styles and scripts of the web UI, gzipped in flash
+  for (const WebAsset &asset : webAssets) {
+    server.on(asset.path, HTTP_GET, [&asset](AsyncWebServerRequest *request) {
+      sendWebAsset(request, asset);
+    });
+  }
+
+  // Benchmark: POST queues a run, GET returns the results of the last one
+  server.on("/bench", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (benchState != BENCH_QUEUED && !benchRunning) {
+      BenchState last = benchState;
+      benchState = BENCH_QUEUED;  // Before the command, which runs only a queued benchmark
+      if (!postFrameCommand(CMD_BENCH)) {
+        benchState = last;
+        sendBusy(request);
+        return;
+      }
+    }
+    request->send(202, "application/json", "{\"state\":\"running\"}");
+  });
+
+  server.on("/bench", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (benchState == BENCH_QUEUED || benchRunning) {
+      request->send(200, "application/json", "{\"state\":\"running\"}");
+      return;
+    }
+    if (benchState == BENCH_IDLE) {
+      request->send(200, "application/json", "{\"state\":\"idle\"}");
+      return;
+    }
+    if (!trySpiMutex()) {
+      sendBusy(request);
+      return;
+    }
+    String result = benchResult;
+    giveSpiMutex();
+    AsyncWebServerResponse *response = request->beginResponse(200, "application/json", result);
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+  });
+
+  // Current settings and status for the pages
+  server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!trySpiMutex()) {
+      sendBusy(request);
+      return;
+    }
+    String name = currentImageName;
+    String album = albumName();
+    uint16_t count = fileCount;
+    giveSpiMutex();
+
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->addHeader("Cache-Control", "no-store");
+    response->printf("{\"speed\":%d,\"transition\":\"%s\",\"order\":\"%s\",\"images\":%u,\"current\":", X,
+                     transitionNames[transition], playOrderNames[playOrder], count);
+    printJsonString(*response, name.c_str());
+    response->print(",\"album\":");
+    printJsonString(*response, album.c_str());
+    response->printf(",\"audio\":%s,\"sdMHz\":%u,\"sdKBps\":%lu,\"sync\":\"%s\",\"syncFollowing\":%s}",
+                     audioPlaying ? "true" : "false", sdSpiMHz, (unsigned long)sdReadKBps, syncRoleNames[syncRole],
+                     syncFollowing() ? "true" : "false");
+    request->send(response);
+  });
+
+  // Albums: GET lists them, POST with name switches (empty for the root folder)
+  server.on("/albums", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!trySpiMutex()) {
+      sendBusy(request);
+      return;
+    }
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->addHeader("Cache-Control", "no-store");
+    printAlbumList(*response);
+    giveSpiMutex();
+    request->send(response);
+  });
+
+  server.on("/albums", HTTP_POST, [](AsyncWebServerRequest *request) {
+    String name = request->hasParam("name", true) ? request->getParam("name", true)->value() : String();
+    if (name.length() && !isAlbumName(name.c_str())) {
+      request->send(400, "application/json", "{\"ok\":false}");
+      return;
+    }
+    if (!requestAlbum(name.c_str())) {
+      sendBusy(request);
+      return;
+    }
+    request->send(202, "application/json", "{\"ok\":true}");
+  });
+
+  // Performance telemetry in Prometheus text format, for the fleet dashboard
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+    response->addHeader("Cache-Control", "no-store");
+
+    printHistogram(*response, "photoframe_slide_lookup_seconds", "Time to find a slide in the image index", metrics.slideLookup);
+    printHistogram(*response, "photoframe_slide_open_seconds", "Time to open a slide's file on the SD card", metrics.slideOpen);
+    printHistogram(*response, "photoframe_slide_decode_seconds", "JPEG decode time per slide, including its reads but not its pushes", metrics.slideDecode);
+    printHistogram(*response, "photoframe_slide_push_seconds", "Time spent pushing a slide to the panel", metrics.slidePush);
+    printHistogram(*response, "photoframe_sd_lock_wait_seconds", "Time spent waiting for the SD bus lock", metrics.spiWait);
+
+    printMetric(*response, "photoframe_sd_read_bytes_total", "counter", "Bytes read from the SD card", metrics.sdBytesRead);
+    printMetric(*response, "photoframe_sd_read_errors_total", "counter", "Failed SD card reads", metrics.sdReadErrorsTotal);
+    printMetric(*response, "photoframe_sd_seek_errors_total", "counter", "Failed SD card seeks", metrics.sdSeekErrorsTotal);
+    printMetric(*response, "photoframe_sd_open_errors_total", "counter", "Indexed images that failed to open",
+                metrics.sdOpenErrorsTotal);
+    printMetric(*response, "photoframe_sd_timeouts_total", "counter", "SD card reads slower than the timeout",
+                metrics.sdTimeoutsTotal);
+    printMetric(*response, "photoframe_sd_remounts_total", "counter", "Remounts after repeated SD card errors",
+                metrics.sdRemountsTotal);
+    printMetric(*response, "photoframe_sd_mount_failures_total", "counter", "Failed attempts at mounting a lost SD card",
+                metrics.sdMountFailuresTotal);
+    printMetric(*response, "photoframe_sd_mounted", "gauge", "1 while the SD card is mounted", sdMounted);
+    printMetric(*response, "photoframe_sync_following", "gauge", "1 while following a leader's slides",
+                syncFollowing());
+    printMetric(*response, "photoframe_sync_round_trip_microseconds", "gauge",
+                "Round trip of the ping the leader's clock offset is taken from", syncRoundTrip);
+    printMetric(*response, "photoframe_sd_clock_mhz", "gauge", "SD card SPI clock", sdSpiMHz);
+    printMetric(*response, "photoframe_images", "gauge", "Images in the index", fileCount);
+
+    printMetric(*response, "photoframe_heap_free_bytes", "gauge", "Free heap", esp_get_free_heap_size());
+    printMetric(*response, "photoframe_heap_min_free_bytes", "gauge", "Lowest free heap since boot", esp_get_minimum_free_heap_size());
+    printMetric(*response, "photoframe_heap_largest_free_block_bytes", "gauge", "Largest allocatable block",
+                heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    printMetric(*response, "photoframe_heap_internal_free_bytes", "gauge", "Free internal RAM",
+                heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    printMetric(*response, "photoframe_psram_free_bytes", "gauge", "Free PSRAM", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    printTaskStacks(*response);
+
+    printMetric(*response, "photoframe_websocket_clients", "gauge", "Connected WebSocket clients", ws.count());
+    printMetric(*response, "photoframe_websocket_dropped_total", "counter", "WebSocket clients dropped for a full send queue",
+                wsClientsDropped);
+    printMetric(*response, "photoframe_touch_dropped_total", "counter", "Touch gestures dropped for a full queue",
+                touchEventsDropped);
+    printMetric(*response, "photoframe_commands_dropped_total", "counter", "Commands to loop() dropped for a full queue",
+                frameCommandsDropped);
+    printMetric(*response, "photoframe_web_busy_total", "counter", "Web requests and chunks turned away while the SD card was busy",
+                webSpiBusy);
+    printPowerMetrics(*response);
+    if (WiFi.status() == WL_CONNECTED) {
+      printMetric(*response, "photoframe_wifi_rssi_dbm", "gauge", "Wi-Fi signal strength", WiFi.RSSI());
+    }
+    printMetric(*response, "photoframe_uptime_seconds", "counter", "Time since boot", esp_timer_get_time() / 1000000);
+    request->send(response);
   });
 
-  // Define the /speed page
-  server.on("/speed", HTTP_GET, [&](AsyncWebServerRequest *request) {
-      String html = R"rawliteral(
-      <!DOCTYPE html>
-      <html>
-      <head>
-        <title>Set Slideshow Speed</title>
-        <style>
-          body {
-            font-family: Arial, sans-serif;
-            background-color: #f0f0f0;
-            text-align: center;
-            margin: 0;
-            padding: 0;
-          }
-          h1 {
-            background-color: #333;
-            color: white;
-            padding: 20px;
-            margin: 0;
-          }
-          .container {
-            padding: 20px;
-          }
-          .input-field {
-            padding: 10px;
-            font-size: 16px;
-            width: 200px;
-            margin-bottom: 20px;
-          }
-          .button {
-            display: inline-block;
-            padding: 15px 25px;
-            font-size: 16px;
-            margin: 10px;
-            cursor: pointer;
-            text-align: center;
-            text-decoration: none;
-            outline: none;
-            color: #fff;
-            background-color: #4CAF50;
-            border: none;
-            border-radius: 15px;
-            box-shadow: 0 5px #999;
-          }
-          .button:hover {background-color: #3e8e41}
-          .button:active {
-            background-color: #3e8e41;
-            box-shadow: 0 3px #666;
-            transform: translateY(2px);
-          }
-        </style>
-      </head>
-      <body>
-        <h1>Set Slideshow Speed</h1>
-        <div class="container">
-          <form action="/set-speed" method="POST">
-            <label for="speed">Enter slideshow speed (in seconds):</label><br>
-            <input type="number" id="speed" name="speed" min="1" value=")rawliteral" + String(X) + R"rawliteral(" class="input-field"><br>
-            <input type="submit" value="Set Speed" class="button">
-          </form>
-          <a href="/" class="button">Go Back to Main Page</a>
-        </div>
-      </body>
-      </html>
-      )rawliteral";
-      request->send(200, "text/html", html);
+  // One page of the image index for the delete page: ?offset=&limit=&prefix=
+  server.on("/api/files", HTTP_GET, [](AsyncWebServerRequest *request) {
+    FileListing listing;
+    if (request->hasParam("prefix")) listing.prefix = request->getParam("prefix")->value();
+    long offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+    long limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : FILE_LIST_LIMIT;
+
+    if (!trySpiMutex()) {
+      sendBusy(request);
+      return;
+    }
+    for (uint16_t i = 0; i < fileCount; i++) {
+      if (listingMatches(listing, i)) listing.total++;
+    }
+    listing.album = albumGeneration;
+    listing.generation = imageIndexGeneration;
+    giveSpiMutex();
+
+    listing.offset = constrain(offset, 0L, (long)listing.total);
+    listing.skip = listing.offset;
+    listing.remaining = constrain(limit, 0L, (long)UINT16_MAX);
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+      [listing](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        return fillFileListing(listing, buffer, maxLen);
+      });
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
   });
 
-  // Define the /set-speed page
-  server.on("/set-speed", HTTP_POST, [&](AsyncWebServerRequest *request) {
+  // Set the slideshow speed, answers with the speed now in effect
+  server.on("/set-speed", HTTP_POST, [](AsyncWebServerRequest *request) {
+    // loop() applies them, so answer with what it's been asked for
+    int speed = X;
+    Transition style = transition;
     if (request->hasParam("speed", true)) {
-        String speedValue = request->getParam("speed", true)->value();
-        X = speedValue.toInt();
-        Serial.printf("Slideshow speed updated to: %d seconds\n", X);
-    }
-    String html = R"rawliteral(
-    <!DOCTYPE html>
-    <html>
-    <head>
-      <title>Speed Updated</title>
-      <style>
-        body {
-          font-family: Arial, sans-serif;
-          background-color: #f0f0f0;
-          text-align: center;
-          margin: 0;
-          padding: 0;
-        }
-        h1 {
-          background-color: #333;
-          color: white;
-          padding: 20px;
-          margin: 0;
-        }
-        .container {
-          padding: 20px;
-        }
-        .button {
-          display: inline-block;
-          padding: 15px 25px;
-          font-size: 16px;
-          margin: 10px;
-          cursor: pointer;
-          text-align: center;
-          text-decoration: none;
-          outline: none;
-          color: #fff;
-          background-color: #4CAF50;
-          border: none;
-          border-radius: 15px;
-          box-shadow: 0 5px #999;
-        }
-        .button:hover {background-color: #3e8e41}
-        .button:active {
-          background-color: #3e8e41;
-          box-shadow: 0 3px #666;
-          transform: translateY(2px);
-        }
-      </style>
-    </head>
-    <body>
-      <h1>Slideshow Speed Updated</h1>
-      <div class="container">
-        <p>Slideshow speed updated successfully!</p>
-        <a href="/speed" class="button">Go Back</a>
-        <a href="/" class="button">Go Back to Main Page</a>
-      </div>
-    </body>
-    </html>
-    )rawliteral";
-    request->send(200, "text/html", html);
+        speed = max(1, (int)request->getParam("speed", true)->value().toInt());
+        postFrameCommand(CMD_SPEED, speed);
+    }
+    if (request->hasParam("transition", true)) {
+        Transition requested = transitionByName(request->getParam("transition", true)->value().c_str());
+        if (requested < TRANSITION_COUNT && postFrameCommand(CMD_TRANSITION, requested)) style = requested;
+    }
+    PlayOrder order = playOrder;
+    if (request->hasParam("order", true)) {
+        PlayOrder requested = playOrderByName(request->getParam("order", true)->value().c_str());
+        if (requested < ORDER_COUNT && postFrameCommand(CMD_ORDER, requested)) order = requested;
+    }
+    SyncRole role = syncRole;
+    if (request->hasParam("sync", true)) {
+        SyncRole requested = syncRoleByName(request->getParam("sync", true)->value().c_str());
+        if (requested < SYNC_ROLE_COUNT && postFrameCommand(CMD_SYNC_ROLE, requested)) role = requested;
+    }
+    request->send(200, "application/json",
+                  "{\"speed\":" + String(speed) + ",\"transition\":\"" + transitionNames[style] +
+                  "\",\"order\":\"" + playOrderNames[order] + "\",\"sync\":\"" + syncRoleNames[role] + "\"}");
   });
 
-  // Route to handle play music button
-  server.on("/play-music", HTTP_GET, handlePlayMusicRequest);
+  // Night schedule: GET for the power page, POST with enabled, from, to (HH:MM) and tz
+  server.on("/api/power", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->addHeader("Cache-Control", "no-store");
+    printPowerJson(*response, nightEnabled, nightFrom, nightTo, nightTz);
+    request->send(response);
+  });
 
-  // File upload form handler
-  server.on("/upload_file", HTTP_GET, [](AsyncWebServerRequest *request) {
-      String html = R"rawliteral(
-      <!DOCTYPE html>
-      <html>
-      <head>
-        <title>Upload Image</title>
-        <style>
-          body {
-            font-family: Arial, sans-serif;
-            background-color: #f0f0f0;
-            text-align: center;
-            margin: 0;
-            padding: 0;
-          }
-          h1 {
-            background-color: #333;
-            color: white;
-            padding: 20px;
-            margin: 0;
-          }
-          .container {
-            padding: 20px;
-          }
-          .button, .submit-button {
-            display: inline-block;
-            padding: 15px 25px;
-            font-size: 16px;
-            margin: 10px;
-            cursor: pointer;
-            text-align: center;
-            text-decoration: none;
-            outline: none;
-            color: #fff;
-            background-color: #4CAF50;
-            border: none;
-            border-radius: 15px;
-            box-shadow: 0 5px #999;
-          }
-          .button:hover, .submit-button:hover {background-color: #3e8e41}
-          .button:active, .submit-button:active {
-            background-color: #3e8e41;
-            box-shadow: 0 3px #666;
-            transform: translateY(2px);
-          }
-          .input-file {
-            font-size: 16px;
-            margin-bottom: 20px;
-          }
-        </style>
-      </head>
-      <body>
-        <h1>Upload a New Image</h1>
-        <div class="container">
-          <form method="POST" action="/upload_file" enctype="multipart/form-data">
-            <input type="file" name="file" id="file" class="input-file"><br>
-            <input type="submit" value="Upload" class="submit-button">
-          </form>
-          <a href="/" class="button">Go Back to Main Page</a>
-        </div>
-      </body>
-      </html>
-      )rawliteral";
-      request->send(200, "text/html", html);
+  server.on("/set-power", HTTP_POST, [](AsyncWebServerRequest *request) {
+    // Checked here, applied by loop(), so answer with what it's been asked for
+    int from = request->hasParam("from", true) ? parseClockMinutes(request->getParam("from", true)->value()) : nightFrom;
+    int to = request->hasParam("to", true) ? parseClockMinutes(request->getParam("to", true)->value()) : nightTo;
+    String tz = request->hasParam("tz", true) ? request->getParam("tz", true)->value() : String();
+    if (from < 0 || to < 0 || tz.length() >= POWER_TZ_MAX) {
+      request->send(400, "application/json", "{\"ok\":false}");
+      return;
+    }
+    bool enabled = request->hasParam("enabled", true) ? request->getParam("enabled", true)->value() == "true"
+                                                      : nightEnabled;
+    if (!postFrameCommand(CMD_POWER, packNightSchedule(enabled, from, to), tz.length() ? tz.c_str() : nullptr)) {
+      request->send(503, "application/json", "{\"ok\":false}");
+      return;
+    }
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    printPowerJson(*response, enabled, from, to, tz.length() ? tz.c_str() : nightTz);
+    request->send(response);
   });
 
-  // File upload processing handler
-  server.on("/upload_file", HTTP_POST, handleFileUpload,
-      [](AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final) {
-          static SdBaseFile file;
-          if (index == 0) {
-              if (!file.open(("/" + filename).c_str(), O_WRITE | O_CREAT | O_TRUNC)) return;
-          }
-          if (file.write(data, len) != len) return;
-          if (final) file.close();
-      }
-  );
+  // Color correction and brightness: GET for the color page, POST with any of
+  // gamma, red, green, blue and brightness, all in percent
+  server.on("/api/color", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->addHeader("Cache-Control", "no-store");
+    printColorJson(*response, colorSettings, backlightLevel);
+    request->send(response);
+  });
 
-  // File delete page handler
-  server.on("/delete", HTTP_GET, [](AsyncWebServerRequest *request) {
-      String html = R"rawliteral(
-      <!DOCTYPE html>
-      <html>
-      <head>
-        <title>Delete Images</title>
-        <style>
-          body {
-            font-family: Arial, sans-serif;
-            background-color: #f0f0f0;
-            text-align: center;
-            margin: 0;
-            padding: 0;
-          }
-          h1 {
-            background-color: #333;
-            color: white;
-            padding: 20px;
-            margin: 0;
-          }
-          .container {
-            padding: 20px;
-            text-align: left;
-            display: inline-block;
-          }
-          .button, .submit-button {
-            display: inline-block;
-            padding: 15px 25px;
-            font-size: 16px;
-            margin: 10px;
-            cursor: pointer;
-            text-align: center;
-            text-decoration: none;
-            outline: none;
-            color: #fff;
-            background-color: #4CAF50;
-            border: none;
-            border-radius: 15px;
-            box-shadow: 0 5px #999;
-          }
-          .button:hover, .submit-button:hover {background-color: #3e8e41}
-          .button:active, .submit-button:active {
-            background-color: #3e8e41;
-            box-shadow: 0 3px #666;
-            transform: translateY(2px);
-          }
-          input[type=checkbox] {
-            margin: 5px;
-            transform: scale(1.5);
-          }
-        </style>
-      </head>
-      <body>
-        <h1>Delete Images</h1>
-        <div class="container">
-          <form method="POST" action="/delete_files">
-      )rawliteral";
-
-      // Make sure SD card is initialized
-      if (!checkAndMountSDCard()) {
-          request->send(500, "text/html", "<h3>SD Card Mount Failed!</h3>");
-          return;
+  server.on("/set-color", HTTP_POST, [](AsyncWebServerRequest *request) {
+    // loop() applies them, so answer with what it's been asked for
+    ColorSettings settings = colorSettings;
+    uint8_t *fields[] = {&settings.gamma, &settings.red, &settings.green, &settings.blue};
+    const char *names[] = {"gamma", "red", "green", "blue"};
+    for (int i = 0; i < 4; i++) {
+      if (request->hasParam(names[i], true)) {
+        *fields[i] = constrain((int)request->getParam(names[i], true)->value().toInt(), 0, 255);
       }
+    }
+    settings = unpackColorSettings(packColorSettings(settings));  // Clamped to the ranges
+    if (!postFrameCommand(CMD_COLOR, packColorSettings(settings))) settings = colorSettings;
+    uint8_t level = backlightLevel;
+    if (request->hasParam("brightness", true)) {
+      int percent = constrain((int)request->getParam("brightness", true)->value().toInt(), 1, 100);
+      uint8_t requested = (percent * 255 + 50) / 100;
+      if (postFrameCommand(CMD_BRIGHTNESS, requested)) level = requested;
+    }
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    printColorJson(*response, settings, level);
+    request->send(response);
+  });
 
-      root.rewind();
-      SdBaseFile entry;
-      char name[100];
-      bool fileFound = false;
-
-      // Iterate through all files
-      while (entry.openNext(&root)) {
-          entry.getName(name, sizeof(name));
-          Serial.printf("Found file: %s\n", name);
-
-          // Skip unwanted files or directories
-          if (strcasecmp(name, "System Volume Information") == 0) {
-              entry.close();
-              continue;  // Skip this file or directory
-          }
-
-          // List all other files
-          html += "<input type='checkbox' name='file' value='" + String(name) + "'>" + String(name) + "<br>";
-          fileFound = true;
-          entry.close();
-      }
+  // Firmware update: POST streams firmware.bin into the other OTA slot, GET says what's running
+  server.on("/update", HTTP_POST, handleUpdateRequest, handleUpdateData);
 
-      if (!fileFound) {
-          html += "<p>No files found.</p>";
-          Serial.println("No files found for deletion.");
-      }
+  server.on("/api/update", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->addHeader("Cache-Control", "no-store");
+    printFirmwareJson(*response);
+    request->send(response);
+  });
 
-      html += R"rawliteral(
-            <input type="submit" value="Delete Selected Files" class="submit-button">
-          </form>
-          <a href="/" class="button">Go Back to Main Page</a>
-        </div>
-      </body>
-      </html>
-      )rawliteral";
+  // Route to handle play music button
+  server.on("/play-music", HTTP_GET, handlePlayMusicRequest);
 
-      request->send(200, "text/html", html);
-  });
+  // File upload processing handler
+  server.on("/upload_file", HTTP_POST, handleFileUpload, handleUploadData);
 
-  // File deletion handler
+  // File deletion handler: loop() deletes them, in order, after the answer
   server.on("/delete_files", HTTP_POST, [](AsyncWebServerRequest *request) {
+      // All the names go in one command (FAT names can't hold a newline), so a
+      // full page of checked boxes is deleted as a whole or not at all
       int params = request->params();
-      bool deletionSuccess = true;
+      String names;
       for (int i = 0; i < params; i++) {
           AsyncWebParameter* p = request->getParam(i);
-          if (p->isPost()) {
-              String fileToDelete = "/" + p->value();
-              if (sd.exists(fileToDelete.c_str())) {
-                  if (sd.remove(fileToDelete.c_str())) {
-                      Serial.printf("File deleted: %s\n", fileToDelete.c_str());
-                  } else {
-                      Serial.printf("Failed to delete file: %s\n", fileToDelete.c_str());
-                      deletionSuccess = false;
-                  }
-              } else {
-                  Serial.printf("File not found: %s\n", fileToDelete.c_str());
-                  deletionSuccess = false;
-              }
-          }
-      }
-      String html = R"rawliteral(
-      <!DOCTYPE html>
-      <html>
-      <head>
-        <title>Delete Images</title>
-        <style>
-          body {
-            font-family: Arial, sans-serif;
-            background-color: #f0f0f0;
-            text-align: center;
-            margin: 0;
-            padding: 0;
-          }
-          h1 {
-            background-color: #333;
-            color: white;
-            padding: 20px;
-            margin: 0;
-          }
-          .container {
-            padding: 20px;
-          }
-          .button {
-            display: inline-block;
-            padding: 15px 25px;
-            font-size: 16px;
-            margin: 10px;
-            cursor: pointer;
-            text-align: center;
-            text-decoration: none;
-            outline: none;
-            color: #fff;
-            background-color: #4CAF50;
-            border: none;
-            border-radius: 15px;
-            box-shadow: 0 5px #999;
-          }
-          .button:hover {background-color: #3e8e41}
-          .button:active {
-            background-color: #3e8e41;
-            box-shadow: 0 3px #666;
-            transform: translateY(2px);
-          }
-        </style>
-      </head>
-      <body>
-        <h1>Delete Images</h1>
-        <div class="container">
-      )rawliteral";
-
-      if (deletionSuccess) {
-          html += "<p>Selected images deleted successfully!</p>";
-      } else {
-          html += "<p>Failed to delete some images!</p>";
+          if (!p->isPost() || p->value().length() == 0 || p->value().indexOf('\n') >= 0) continue;
+          if (names.length() > 0) names += '\n';
+          names += p->value();
       }
-
-      html += R"rawliteral(
-          <a href="/delete" class="button">Go Back</a>
-          <a href="/" class="button">Go Back to Main Page</a>
-        </div>
-      </body>
-      </html>
-      )rawliteral";
-
-      request->send(200, "text/html", html);
-  });
-
-  // About page route
-  server.on("/about", HTTP_GET, [](AsyncWebServerRequest *request) {
-    String html = R"rawliteral(
-    <!DOCTYPE html>
-    <html>
-    <head>
-      <title>About PhotoFrame 2.0</title>
-      <style>
-        body {
-          font-family: Arial, sans-serif;
-          background-color: #f0f0f0;
-          text-align: center;
-          margin: 0;
-          padding: 0;
-        }
-        h1 {
-          background-color: #333;
-          color: white;
-          padding: 20px;
-          margin: 0;
-        }
-        .container {
-          padding: 20px;
-        }
-        .button {
-          display: inline-block;
-          padding: 15px 25px;
-          font-size: 16px;
-          margin: 10px;
-          cursor: pointer;
-          text-align: center;
-          text-decoration: none;
-          outline: none;
-          color: #fff;
-          background-color: #4CAF50;
-          border: none;
-          border-radius: 15px;
-          box-shadow: 0 5px #999;
-        }
-        .button:hover {background-color: #3e8e41}
-        .button:active {
-          background-color: #3e8e41;
-          box-shadow: 0 3px #666;
-          transform: translateY(2px);
-        }
-        ul {
-          text-align: left;
-          display: inline-block;
-          margin: 0;
-          padding: 0;
-        }
-      </style>
-    </head>
-    <body>
-      <h1>About PhotoFrame 2.0</h1>
-      <div class="container">
-        <p>This project creates an advanced ESP32-powered photo frame that displays a slideshow of images, hosts a web interface for controlling slideshow speed, uploading/deleting images, and plays audio using the built-in DAC.</p>
-        <h3>Created by:</h3>
-        <p>ChatGPT (OpenAI), Grey Lancaster, and the Open-Source Community</p>
-        <h3>Special Thanks to the following libraries and developers:</h3>
-        <ul>
-          <li>WiFiManager by tzapu</li>
-          <li>ESPAsyncWebServer by me-no-dev</li>
-          <li>TFT_eSPI by Bodmer</li>
-          <li>XPT2046_Bitbang by nitek</li>
-          <li>SdFat by Greiman</li>
-          <li>JPEGDEC by BitBank</li>
-          <li>QRCode by ricmoo</li>
-          <li>ESP32-audioI2S by schreibfaul1</li>
-          <li>AudioFileSourceSD by Phil Schatzmann</li>
-          <li>mDNS (ESP32 Core)</li>
-          <li>FS (ESP32 Core)</li>
-        </ul>
-        <p>This project would not be possible without the open-source community and the many talented developers who have contributed to the libraries we utilized.</p>
-        <a href="/" class="button">Go Back to Main Page</a>
-      </div>
-    </body>
-    </html>
-    )rawliteral";
-
-    request->send(200, "text/html", html);
-  });
-
-  // Route to serve the slideshow page
-  server.on("/slideshow", HTTP_GET, [](AsyncWebServerRequest *request) {
-    String html = R"rawliteral(
-    <!DOCTYPE html>
-    <html>
-    <head>
-      <title>Slideshow</title>
-      <style>
-        body {
-          margin: 0;
-          padding: 0;
-          font-family: Arial, sans-serif;
-          background-color: #f0f0f0;
-        }
-        #sidebar {
-          position: fixed;
-          left: 0;
-          top: 0;
-          width: 200px;
-          height: 100%;
-          background-color: #333;
-          color: white;
-          padding-top: 20px;
-          box-sizing: border-box;
-        }
-        #sidebar button {
-          display: block;
-          width: 160px;
-          margin: 20px auto;
-          padding: 15px;
-          font-size: 16px;
-          cursor: pointer;
-          text-align: center;
-          text-decoration: none;
-          outline: none;
-          color: #fff;
-          background-color: #4CAF50;
-          border: none;
-          border-radius: 15px;
-        }
-        #sidebar button:hover {background-color: #3e8e41}
-        #sidebar button:active {
-          background-color: #3e8e41;
-          box-shadow: 0 3px #666;
-          transform: translateY(2px);
-        }
-        #main-content {
-          margin-left: 200px;
-          padding: 0;
-          text-align: center;
-        }
-        #main-content img {
-          max-width: 100%;
-          height: auto;
-        }
-      </style>
-    </head>
-    <body>
-      <div id="sidebar">
-        <button onclick="location.href='/'">Go Back to Main Page</button>
-      </div>
-      <div id="main-content">
-        <img id="slideshow" src="/current_image">
-      </div>
-      <script>
-        var gateway = `ws://${window.location.hostname}/ws`;
-        var websocket;
-        
-        window.addEventListener('load', onLoad);
-        window.addEventListener('beforeunload', function() {
-          if (websocket) {
-            websocket.close();
-          }
-        });
-        
-        function onLoad(event) {
-          initWebSocket();
-        }
-        
-        function initWebSocket() {
-          console.log('Trying to open a WebSocket connection...');
-          websocket = new WebSocket(gateway);
-          websocket.onopen = function(event) {
-            console.log('Connection opened');
-          };
-          websocket.onclose = function(event) {
-            console.log('Connection closed');
-          };
-          websocket.onmessage = function(event) {
-            if (event.data === 'update') {
-              var img = document.getElementById('slideshow');
-              img.src = '/current_image?t=' + new Date().getTime();
-            }
-          };
-        }
-      </script>
-    </body>
-    </html>
-    )rawliteral";
-    request->send(200, "text/html", html);
+      bool queued = names.length() == 0 || postFrameCommand(CMD_DELETE, 0, names.c_str());
+      request->send(queued ? 202 : 503, "application/json", queued ? "{\"ok\":true}" : "{\"ok\":false}");
   });
 
   // Route to serve the current image
@@ -1155,31 +4415,22 @@ void setupWebServer() {
       return;
     }
 
-    xSemaphoreTake(xSpiMutex, portMAX_DELAY);
-
-    SdBaseFile *file = new SdBaseFile();
-    if (!file->open(currentImageName.c_str(), O_RDONLY)) {
-      xSemaphoreGive(xSpiMutex);
-      delete file;
-      request->send(404, "text/plain", "Image not found");
+    if (!trySpiMutex()) {
+      sendBusy(request);
       return;
     }
+    String name = currentImageName;
+    giveSpiMutex();
+    sendImage(request, name, false);
+  });
 
-    AsyncWebServerResponse *response = request->beginChunkedResponse("image/jpeg",
-      [file](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
-        size_t bytesRead = file->read(buffer, maxLen);
-        if (bytesRead == 0) {
-          file->close();
-          delete file;
-          xSemaphoreGive(xSpiMutex);
-        }
-        return bytesRead;
-      });
-
-    response->addHeader("Content-Disposition", "inline; filename=" + currentImageName);
-    response->addHeader("Access-Control-Allow-Origin", "*");
-
-    request->send(response);
+  // Route to serve a small preview of an image for the web UI
+  server.on("/thumb", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("name")) {
+      request->send(400, "text/plain", "Missing name");
+      return;
+    }
+    sendImage(request, request->getParam("name")->value(), true);
   });
 
   // Initialize WebSocket
@@ -1202,26 +4453,36 @@ void displayQRCode(String ip) {
   // Append :8080 to the IP address for the web server
   String url = "http://" + ip + ":8080";
 
-  QRCode qrcode;
-  uint8_t qrcodeData[qrcode_getBufferSize(4)];
-  qrcode_initText(&qrcode, qrcodeData, 4, ECC_MEDIUM, url.c_str());
+  FrameQRCode qrcode;
+  uint8_t qrcodeTemp[FrameQRCode::BUFFER_LEN];
+  tft.fillScreen(TFT_BLACK);
+  if (!qrcode.encodeText(url.c_str(), qrcodegen::QrCode::Ecc::MEDIUM, qrcodeTemp)) return;
 
   int blockSize = 6;  // Adjust the size of the blocks
-  int qrSize = qrcode.size;
+  int qrSize = qrcode.getSize();
   int startX = (tft.width() - qrSize * blockSize) / 2;
   int startY = (tft.height() - qrSize * blockSize) / 2;
 
-  tft.fillScreen(TFT_BLACK);
+  // White background, then each row's dark modules as one rectangle per run
+  tft.startWrite();
+  tft.fillRect(startX, startY, qrSize * blockSize, qrSize * blockSize, TFT_WHITE);
   for (int y = 0; y < qrSize; y++) {
-    for (int x = 0; x < qrSize; x++) {
-      tft.fillRect(startX + x * blockSize, startY + y * blockSize, blockSize, blockSize,
-                   qrcode_getModule(&qrcode, x, y) ? TFT_BLACK : TFT_WHITE);
+    for (int x = 0; x < qrSize;) {
+      if (!qrcode.getModule(x, y)) {
+        x++;
+        continue;
+      }
+      int end = x + 1;
+      while (end < qrSize && qrcode.getModule(end, y)) end++;
+      tft.fillRect(startX + x * blockSize, startY + y * blockSize, (end - x) * blockSize, blockSize, TFT_BLACK);
+      x = end;
     }
   }
+  tft.endWrite();
 }
 
-// Function to show Wi-Fi information, then QR code
-void displayMessageAndQRCode(String ip) {
+// Function to show Wi-Fi information, the QR code follows as the next overlay page
+void displayConnectInfo(String ip) {
   // Append :8080 to the IP address for the web server
   String fullIP = ip + ":8080";
 
@@ -1263,25 +4524,311 @@ void displayMessageAndQRCode(String ip) {
   tft.setCursor(20, 200);  // Add more detail
   tft.println("to manage your frame.");
 
-  // Reserve space for the countdown timer
+  tft.setCursor(20, 220);
+  tft.println("QR code follows...");
+}
+
+// Function to show the Wi-Fi setup instructions while the WiFiManager portal is open
+void displayPortalInstructions() {
+  tft.fillScreen(TFT_BLACK);
+  tft.setTextColor(TFT_RED);
+  tft.setTextSize(3);
+
+  // Title starts higher up
+  tft.setCursor(20, 0); 
+  tft.println("CYD PhotoFrame! ");
+
+  tft.setTextColor(TFT_WHITE);
+  tft.setTextSize(2);
+
+  // Adjusted vertical positions to fit properly
+  tft.setCursor(20, 40);
+  tft.println("Wi-Fi is not set up");
+  tft.setCursor(20, 60);
+  tft.println("yet. To connect the");
+  tft.setCursor(20, 80);
+  tft.println("frame, follow the");
+  tft.setCursor(20, 100);
+  tft.println("instructions below");
+  tft.println("");  
+
+  // Highlight WiFi and IP instructions
+  tft.setTextColor(TFT_GREEN);
+  tft.setCursor(20, 120);
+  tft.println("Connect your wifi to:");
+  tft.setTextColor(TFT_CYAN);
+  tft.setCursor(20, 140);
+  tft.println("ESP32_AP");
+  tft.setTextColor(TFT_GREEN);
+  tft.setCursor(20, 160);
+  tft.println("And use browser to open");
+  tft.setTextColor(TFT_CYAN);
+  tft.setCursor(20, 180);
+  tft.println("192.168.4.1");
   tft.setTextColor(TFT_WHITE);
-  tft.fillRect(0, 220, tft.width(), 40, TFT_BLACK);  // Clear space for countdown area
+  tft.setCursor(20, 200);
+  tft.println("to configure WiFi");
   tft.setCursor(20, 220);
+  tft.println("Then enjoy PhotoFrame");
+}
+
+// On-screen overlays
+// loop() owns the panel, so other tasks ask for an overlay and loop() draws it
+// and holds the slideshow until it's done: the setup instructions while the
+// WiFiManager portal is open, and the web address then its QR code when the
+// BOOT button is held (or once after the portal has configured Wi-Fi).
+enum Overlay : uint8_t { OVERLAY_NONE, OVERLAY_PORTAL, OVERLAY_INFO, OVERLAY_QR };
+#define OVERLAY_INFO_MS 5000
+#define OVERLAY_QR_MS 10000
+
+Overlay overlayRequest = OVERLAY_NONE;  // Set by loop(), from CMD_OVERLAY or a hold
+Overlay overlayShown = OVERLAY_NONE;
+uint32_t overlayTimer = 0;
+
+// Network bring-up
+// Runs beside the slideshow, so after a power cut only the SD mount and one
+// decode stand between boot and a photo. With saved credentials WiFiManager
+// keeps retrying quietly (the router may just be rebooting too), and only
+// opens its portal once NETWORK_PORTAL_AFTER_FAILS attempts in a row have
+// failed, so a frame whose network changed can be set up again; without, it
+// opens the portal straight away. Either way a portal that times out goes
+// back to retrying.
+#define NETWORK_TASK_STACK 8192
+#define NETWORK_PORTAL_TIMEOUT_S 180
+#define NETWORK_RETRY_MS 30000
+#define NETWORK_PORTAL_AFTER_FAILS 10  // About five minutes of a missing network
+
+volatile bool networkReady = false;
+String networkIP;  // Written once before networkReady is set
+
+void networkTask(void *parameter) {
+  static bool portalOpened = false;
+  wm.setAPCallback([](WiFiManager *manager) {
+    portalOpened = true;
+    postFrameCommand(CMD_OVERLAY, OVERLAY_PORTAL);
+  });
+  wm.setConfigPortalTimeout(NETWORK_PORTAL_TIMEOUT_S);
+  WiFi.mode(WIFI_STA);  // WiFiManager can only see saved credentials with the radio up
+  bool saved = wm.getWiFiIsSaved();
+
+  // Connect to WiFi using WiFiManager
+  uint8_t failures = 0;
+  wm.setEnableConfigPortal(!saved);
+  while (!wm.autoConnect("ESP32_AP")) {
+    Serial.println("Failed to connect to WiFi, retrying later");
+    if (portalOpened) {
+      postFrameCommand(CMD_OVERLAY, OVERLAY_NONE);
+      portalOpened = false;
+      failures = 0;  // Timed out: back to quiet retries with the saved network
+    } else if (failures < NETWORK_PORTAL_AFTER_FAILS) {
+      failures++;
+    }
+    saved = wm.getWiFiIsSaved();  // The portal may have just saved some
+    wm.setEnableConfigPortal(!saved || failures >= NETWORK_PORTAL_AFTER_FAILS);
+    vTaskDelay(pdMS_TO_TICKS(NETWORK_RETRY_MS));
+  }
+  while (WiFi.localIP() == IPAddress(0, 0, 0, 0)) {
+    Serial.println("Waiting for IP address...");
+    vTaskDelay(pdMS_TO_TICKS(500));
+  }
+  beginNetworkPower();
+
+  if (!MDNS.begin("photoframe")) {
+    Serial.println("Error starting mDNS");
+  } else {
+    Serial.println("mDNS started: photoframe.local");
+  }
+
+  // Now that Wi-Fi is connected, set up the web server
+  setupWebServer();
+  beginSync();
 
-  // Countdown timer for QR code display
-  for (int countdown = 10; countdown > 0; countdown--) {
-      tft.fillRect(0, 220, tft.width(), 40, TFT_BLACK);  // Clear countdown area
-      tft.setCursor(20, 220);
-      tft.printf("QR Code in: %d seconds", countdown);
-      delay(1000);
+  networkIP = WiFi.localIP().toString();
+  networkReady = true;
+  Serial.printf("Assigned IP: %s\n", networkIP.c_str());
+  if (portalOpened) postFrameCommand(CMD_OVERLAY, OVERLAY_INFO);  // Just configured, show where to find the frame
+  vTaskDelete(NULL);
+}
+
+// Draw a newly requested overlay and time the pages of the info one. Returns
+// true while an overlay holds the panel; the slide comes back when it ends.
+bool updateOverlay() {
+  Overlay request = overlayRequest;
+  if (request != overlayShown) {
+    overlayShown = request;
+    overlayTimer = millis();
+    if (request == OVERLAY_PORTAL) displayPortalInstructions();
+    else if (request == OVERLAY_INFO) displayConnectInfo(networkIP);
+    else if (request == OVERLAY_QR) displayQRCode(networkIP);
+    else if (fileCount > 0 && sdMounted) {
+      loadImage(currentIndex);
+      timer = millis();
+    } else {
+      error(sdMounted ? "No .JPG or .RGB images found" : "SD Card Mount Failed");
+    }
+  }
+
+  uint32_t shown = millis() - overlayTimer;
+  if (overlayShown == OVERLAY_INFO && shown > OVERLAY_INFO_MS) overlayRequest = OVERLAY_QR;
+  if (overlayShown == OVERLAY_QR && shown > OVERLAY_QR_MS) overlayRequest = OVERLAY_NONE;
+  return overlayShown != OVERLAY_NONE;
+}
+
+// BOOT button
+// The interrupt only flags the falling edge; loop() then follows the pin to
+// tell a tap (next slide) from a hold (show the web address).
+#define BUTTON_DEBOUNCE_MS 30  // Shorter pulses are contact bounce
+#define BUTTON_HOLD_MS 1000
+
+enum ButtonEvent : uint8_t { BUTTON_NONE, BUTTON_TAP, BUTTON_HOLD };
+bool buttonDown = false;
+bool buttonHoldSent = false;
+uint32_t buttonDownAt = 0;
+
+ButtonEvent readButton() {
+  if (!buttonDown) {
+    if (!buttonPressed) return BUTTON_NONE;
+    buttonDown = true;
+    buttonHoldSent = false;
+    buttonDownAt = millis();
+  }
+  buttonPressed = false;  // Edges while it's down are bounce
+
+  uint32_t held = millis() - buttonDownAt;
+  if (digitalRead(0) == HIGH) {
+    buttonDown = false;
+    return buttonHoldSent || held < BUTTON_DEBOUNCE_MS ? BUTTON_NONE : BUTTON_TAP;
+  }
+  if (!buttonHoldSent && held >= BUTTON_HOLD_MS) {
+    buttonHoldSent = true;
+    return BUTTON_HOLD;
+  }
+  return BUTTON_NONE;
+}
+
+// Touch screen
+// The XPT2046 pulls PENIRQ (GPIO36) low while the panel is pressed. The edge
+// wakes touchTask, which samples the controller until the pen lifts and posts
+// one gesture to loop() as a CMD_TOUCH. The interrupt stays off while
+// sampling (the controller drives PENIRQ during conversions) and a press must
+// outlast TOUCH_DEBOUNCE_MS, which also filters the spurious edges GPIO36 can
+// see when the radio wakes.
+#define TOUCH_DEBOUNCE_MS 20
+#define TOUCH_SAMPLE_MS 10
+#define TOUCH_RELEASE_MS 40      // PENIRQ high this long means the pen lifted
+#define TOUCH_LONG_PRESS_MS 800
+#define TOUCH_SWIPE_MIN 50       // Horizontal travel in screen pixels for a swipe
+#define TOUCH_TAP_MAX 20         // Travel still counted as a tap or long-press
+#define TOUCH_TASK_PRIORITY 3    // Above audio, it sleeps between gestures
+#ifndef TOUCH_FLIP_X
+#define TOUCH_FLIP_X 0           // Set to 1 if swipes come out mirrored
+#endif
+
+enum TouchEvent : uint8_t { TOUCH_TAP, TOUCH_SWIPE_LEFT, TOUCH_SWIPE_RIGHT, TOUCH_LONG_PRESS };
+TaskHandle_t touchTaskHandle = NULL;
+
+void IRAM_ATTR touchInt() {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(touchTaskHandle, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+void postTouchEvent(TouchEvent event) {
+  if (!postFrameCommand(CMD_TOUCH, event)) touchEventsDropped++;
+}
+
+// Follow one press from the first sample to the lift
+void trackTouch() {
+  TouchPoint first = ts.getTouch();
+  TouchPoint last = first;
+  uint32_t downAt = millis();
+  uint32_t highSince = 0;
+  bool moved = false;
+  bool longPressSent = false;
+
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(TOUCH_SAMPLE_MS));
+    if (digitalRead(XPT2046_IRQ) == HIGH) {
+      if (!highSince) highSince = millis();
+      if (millis() - highSince >= TOUCH_RELEASE_MS) break;
+      continue;
+    }
+    highSince = 0;
+    last = ts.getTouch();
+    if (abs(last.x - first.x) > TOUCH_TAP_MAX || abs(last.y - first.y) > TOUCH_TAP_MAX) moved = true;
+    if (!moved && !longPressSent && millis() - downAt >= TOUCH_LONG_PRESS_MS) {
+      postTouchEvent(TOUCH_LONG_PRESS);
+      longPressSent = true;
+    }
+  }
+  if (longPressSent) return;
+
+  int dx = last.x - first.x;
+  if (TOUCH_FLIP_X) dx = -dx;
+  if (abs(dx) >= TOUCH_SWIPE_MIN && abs(dx) > abs(last.y - first.y)) {
+    postTouchEvent(dx < 0 ? TOUCH_SWIPE_LEFT : TOUCH_SWIPE_RIGHT);
+  } else if (!moved) {
+    postTouchEvent(TOUCH_TAP);
+  }
+}
+
+void touchTask(void *parameter) {
+  while (true) {
+    attachInterrupt(XPT2046_IRQ, touchInt, FALLING);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    detachInterrupt(XPT2046_IRQ);
+
+    vTaskDelay(pdMS_TO_TICKS(TOUCH_DEBOUNCE_MS));
+    if (digitalRead(XPT2046_IRQ) == LOW) trackTouch();
+    ulTaskNotifyTake(pdTRUE, 0);  // Drop edges from the press just handled
   }
+}
+
+void startTouchTask() {
+  pinMode(XPT2046_IRQ, INPUT);  // Input only, the board has the pull-up
+  xTaskCreatePinnedToCore(
+    touchTask,            // Function to implement the task
+    "touchTask",          // Name of the task
+    4096,                 // Stack size in words
+    NULL,                 // Task input parameter
+    TOUCH_TASK_PRIORITY,  // Priority of the task
+    &touchTaskHandle,     // Task handle
+    1                     // Core where the task should run
+  );
+}
+
+// Last slide
+// The slide on screen is kept in NVS so a restart comes back to it, written at
+// most once per LAST_SLIDE_SAVE_MS to spare the flash.
+#define LAST_SLIDE_SAVE_MS 60000
+
+String savedSlideName;
+uint32_t slideSavedAt = 0;
+
+void saveLastSlide() {
+  if (millis() - slideSavedAt < LAST_SLIDE_SAVE_MS) return;
+  takeSpiMutex();
+  String name = currentImageName;
+  giveSpiMutex();
+  if (name.length() == 0 || name == savedSlideName) return;
+  prefs.putString("lastSlide", name);
+  savedSlideName = name;
+  slideSavedAt = millis();
+}
 
-    displayQRCode(ip);  // Show QR code with IP and port 8080
-    delay(5000);  // Show QR code for 5 seconds
+// Index of the slide shown before the restart, or 0 if it's gone
+int16_t restoreLastSlide() {
+  savedSlideName = prefs.getString("lastSlide", "");
+  if (savedSlideName.length() == 0) return 0;
+  takeSpiMutex();
+  int32_t index = findImageEntry(savedSlideName.c_str());
+  giveSpiMutex();
+  return index >= 0 ? index : 0;
 }
 
 void setup() {
   Serial.begin(115200);
+  frameCommands = xQueueCreate(FRAME_QUEUE_LENGTH, sizeof(FrameCommand));
   pinMode(0, INPUT);
   attachInterrupt(0, buttonInt, FALLING);
   pinMode(4, OUTPUT); digitalWrite(4, HIGH);
@@ -1289,7 +4836,10 @@ void setup() {
   pinMode(17, OUTPUT); digitalWrite(17, HIGH);
 
   tft.init();
+  beginBacklight();
   tft.setRotation(3);
+  frameWidth = tft.width();
+  frameHeight = tft.height();
   tft.fillScreen(TFT_BLACK);
   tft.setTextColor(TFT_RED);
 
@@ -1309,69 +4859,53 @@ void setup() {
 
   tft.setTextSize(3);
   tft.setSwapBytes(true);
+
+#ifdef USE_TFT_DMA
+  // DMA push from JPEGDraw, falls back to pushImage if the buffers can't be allocated
+  dmaBuffer[0] = (uint16_t *)heap_caps_malloc(DMA_BUFFER_PIXELS * sizeof(uint16_t), MALLOC_CAP_DMA);
+  dmaBuffer[1] = (uint16_t *)heap_caps_malloc(DMA_BUFFER_PIXELS * sizeof(uint16_t), MALLOC_CAP_DMA);
+  if (dmaBuffer[0] && dmaBuffer[1] && tft.initDMA()) {
+    Serial.println("TFT DMA enabled");
+  } else {
+    Serial.println("TFT DMA unavailable, using blocking pushImage");
+    free(dmaBuffer[0]);
+    free(dmaBuffer[1]);
+    dmaBuffer[0] = dmaBuffer[1] = nullptr;
+  }
+#endif
    // Set the viewport to constrain the display within 320x240 resolution
     tft.setViewport(0, 0, 320, 240);
-    // Initialize SPIFFS
+
+    // Splash for the moment it takes to mount the card
     if (!SPIFFS.begin(true)) {  // 'true' will format the partition if SPIFFS is not initialized
       Serial.println("SPIFFS Mount Failed");
-      return;  // Stop further execution if SPIFFS mount fails
-    }
-    fs::File jpegFile = SPIFFS.open("/vanity.jpg", "r");  // Open the image file from SPIFFS
-
-    if (!jpegFile) {
-      Serial.println("Failed to open the file!");
-      return;
+    } else {
+      fs::File jpegFile = SPIFFS.open("/vanity.jpg", "r");  // Open the image file from SPIFFS
+      if (!jpegFile) {
+        Serial.println("Failed to open the file!");
+      } else if (jpeg.open(jpegFile, JPEGDraw)) {
+        beginJpegDraw();
+        jpeg.decode(0, 0, 0);  // Decode without any scaling by passing 0 as the scale option
+        endJpegDraw();
+        jpeg.close();
+      }
+      jpegFile.close();
     }
 
-    // Pass the opened file and the existing JPEGDraw function to the JPEG decoder
-    jpeg.open(jpegFile, JPEGDraw);  // Use your existing JPEGDraw as the callback
-    jpeg.decode(0, 0, 0);  // Decode without any scaling by passing 0 as the scale option
-    jpegFile.close();
-
-    delay(10000);  // Wait for 10 seconds
-
-    tft.fillScreen(TFT_BLACK);  // Clear the screen after 10 seconds
-
-  // Title starts higher up
-  tft.setCursor(20, 0); 
-  tft.println("CYD PhotoFrame! ");
-
-  tft.setTextColor(TFT_WHITE);
-  tft.setTextSize(2);
-
-  // Adjusted vertical positions to fit properly
-  tft.setCursor(20, 40);
-  tft.println("If this stays on your");
-  tft.setCursor(20, 60);
-  tft.println("screen for more than 15 ");
-  tft.setCursor(20, 80);
-  tft.println("seconds, follow the");
-  tft.setCursor(20, 100);
-  tft.println("instructions below");
-  tft.println("");  
-
-  // Highlight WiFi and IP instructions
-  tft.setTextColor(TFT_GREEN);
-  tft.setCursor(20, 120);
-  tft.println("Connect your wifi to:");
-  tft.setTextColor(TFT_CYAN);
-  tft.setCursor(20, 140);
-  tft.println("ESP32_AP");
-  tft.setTextColor(TFT_GREEN);
-  tft.setCursor(20, 160);
-  tft.println("And use browser to open");
-  tft.setTextColor(TFT_CYAN);
-  tft.setCursor(20, 180);
-  tft.println("192.168.4.1");
-  tft.setTextColor(TFT_WHITE);
-  tft.setCursor(20, 200);
-  tft.println("to configure WiFi");
-  tft.setCursor(20, 220);
-  tft.println("Then enjoy PhotoFrame");
-
-    delay(1000);
     ts.begin();
+    startTouchTask();
     xSpiMutex = xSemaphoreCreateMutex();
+    prefs.begin("photoframe", false);
+    X = max(1, (int)prefs.getInt("speed", X));
+    transition = (Transition)min((int)prefs.getUChar("transition", TRANSITION_NONE), TRANSITION_COUNT - 1);
+    playOrder = (PlayOrder)min((int)prefs.getUChar("order", ORDER_SEQUENTIAL), ORDER_COUNT - 1);
+    FsDateTime::setCallback(sdDateTime);  // Uploads get their real date for the recent order
+    syncRole = (SyncRole)min((int)prefs.getUChar("sync", SYNC_OFF), SYNC_ROLE_COUNT - 1);
+    colorSettings = unpackColorSettings(prefs.getUInt("color", packColorSettings(colorSettings)));
+    buildColorLuts();
+    backlightLevel = max(1, (int)prefs.getUChar("brightness", backlightLevel));
+    setBacklight(backlightLevel);
+    beginPower();
 
     // Increase the Task Watchdog Timer to prevent resets
     esp_task_wdt_init(30, true);  // Set watchdog timeout to 30 seconds
@@ -1382,87 +4916,223 @@ void setup() {
     out->SetGain(0.5);               // Set volume (0.0 to 1.0)
     out->SetRate(44100);             // Set sample rate to match your WAV file
 
-    // Connect to WiFi using WiFiManager
-    if (!wm.autoConnect("ESP32_AP")) {
-      Serial.println("Failed to connect to WiFi. Starting AP mode...");
-      tft.fillScreen(TFT_BLACK);
-      tft.setCursor(0, 0);
-      tft.setTextColor(TFT_WHITE);
-      tft.setTextSize(3);
-      tft.println("WiFi AP Mode");
-      while (true) delay(1000);
+    // Initialize SD card
+    if (!checkAndMountSDCard()) {
+      error("SD Card Mount Failed");
+      scheduleSdRetry();  // loop() mounts it once it's inserted
+    } else {
+      checkMusicFile();
+      startPrefetchTask();
+      // Back to the album that was on show, or the root folder if it's gone
+      String album = prefs.getString("album", "");
+      takeSpiMutex();
+      if (album.length() == 0 || !isAlbumName(album.c_str()) || !openAlbum(("/" + album).c_str())) {
+        openAlbum("/");
+      }
+      giveSpiMutex();
     }
 
-    while (WiFi.status() != WL_CONNECTED) {
-      delay(1000);
-      Serial.println("Waiting for WiFi...");
+    // Wi-Fi, mDNS and the web server come up in the background
+    xTaskCreatePinnedToCore(networkTask, "networkTask", NETWORK_TASK_STACK, NULL, 1, NULL, 0);
+
+    if (fileCount == 0) {
+      if (sdMounted) error("No .JPG or .RGB images found");
+    } else {
+      currentIndex = restoreLastSlide();
+      loadImage(currentIndex);
     }
-    if (!MDNS.begin("photoframe")) {
-    Serial.println("Error starting mDNS");
-  } else {
-    Serial.println("mDNS started: photoframe.local");
-  }
+    timer = millis();
+    if (benchState == BENCH_QUEUED) postFrameCommand(CMD_BENCH);  // BENCH_AT_BOOT
+}
 
-    // Now that Wi-Fi is connected, set up the web server
-    setupWebServer();
-
-    // Display IP address
-    String ip = WiFi.localIP().toString();
-    if (ip == "0.0.0.0") {
-      Serial.println("IP address not assigned, retrying...");
-      // Wait for IP to be assigned
-      int retries = 0;
-      while (ip == "0.0.0.0" && retries < 10) {
-        delay(1000);
-        ip = WiFi.localIP().toString();
-        Serial.println("Waiting for IP address...");
-        retries++;
-      }
-      if (ip == "0.0.0.0") {
-        Serial.println("Failed to obtain IP address.");
-        // Handle failure (e.g., restart or enter AP mode)
-        return;
-      }
+// Delete an image of the album on show, with its copies and index entry
+void deleteImage(const char *name) {
+  takeSpiMutex();
+  String path = albumFilePath(name);
+  if (!sd.exists(path.c_str())) {
+    Serial.printf("File not found: %s\n", path.c_str());
+  } else if (sd.remove(path.c_str())) {
+    Serial.printf("File deleted: %s\n", path.c_str());
+    markIndexChanged();
+    int32_t entry = findImageEntry(name);
+    if (entry >= 0) {
+      resetImageCopies(entry);
+      removeImageEntry(entry);
     }
+    invalidatePrefetch();
+  } else {
+    Serial.printf("Failed to delete file: %s\n", path.c_str());
+  }
+  giveSpiMutex();
+}
 
-    Serial.printf("Assigned IP: %s\n", ip.c_str());
-    displayMessageAndQRCode(ip);
+// From loop(): put the index and the slide on show away, then restart
+void restartForUpdate() {
+  delay(OTA_RESTART_DELAY_MS);
+  if (indexChanged) saveImageIndex();
+  slideSavedAt = millis() - LAST_SLIDE_SAVE_MS;
+  saveLastSlide();
+  Serial.println("Restarting into the new firmware");
+  ESP.restart();
+}
 
-    // Initialize SD card
-    if (!checkAndMountSDCard()) {
-      error("SD Card Mount Failed");
-    } else {
-      root.open("/");
-      fileCount = 0;
-      SdBaseFile fileEntry;
-      char name[100];
-      while (fileEntry.openNext(&root)) {
-        fileEntry.getName(name, sizeof(name));
-        if (strcasecmp(name + strlen(name) - 3, "JPG") == 0) {
-          fileCount++;
-        }
-        fileEntry.close();
-      }
-      Serial.printf("Found %d images.\n", fileCount);
+// Carry out a command from frameCommands. Gestures come back through step
+// (+1 next, -1 previous) and hold (show the address) for loop() to act on.
+void runFrameCommand(FrameCommand &command, int8_t &step, bool &hold) {
+  switch (command.type) {
+    case CMD_BUTTON:
+      buttonPressed = true;  // readButton() follows the pin from here
+      break;
+    case CMD_TOUCH:
+      if (command.arg == TOUCH_LONG_PRESS) hold = true;
+      else step = command.arg == TOUCH_SWIPE_RIGHT ? -1 : 1;
+      break;
+    case CMD_STEP:
+      slideRequest = command.arg;  // Waits for the display and any overlay
+      break;
+    case CMD_PAUSE:
+      slideshowPaused = command.arg != 0;
+      sendSlideState(nullptr);
+      break;
+    case CMD_SPEED:
+      setSlideSpeed(command.arg);
+      break;
+    case CMD_TRANSITION:
+      setTransition((Transition)command.arg);
+      break;
+    case CMD_ORDER:
+      setPlayOrder((PlayOrder)command.arg);
+      break;
+    case CMD_OVERLAY:
+      overlayRequest = (Overlay)command.arg;
+      break;
+    case CMD_SEND_STATE: {
+      AsyncWebSocketClient *client = ws.client(command.arg);
+      if (client && client->status() == WS_CONNECTED) sendSlideState(client);
+      break;
     }
-
-    if (fileCount == 0) error("No .JPG images found");
-    currentIndex = 0;
-    loadImage(currentIndex);
+    case CMD_ALBUM:
+      strlcpy(albumRequest, command.text, sizeof(albumRequest));
+      albumRequested = true;  // Switched once no overlay holds the panel
+      break;
+    case CMD_DELETE:
+      for (char *name = strtok(command.text, "\n"); name; name = strtok(nullptr, "\n")) deleteImage(name);
+      break;
+    case CMD_PLAY_MUSIC:
+      if (checkMusicFile()) startAudioPlayback();
+      else Serial.println("music.wav not found on the SD card.");
+      break;
+    case CMD_BENCH:
+      if (benchState == BENCH_QUEUED) runBenchmark();
+      break;
+    case CMD_CLOSE_FILE:
+    case CMD_REMOVE_FILE: {
+      SdBaseFile *file = (SdBaseFile *)(intptr_t)command.arg;
+      takeSpiMutex();
+      if (command.type == CMD_REMOVE_FILE) file->remove();
+      else file->close();
+      giveSpiMutex();
+      delete file;
+      if (command.type == CMD_REMOVE_FILE) countWebRemove(-1);
+      break;
+    }
+    case CMD_POWER:
+      setNightSchedule(command.arg, command.text);
+      break;
+    case CMD_RESTART:
+      restartForUpdate();
+      break;
+    case CMD_COLOR:
+      // Show the change on the slide on screen, and redo the prefetched one
+      setColorSettings(unpackColorSettings(command.arg));
+      invalidatePrefetch();
+      if (fileCount > 0 && sdMounted && displayOn && overlayShown == OVERLAY_NONE) loadImage(currentIndex);
+      break;
+    case CMD_BRIGHTNESS:
+      setBrightness(command.arg);
+      break;
+    case CMD_SYNC_ROLE:
+      setSyncRole((SyncRole)command.arg);
+      break;
+    case CMD_SYNC_SLIDE:
+      followSyncedSlide(command.text, command.arg);
+      break;
+  }
+  free(command.text);
 }
 
+uint32_t loopWait = 0;  // How long the next loop() may wait for a command
+
 void loop() {
-  if (fileCount > 0) {
-    if ((millis() - timer > X * 1000) || buttonPressed) {
-      currentIndex = (currentIndex + 1) % fileCount;
-      loadImage(currentIndex);
-      timer = millis();
-      buttonPressed = false;
+  int8_t step = 0;
+  bool hold = false;
+  FrameCommand command;
+  if (xQueueReceive(frameCommands, &command, pdMS_TO_TICKS(loopWait)) == pdTRUE) {
+    runFrameCommand(command, step, hold);
+  }
+
+  if (sdMounted && sdReadErrors >= SD_ERROR_LIMIT) recoverSdCard();
+  else if (sdRetryDue()) retrySdCard();
+  if (albumRequested && overlayShown == OVERLAY_NONE) switchAlbum();
+
+  // BOOT button and touch: a tap or swipe left is the next slide, a swipe right
+  // the previous one, a hold shows the address
+  ButtonEvent button = readButton();
+  if (button == BUTTON_TAP) step = 1;
+  else if (button == BUTTON_HOLD) hold = true;
+
+  // At night the first touch only lights the display. Edge interrupts don't
+  // wake the chip from light sleep, so the pins are polled while it's off.
+  bool input = step || hold || (!displayOn && (digitalRead(0) == LOW || digitalRead(XPT2046_IRQ) == LOW));
+  if (updateDisplayPower(input)) {
+    step = 0;
+    hold = false;
+  }
+
+  if (hold && networkReady) overlayRequest = OVERLAY_INFO;
+  bool overlay = displayOn && updateOverlay();
+  if (overlay && step && overlayShown != OVERLAY_PORTAL) {
+    overlayRequest = OVERLAY_NONE;  // A tap dismisses the address
+  }
+
+  uint16_t count = fileCount;  // Uploads patch the index from the web server
+  if (slideshowPaused || !displayOn) timer = millis();  // Resuming shows the slide for a full interval
+  if (!sdMounted) timer = millis();  // Keep the last slide up until the card is back
+  if (count > 0 && !overlay && displayOn && sdMounted) {
+    if (!step) step = slideRequest;
+    if (syncPending) {
+      if ((int32_t)(syncPresentAt - micros()) < 1000) presentSyncedSlide();
+    } else if ((millis() - timer > X * 1000 && !syncFollowing()) || step) {
+      slideRequest = 0;
+      takeSpiMutex();
+      advanceSlide(step);
+      giveSpiMutex();
+      if (!announceSyncedSlide(currentIndex)) {  // The leader shows it at the announced time
+        loadImage(currentIndex);
+        timer = millis();
+      }
     }
   }
+  pollSync();
+  saveLastSlide();
+  if (indexChanged && millis() - indexChangedAt > INDEX_SAVE_DELAY_MS) saveImageIndex();
 
   ws.cleanupClients();  // Clean up WebSocket clients
 
-
-  delay(1);  // Yield to other tasks
+  // Sleep until the next slide is due, or until a command comes
+  loopWait = POWER_IDLE_WAIT_MS;
+  if (buttonDown || overlay) {
+    loopWait = POWER_POLL_MS;
+  } else if (syncPending && displayOn && sdMounted) {
+    int32_t due = (int32_t)(syncPresentAt - micros()) / 1000 - 1;
+    loopWait = constrain(due, 0, POWER_IDLE_WAIT_MS);
+  } else if (!sdMounted) {
+    int32_t due = (int32_t)(sdRetryAt - millis());
+    loopWait = constrain(due, 0, POWER_IDLE_WAIT_MS);
+  } else if (count > 0 && displayOn && !slideshowPaused && !syncFollowing()) {
+    int32_t due = (int32_t)(timer + X * 1000 - millis());
+    loopWait = constrain(due, 0, POWER_IDLE_WAIT_MS);
+  }
+  setCpuBusy(backgroundBusy());
+  accountPower();
 }
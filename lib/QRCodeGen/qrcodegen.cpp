@@ -826,4 +826,559 @@ void BitBuffer::appendBits(std::uint32_t val, int len) {
 		this->push_back(((val >> i) & 1) != 0);
 }
 
+
+/*---- Class FixedQrEncoder ----*/
+
+// Powers of the generator 0x02 in GF(2^8/0x11D) and their inverse (LOG[0] is unused),
+// so Reed-Solomon multiplies are two lookups instead of a shift-and-add loop.
+static constexpr uint8_t GF_EXP[255] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1D, 0x3A, 0x74, 0xE8, 0xCD, 0x87, 0x13, 0x26,
+	0x4C, 0x98, 0x2D, 0x5A, 0xB4, 0x75, 0xEA, 0xC9, 0x8F, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0,
+	0x9D, 0x27, 0x4E, 0x9C, 0x25, 0x4A, 0x94, 0x35, 0x6A, 0xD4, 0xB5, 0x77, 0xEE, 0xC1, 0x9F, 0x23,
+	0x46, 0x8C, 0x05, 0x0A, 0x14, 0x28, 0x50, 0xA0, 0x5D, 0xBA, 0x69, 0xD2, 0xB9, 0x6F, 0xDE, 0xA1,
+	0x5F, 0xBE, 0x61, 0xC2, 0x99, 0x2F, 0x5E, 0xBC, 0x65, 0xCA, 0x89, 0x0F, 0x1E, 0x3C, 0x78, 0xF0,
+	0xFD, 0xE7, 0xD3, 0xBB, 0x6B, 0xD6, 0xB1, 0x7F, 0xFE, 0xE1, 0xDF, 0xA3, 0x5B, 0xB6, 0x71, 0xE2,
+	0xD9, 0xAF, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0D, 0x1A, 0x34, 0x68, 0xD0, 0xBD, 0x67, 0xCE,
+	0x81, 0x1F, 0x3E, 0x7C, 0xF8, 0xED, 0xC7, 0x93, 0x3B, 0x76, 0xEC, 0xC5, 0x97, 0x33, 0x66, 0xCC,
+	0x85, 0x17, 0x2E, 0x5C, 0xB8, 0x6D, 0xDA, 0xA9, 0x4F, 0x9E, 0x21, 0x42, 0x84, 0x15, 0x2A, 0x54,
+	0xA8, 0x4D, 0x9A, 0x29, 0x52, 0xA4, 0x55, 0xAA, 0x49, 0x92, 0x39, 0x72, 0xE4, 0xD5, 0xB7, 0x73,
+	0xE6, 0xD1, 0xBF, 0x63, 0xC6, 0x91, 0x3F, 0x7E, 0xFC, 0xE5, 0xD7, 0xB3, 0x7B, 0xF6, 0xF1, 0xFF,
+	0xE3, 0xDB, 0xAB, 0x4B, 0x96, 0x31, 0x62, 0xC4, 0x95, 0x37, 0x6E, 0xDC, 0xA5, 0x57, 0xAE, 0x41,
+	0x82, 0x19, 0x32, 0x64, 0xC8, 0x8D, 0x07, 0x0E, 0x1C, 0x38, 0x70, 0xE0, 0xDD, 0xA7, 0x53, 0xA6,
+	0x51, 0xA2, 0x59, 0xB2, 0x79, 0xF2, 0xF9, 0xEF, 0xC3, 0x9B, 0x2B, 0x56, 0xAC, 0x45, 0x8A, 0x09,
+	0x12, 0x24, 0x48, 0x90, 0x3D, 0x7A, 0xF4, 0xF5, 0xF7, 0xF3, 0xFB, 0xEB, 0xCB, 0x8B, 0x0B, 0x16,
+	0x2C, 0x58, 0xB0, 0x7D, 0xFA, 0xE9, 0xCF, 0x83, 0x1B, 0x36, 0x6C, 0xD8, 0xAD, 0x47, 0x8E,
+};
+
+static constexpr uint8_t GF_LOG[256] = {
+	0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1A, 0xC6, 0x03, 0xDF, 0x33, 0xEE, 0x1B, 0x68, 0xC7, 0x4B,
+	0x04, 0x64, 0xE0, 0x0E, 0x34, 0x8D, 0xEF, 0x81, 0x1C, 0xC1, 0x69, 0xF8, 0xC8, 0x08, 0x4C, 0x71,
+	0x05, 0x8A, 0x65, 0x2F, 0xE1, 0x24, 0x0F, 0x21, 0x35, 0x93, 0x8E, 0xDA, 0xF0, 0x12, 0x82, 0x45,
+	0x1D, 0xB5, 0xC2, 0x7D, 0x6A, 0x27, 0xF9, 0xB9, 0xC9, 0x9A, 0x09, 0x78, 0x4D, 0xE4, 0x72, 0xA6,
+	0x06, 0xBF, 0x8B, 0x62, 0x66, 0xDD, 0x30, 0xFD, 0xE2, 0x98, 0x25, 0xB3, 0x10, 0x91, 0x22, 0x88,
+	0x36, 0xD0, 0x94, 0xCE, 0x8F, 0x96, 0xDB, 0xBD, 0xF1, 0xD2, 0x13, 0x5C, 0x83, 0x38, 0x46, 0x40,
+	0x1E, 0x42, 0xB6, 0xA3, 0xC3, 0x48, 0x7E, 0x6E, 0x6B, 0x3A, 0x28, 0x54, 0xFA, 0x85, 0xBA, 0x3D,
+	0xCA, 0x5E, 0x9B, 0x9F, 0x0A, 0x15, 0x79, 0x2B, 0x4E, 0xD4, 0xE5, 0xAC, 0x73, 0xF3, 0xA7, 0x57,
+	0x07, 0x70, 0xC0, 0xF7, 0x8C, 0x80, 0x63, 0x0D, 0x67, 0x4A, 0xDE, 0xED, 0x31, 0xC5, 0xFE, 0x18,
+	0xE3, 0xA5, 0x99, 0x77, 0x26, 0xB8, 0xB4, 0x7C, 0x11, 0x44, 0x92, 0xD9, 0x23, 0x20, 0x89, 0x2E,
+	0x37, 0x3F, 0xD1, 0x5B, 0x95, 0xBC, 0xCF, 0xCD, 0x90, 0x87, 0x97, 0xB2, 0xDC, 0xFC, 0xBE, 0x61,
+	0xF2, 0x56, 0xD3, 0xAB, 0x14, 0x2A, 0x5D, 0x9E, 0x84, 0x3C, 0x39, 0x53, 0x47, 0x6D, 0x41, 0xA2,
+	0x1F, 0x2D, 0x43, 0xD8, 0xB7, 0x7B, 0xA4, 0x76, 0xC4, 0x17, 0x49, 0xEC, 0x7F, 0x0C, 0x6F, 0xF6,
+	0x6C, 0xA1, 0x3B, 0x52, 0x29, 0x9D, 0x55, 0xAA, 0xFB, 0x60, 0x86, 0xB1, 0xBB, 0xCC, 0x3E, 0x5A,
+	0xCB, 0x59, 0x5F, 0xB0, 0x9C, 0xA9, 0xA0, 0x51, 0x0B, 0xF5, 0x16, 0xEB, 0x7A, 0x75, 0x2C, 0xD7,
+	0x4F, 0xAE, 0xD5, 0xE9, 0xE6, 0xE7, 0xAD, 0xE8, 0x74, 0xD6, 0xF4, 0xEA, 0xA8, 0x50, 0x58, 0xAF,
+};
+
+
+// Segment modes by their mode indicator bits
+static constexpr int FIXED_MODE_NUMERIC      = 0x1;
+static constexpr int FIXED_MODE_ALPHANUMERIC = 0x2;
+static constexpr int FIXED_MODE_BYTE         = 0x4;
+
+
+bool FixedQrEncoder::encodeText(const char *text, QrCode::Ecc ecl, int maxVersion,
+		uint8_t qrcode[], uint8_t tempBuffer[]) {
+	qrcode[0] = 0;
+	if (maxVersion < QrCode::MIN_VERSION || maxVersion > QrCode::MAX_VERSION)
+		return false;
+	
+	// Choose the most compact mode that can hold the whole text
+	size_t textLen = std::strlen(text);
+	int mode = FIXED_MODE_NUMERIC;
+	for (size_t i = 0; i < textLen; i++) {
+		char c = text[i];
+		if (c < '0' || c > '9') {
+			if (std::strchr(QrSegment::ALPHANUMERIC_CHARSET, c) != nullptr)
+				mode = FIXED_MODE_ALPHANUMERIC;
+			else {
+				mode = FIXED_MODE_BYTE;
+				break;
+			}
+		}
+	}
+	
+	// Find the minimal version number to use
+	int version, dataUsedBits;
+	for (version = QrCode::MIN_VERSION; ; version++) {
+		int dataCapacityBits = QrCode::getNumDataCodewords(version, ecl) * 8;
+		dataUsedBits = textLen > 0 ? getSegmentBits(mode, textLen, version) : 0;  // No segment for empty text
+		if (dataUsedBits != -1 && dataUsedBits <= dataCapacityBits)
+			break;
+		if (version >= maxVersion)
+			return false;
+	}
+	
+	// Increase the error correction level while the data still fits in the current version number
+	for (QrCode::Ecc newEcl : {QrCode::Ecc::MEDIUM, QrCode::Ecc::QUARTILE, QrCode::Ecc::HIGH}) {
+		if (dataUsedBits <= QrCode::getNumDataCodewords(version, newEcl) * 8)
+			ecl = newEcl;
+	}
+	
+	// Build the data bit string in qrcode[], which is free until the modules are drawn
+	std::memset(qrcode, 0, bufferLenForVersion(version));
+	int bitLen = 0;
+	if (textLen > 0) {
+		appendBits(static_cast<uint32_t>(mode), 4, qrcode, bitLen);
+		appendBits(static_cast<uint32_t>(textLen), getSegmentBits(mode, 0, version) - 4, qrcode, bitLen);
+	}
+	if (mode == FIXED_MODE_NUMERIC) {
+		for (size_t i = 0; i < textLen; i += 3) {  // Groups of 3 digits into 10 bits
+			int n = static_cast<int>(std::min(textLen - i, static_cast<size_t>(3)));
+			uint32_t value = 0;
+			for (int j = 0; j < n; j++)
+				value = value * 10 + static_cast<uint32_t>(text[i + j] - '0');
+			appendBits(value, n * 3 + 1, qrcode, bitLen);
+		}
+	} else if (mode == FIXED_MODE_ALPHANUMERIC) {
+		const char *charset = QrSegment::ALPHANUMERIC_CHARSET;
+		for (size_t i = 0; i < textLen; i += 2) {  // Pairs of characters into 11 bits
+			uint32_t value = static_cast<uint32_t>(std::strchr(charset, text[i]) - charset);
+			if (i + 1 < textLen) {
+				value = value * 45 + static_cast<uint32_t>(std::strchr(charset, text[i + 1]) - charset);
+				appendBits(value, 11, qrcode, bitLen);
+			} else
+				appendBits(value, 6, qrcode, bitLen);
+		}
+	} else {
+		for (size_t i = 0; i < textLen; i++)
+			appendBits(static_cast<uint8_t>(text[i]), 8, qrcode, bitLen);
+	}
+	assert(bitLen == dataUsedBits);
+	
+	// Add terminator and pad up to a byte if applicable, then pad with alternating bytes
+	int dataCapacityBits = QrCode::getNumDataCodewords(version, ecl) * 8;
+	appendBits(0, std::min(4, dataCapacityBits - bitLen), qrcode, bitLen);
+	appendBits(0, (8 - bitLen % 8) % 8, qrcode, bitLen);
+	for (uint8_t padByte = 0xEC; bitLen < dataCapacityBits; padByte ^= 0xEC ^ 0x11)
+		appendBits(padByte, 8, qrcode, bitLen);
+	
+	// Compute ECC and draw modules; tempBuffer then holds the function module mask
+	addEccAndInterleave(qrcode, version, ecl, tempBuffer);
+	initializeFunctionModules(version, qrcode);
+	drawCodewords(tempBuffer, QrCode::getNumRawDataModules(version) / 8, qrcode);
+	drawLightFunctionModules(qrcode, version);
+	initializeFunctionModules(version, tempBuffer);
+	
+	// Automatically choose the best mask
+	int msk = 0;
+	long minPenalty = LONG_MAX;
+	for (int i = 0; i < 8; i++) {
+		applyMask(tempBuffer, qrcode, i);
+		drawFormatBits(ecl, i, qrcode);
+		long penalty = getPenaltyScore(qrcode);
+		if (penalty < minPenalty) {
+			msk = i;
+			minPenalty = penalty;
+		}
+		applyMask(tempBuffer, qrcode, i);  // Undoes the mask due to XOR
+	}
+	applyMask(tempBuffer, qrcode, msk);  // Apply the final choice of mask
+	drawFormatBits(ecl, msk, qrcode);  // Overwrite old format bits
+	return true;
+}
+
+
+int FixedQrEncoder::getSize(const uint8_t qrcode[]) {
+	return qrcode[0];
+}
+
+
+bool FixedQrEncoder::getModule(const uint8_t qrcode[], int x, int y) {
+	int size = qrcode[0];
+	if (x < 0 || x >= size || y < 0 || y >= size)
+		return false;
+	int index = y * size + x;
+	return ((qrcode[(index >> 3) + 1] >> (index & 7)) & 1) != 0;
+}
+
+
+int FixedQrEncoder::getSegmentBits(int mode, size_t len, int ver) {
+	// Character count bits for versions 1-9, 10-26 and 27-40
+	int range = ver <= 9 ? 0 : ver <= 26 ? 1 : 2;
+	int ccbits, dataBits;
+	if (mode == FIXED_MODE_NUMERIC) {
+		static constexpr int COUNT_BITS[3] = {10, 12, 14};
+		ccbits = COUNT_BITS[range];
+		dataBits = static_cast<int>((len * 10 + 2) / 3);
+	} else if (mode == FIXED_MODE_ALPHANUMERIC) {
+		static constexpr int COUNT_BITS[3] = {9, 11, 13};
+		ccbits = COUNT_BITS[range];
+		dataBits = static_cast<int>((len * 11 + 1) / 2);
+	} else {
+		static constexpr int COUNT_BITS[3] = {8, 16, 16};
+		ccbits = COUNT_BITS[range];
+		dataBits = static_cast<int>(len * 8);
+	}
+	if (len >= (static_cast<size_t>(1) << ccbits))
+		return -1;
+	return 4 + ccbits + dataBits;
+}
+
+
+void FixedQrEncoder::appendBits(uint32_t val, int len, uint8_t buffer[], int &bitLen) {
+	assert(0 <= len && len <= 16 && val >> len == 0);
+	for (int i = len - 1; i >= 0; i--, bitLen++)
+		buffer[bitLen >> 3] |= ((val >> i) & 1) << (7 - (bitLen & 7));
+}
+
+
+void FixedQrEncoder::addEccAndInterleave(uint8_t data[], int ver, QrCode::Ecc ecl, uint8_t result[]) {
+	// Calculate parameter numbers
+	int numBlocks = QrCode::NUM_ERROR_CORRECTION_BLOCKS[static_cast<int>(ecl)][ver];
+	int blockEccLen = QrCode::ECC_CODEWORDS_PER_BLOCK  [static_cast<int>(ecl)][ver];
+	int rawCodewords = QrCode::getNumRawDataModules(ver) / 8;
+	int dataLen = QrCode::getNumDataCodewords(ver, ecl);
+	int numShortBlocks = numBlocks - rawCodewords % numBlocks;
+	int shortBlockDataLen = rawCodewords / numBlocks - blockEccLen;
+	
+	// Compute each block's ECC and scatter both straight to their interleaved positions
+	uint8_t rsdiv[REED_SOLOMON_DEGREE_MAX];
+	reedSolomonComputeDivisor(blockEccLen, rsdiv);
+	const uint8_t *dat = data;
+	for (int i = 0; i < numBlocks; i++) {
+		int datLen = shortBlockDataLen + (i < numShortBlocks ? 0 : 1);
+		uint8_t *ecc = &data[dataLen];  // Past the data codewords, free once they are copied
+		reedSolomonComputeRemainder(dat, datLen, rsdiv, blockEccLen, ecc);
+		for (int j = 0, k = i; j < datLen; j++, k += numBlocks) {
+			if (j == shortBlockDataLen)
+				k -= numShortBlocks;  // Short blocks have no byte here
+			result[k] = dat[j];
+		}
+		for (int j = 0, k = dataLen + i; j < blockEccLen; j++, k += numBlocks)
+			result[k] = ecc[j];
+		dat += datLen;
+	}
+}
+
+
+void FixedQrEncoder::initializeFunctionModules(int ver, uint8_t qrcode[]) {
+	int size = ver * 4 + 17;
+	std::memset(qrcode, 0, bufferLenForVersion(ver));
+	qrcode[0] = static_cast<uint8_t>(size);
+	
+	// Timing patterns, then the finders with their separators and format bits
+	fillRectangle(6, 0, 1, size, qrcode);
+	fillRectangle(0, 6, size, 1, qrcode);
+	fillRectangle(0, 0, 9, 9, qrcode);
+	fillRectangle(size - 8, 0, 8, 9, qrcode);
+	fillRectangle(0, size - 8, 9, 8, qrcode);
+	
+	// Alignment patterns, except on the three finder corners
+	uint8_t alignPatPos[7];
+	int numAlign = getAlignmentPatternPositions(ver, alignPatPos);
+	for (int i = 0; i < numAlign; i++) {
+		for (int j = 0; j < numAlign; j++) {
+			if (!((i == 0 && j == 0) || (i == 0 && j == numAlign - 1) || (i == numAlign - 1 && j == 0)))
+				fillRectangle(alignPatPos[i] - 2, alignPatPos[j] - 2, 5, 5, qrcode);
+		}
+	}
+	
+	// Version blocks
+	if (ver >= 7) {
+		fillRectangle(size - 11, 0, 3, 6, qrcode);
+		fillRectangle(0, size - 11, 6, 3, qrcode);
+	}
+}
+
+
+void FixedQrEncoder::drawLightFunctionModules(uint8_t qrcode[], int ver) {
+	int size = getSize(qrcode);
+	for (int i = 7; i < size - 7; i += 2) {
+		setModule(qrcode, 6, i, false);
+		setModule(qrcode, i, 6, false);
+	}
+	
+	for (int dy = -4; dy <= 4; dy++) {
+		for (int dx = -4; dx <= 4; dx++) {
+			int dist = std::max(std::abs(dx), std::abs(dy));  // Chebyshev/infinity norm
+			if (dist == 2 || dist == 4) {
+				setModuleUnbounded(qrcode, 3 + dx, 3 + dy, false);
+				setModuleUnbounded(qrcode, size - 4 + dx, 3 + dy, false);
+				setModuleUnbounded(qrcode, 3 + dx, size - 4 + dy, false);
+			}
+		}
+	}
+	
+	uint8_t alignPatPos[7];
+	int numAlign = getAlignmentPatternPositions(ver, alignPatPos);
+	for (int i = 0; i < numAlign; i++) {
+		for (int j = 0; j < numAlign; j++) {
+			if ((i == 0 && j == 0) || (i == 0 && j == numAlign - 1) || (i == numAlign - 1 && j == 0))
+				continue;
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++)
+					setModule(qrcode, alignPatPos[i] + dx, alignPatPos[j] + dy, dx == 0 && dy == 0);
+			}
+		}
+	}
+	
+	if (ver >= 7) {
+		int rem = ver;  // version is uint6, in the range [7, 40]
+		for (int i = 0; i < 12; i++)
+			rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+		long bits = static_cast<long>(ver) << 12 | rem;  // uint18
+		for (int i = 0; i < 6; i++) {
+			for (int j = 0; j < 3; j++, bits >>= 1) {
+				int k = size - 11 + j;
+				setModule(qrcode, k, i, (bits & 1) != 0);
+				setModule(qrcode, i, k, (bits & 1) != 0);
+			}
+		}
+	}
+}
+
+
+void FixedQrEncoder::drawFormatBits(QrCode::Ecc ecl, int msk, uint8_t qrcode[]) {
+	// Calculate error correction code and pack bits
+	int data = QrCode::getFormatBits(ecl) << 3 | msk;  // errCorrLvl is uint2, msk is uint3
+	int rem = data;
+	for (int i = 0; i < 10; i++)
+		rem = (rem << 1) ^ ((rem >> 9) * 0x537);
+	int bits = (data << 10 | rem) ^ 0x5412;  // uint15
+	
+	// Draw first copy
+	for (int i = 0; i <= 5; i++)
+		setModule(qrcode, 8, i, QrCode::getBit(bits, i));
+	setModule(qrcode, 8, 7, QrCode::getBit(bits, 6));
+	setModule(qrcode, 8, 8, QrCode::getBit(bits, 7));
+	setModule(qrcode, 7, 8, QrCode::getBit(bits, 8));
+	for (int i = 9; i < 15; i++)
+		setModule(qrcode, 14 - i, 8, QrCode::getBit(bits, i));
+	
+	// Draw second copy
+	int size = getSize(qrcode);
+	for (int i = 0; i < 8; i++)
+		setModule(qrcode, size - 1 - i, 8, QrCode::getBit(bits, i));
+	for (int i = 8; i < 15; i++)
+		setModule(qrcode, 8, size - 15 + i, QrCode::getBit(bits, i));
+	setModule(qrcode, 8, size - 8, true);  // Always dark
+}
+
+
+void FixedQrEncoder::drawCodewords(const uint8_t data[], int dataLen, uint8_t qrcode[]) {
+	int size = getSize(qrcode);
+	int i = 0;  // Bit index into the data
+	// Do the funny zigzag scan
+	for (int right = size - 1; right >= 1; right -= 2) {  // Index of right column in each column pair
+		if (right == 6)
+			right = 5;
+		for (int vert = 0; vert < size; vert++) {  // Vertical counter
+			for (int j = 0; j < 2; j++) {
+				int x = right - j;  // Actual x coordinate
+				bool upward = ((right + 1) & 2) == 0;
+				int y = upward ? size - 1 - vert : vert;  // Actual y coordinate
+				if (!getModule(qrcode, x, y) && i < dataLen * 8) {  // Function modules are still dark
+					setModule(qrcode, x, y, QrCode::getBit(data[i >> 3], 7 - (i & 7)));
+					i++;
+				}
+				// Remainder bits (0 to 7) stay light
+			}
+		}
+	}
+	assert(i == dataLen * 8);
+}
+
+
+void FixedQrEncoder::applyMask(const uint8_t functionModules[], uint8_t qrcode[], int msk) {
+	int size = getSize(qrcode);
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			if (getModule(functionModules, x, y))
+				continue;
+			bool invert;
+			switch (msk) {
+				case 0:  invert = (x + y) % 2 == 0;                    break;
+				case 1:  invert = y % 2 == 0;                          break;
+				case 2:  invert = x % 3 == 0;                          break;
+				case 3:  invert = (x + y) % 3 == 0;                    break;
+				case 4:  invert = (x / 3 + y / 2) % 2 == 0;            break;
+				case 5:  invert = x * y % 2 + x * y % 3 == 0;          break;
+				case 6:  invert = (x * y % 2 + x * y % 3) % 2 == 0;    break;
+				default: invert = ((x + y) % 2 + x * y % 3) % 2 == 0;  break;
+			}
+			setModule(qrcode, x, y, getModule(qrcode, x, y) ^ invert);
+		}
+	}
+}
+
+
+long FixedQrEncoder::getPenaltyScore(const uint8_t qrcode[]) {
+	int size = getSize(qrcode);
+	long result = 0;
+	
+	// Adjacent modules in row having same color, and finder-like patterns
+	for (int y = 0; y < size; y++) {
+		bool runColor = false;
+		int runX = 0;
+		int runHistory[7] = {};
+		for (int x = 0; x < size; x++) {
+			if (getModule(qrcode, x, y) == runColor) {
+				runX++;
+				if (runX == 5)
+					result += QrCode::PENALTY_N1;
+				else if (runX > 5)
+					result++;
+			} else {
+				finderPenaltyAddHistory(runX, runHistory, size);
+				if (!runColor)
+					result += finderPenaltyCountPatterns(runHistory, size) * QrCode::PENALTY_N3;
+				runColor = getModule(qrcode, x, y);
+				runX = 1;
+			}
+		}
+		result += finderPenaltyTerminateAndCount(runColor, runX, runHistory, size) * QrCode::PENALTY_N3;
+	}
+	// Adjacent modules in column having same color, and finder-like patterns
+	for (int x = 0; x < size; x++) {
+		bool runColor = false;
+		int runY = 0;
+		int runHistory[7] = {};
+		for (int y = 0; y < size; y++) {
+			if (getModule(qrcode, x, y) == runColor) {
+				runY++;
+				if (runY == 5)
+					result += QrCode::PENALTY_N1;
+				else if (runY > 5)
+					result++;
+			} else {
+				finderPenaltyAddHistory(runY, runHistory, size);
+				if (!runColor)
+					result += finderPenaltyCountPatterns(runHistory, size) * QrCode::PENALTY_N3;
+				runColor = getModule(qrcode, x, y);
+				runY = 1;
+			}
+		}
+		result += finderPenaltyTerminateAndCount(runColor, runY, runHistory, size) * QrCode::PENALTY_N3;
+	}
+	
+	// 2*2 blocks of modules having same color
+	for (int y = 0; y < size - 1; y++) {
+		for (int x = 0; x < size - 1; x++) {
+			bool  color = getModule(qrcode, x, y);
+			if (  color == getModule(qrcode, x + 1, y) &&
+			      color == getModule(qrcode, x, y + 1) &&
+			      color == getModule(qrcode, x + 1, y + 1))
+				result += QrCode::PENALTY_N2;
+		}
+	}
+	
+	// Balance of dark and light modules, counted a byte at a time
+	int dark = 0;
+	int total = size * size;  // Note that size is odd, so dark/total != 1/2
+	for (int i = 0; i < (total + 7) / 8; i++)
+		dark += __builtin_popcount(qrcode[i + 1]);  // Bits past the last module are never set
+	// Compute the smallest integer k >= 0 such that (45-5k)% <= dark/total <= (55+5k)%
+	int k = static_cast<int>((std::abs(dark * 20L - total * 10L) + total - 1) / total) - 1;
+	assert(0 <= k && k <= 9);
+	result += k * QrCode::PENALTY_N4;
+	return result;
+}
+
+
+int FixedQrEncoder::getAlignmentPatternPositions(int ver, uint8_t result[7]) {
+	if (ver == 1)
+		return 0;
+	int numAlign = ver / 7 + 2;
+	int step = (ver * 8 + numAlign * 3 + 5) / (numAlign * 4 - 4) * 2;
+	for (int i = numAlign - 1, pos = ver * 4 + 10; i >= 1; i--, pos -= step)
+		result[i] = static_cast<uint8_t>(pos);
+	result[0] = 6;
+	return numAlign;
+}
+
+
+void FixedQrEncoder::fillRectangle(int left, int top, int width, int height, uint8_t qrcode[]) {
+	for (int dy = 0; dy < height; dy++) {
+		for (int dx = 0; dx < width; dx++)
+			setModule(qrcode, left + dx, top + dy, true);
+	}
+}
+
+
+void FixedQrEncoder::setModule(uint8_t qrcode[], int x, int y, bool isDark) {
+	int index = y * qrcode[0] + x;
+	uint8_t bit = static_cast<uint8_t>(1 << (index & 7));
+	if (isDark)
+		qrcode[(index >> 3) + 1] |= bit;
+	else
+		qrcode[(index >> 3) + 1] &= static_cast<uint8_t>(~bit);
+}
+
+
+void FixedQrEncoder::setModuleUnbounded(uint8_t qrcode[], int x, int y, bool isDark) {
+	int size = qrcode[0];
+	if (0 <= x && x < size && 0 <= y && y < size)
+		setModule(qrcode, x, y, isDark);
+}
+
+
+void FixedQrEncoder::reedSolomonComputeDivisor(int degree, uint8_t result[]) {
+	assert(1 <= degree && degree <= REED_SOLOMON_DEGREE_MAX);
+	// Same product polynomial as QrCode::reedSolomonComputeDivisor(), see there
+	std::memset(result, 0, static_cast<size_t>(degree));
+	result[degree - 1] = 1;  // Start off with the monomial x^0
+	for (int i = 0; i < degree; i++) {
+		uint8_t root = GF_EXP[i];  // r^i, r = 0x02
+		for (int j = 0; j < degree; j++) {
+			result[j] = reedSolomonMultiply(result[j], root);
+			if (j + 1 < degree)
+				result[j] ^= result[j + 1];
+		}
+	}
+}
+
+
+void FixedQrEncoder::reedSolomonComputeRemainder(const uint8_t data[], int dataLen,
+		const uint8_t generator[], int degree, uint8_t result[]) {
+	std::memset(result, 0, static_cast<size_t>(degree));
+	for (int i = 0; i < dataLen; i++) {  // Polynomial division
+		uint8_t factor = data[i] ^ result[0];
+		std::memmove(&result[0], &result[1], static_cast<size_t>(degree - 1));
+		result[degree - 1] = 0;
+		if (factor == 0)
+			continue;
+		int logFactor = GF_LOG[factor];
+		for (int j = 0; j < degree; j++) {
+			if (generator[j] != 0)
+				result[j] ^= GF_EXP[(GF_LOG[generator[j]] + logFactor) % 255];
+		}
+	}
+}
+
+
+uint8_t FixedQrEncoder::reedSolomonMultiply(uint8_t x, uint8_t y) {
+	if (x == 0 || y == 0)
+		return 0;
+	return GF_EXP[(GF_LOG[x] + GF_LOG[y]) % 255];
+}
+
+
+int FixedQrEncoder::finderPenaltyCountPatterns(const int runHistory[7], int size) {
+	int n = runHistory[1];
+	assert(n <= size * 3);
+	(void)size;
+	bool core = n > 0 && runHistory[2] == n && runHistory[3] == n * 3 && runHistory[4] == n && runHistory[5] == n;
+	return (core && runHistory[0] >= n * 4 && runHistory[6] >= n ? 1 : 0)
+	     + (core && runHistory[6] >= n * 4 && runHistory[0] >= n ? 1 : 0);
+}
+
+
+int FixedQrEncoder::finderPenaltyTerminateAndCount(bool currentRunColor, int currentRunLength, int runHistory[7], int size) {
+	if (currentRunColor) {  // Terminate dark run
+		finderPenaltyAddHistory(currentRunLength, runHistory, size);
+		currentRunLength = 0;
+	}
+	currentRunLength += size;  // Add light border to final run
+	finderPenaltyAddHistory(currentRunLength, runHistory, size);
+	return finderPenaltyCountPatterns(runHistory, size);
+}
+
+
+void FixedQrEncoder::finderPenaltyAddHistory(int currentRunLength, int runHistory[7], int size) {
+	if (runHistory[0] == 0)
+		currentRunLength += size;  // Add light border to initial run
+	std::memmove(&runHistory[1], &runHistory[0], 6 * sizeof(runHistory[0]));
+	runHistory[0] = currentRunLength;
+}
+
 }
@@ -213,6 +213,9 @@ class QrSegment final {
 	 * each character value maps to the index in the string. */
 	private: static const char *ALPHANUMERIC_CHARSET;
 	
+	// Encodes text segments without building QrSegment objects.
+	friend class FixedQrEncoder;
+	
 };
 
 
@@ -501,6 +504,9 @@ class QrCode final {
 	private: static const std::int8_t ECC_CODEWORDS_PER_BLOCK[4][41];
 	private: static const std::int8_t NUM_ERROR_CORRECTION_BLOCKS[4][41];
 	
+	// Shares the tables and the capacity formulas above.
+	friend class FixedQrEncoder;
+	
 };
 
 
@@ -546,4 +552,167 @@ class BitBuffer final : public std::vector<bool> {
 	
 };
 
+
+
+/* 
+ * A QR Code encoder that never touches the heap, for small targets where a
+ * failed allocation mid-encode is worse than a fixed cost. It produces the same
+ * symbols as QrCode::encodeText() for a single segment (numeric, alphanumeric
+ * or byte mode, whichever is most compact), written into caller-provided buffers.
+ * 
+ * A symbol is stored as packed bits: byte 0 holds the side length, then module
+ * (x, y) is bit ((y * size + x) % 8) of byte ((y * size + x) / 8 + 1), least
+ * significant bit first. Both buffers must be bufferLenForVersion(maxVersion) bytes.
+ * FixedQrCode below sizes them at compile time.
+ */
+class FixedQrEncoder final {
+	
+	/*---- Public functions ----*/
+	
+	// Returns the number of bytes needed to hold a symbol of the given version
+	// (also the size of the scratch buffer the encoder needs).
+	public: static constexpr std::size_t bufferLenForVersion(int ver) {
+		return static_cast<std::size_t>(((ver * 4 + 17) * (ver * 4 + 17) + 7) / 8 + 1);
+	}
+	
+	
+	/* 
+	 * Encodes the given text at the lowest version up to maxVersion that fits, boosting
+	 * the error correction level while it still fits, with the best mask. Returns false
+	 * (leaving a size of 0 in qrcode[0]) if the text doesn't fit or maxVersion is invalid.
+	 * The tempBuffer contents are garbage afterwards.
+	 */
+	public: static bool encodeText(const char *text, QrCode::Ecc ecl, int maxVersion,
+		std::uint8_t qrcode[], std::uint8_t tempBuffer[]);
+	
+	
+	// Returns the side length of the encoded symbol, or 0 if encoding failed.
+	public: static int getSize(const std::uint8_t qrcode[]);
+	
+	
+	// Returns the color of the module at the given coordinates, false (light)
+	// if they are out of bounds.
+	public: static bool getModule(const std::uint8_t qrcode[], int x, int y);
+	
+	
+	/*---- Private helper functions ----*/
+	
+	// Number of bits the text takes as a segment in the given mode and version,
+	// or -1 if its length doesn't fit the character count field.
+	private: static int getSegmentBits(int mode, std::size_t len, int ver);
+	
+	
+	// Appends the given number of low-order bits of val to the big endian bit string in buffer[].
+	private: static void appendBits(std::uint32_t val, int len, std::uint8_t buffer[], int &bitLen);
+	
+	
+	// Splits the data codewords in data[] into blocks, appends Reed-Solomon ECC to each
+	// and interleaves them into result[]. The tail of data[] is used as scratch space.
+	private: static void addEccAndInterleave(std::uint8_t data[], int ver, QrCode::Ecc ecl, std::uint8_t result[]);
+	
+	
+	// Marks every function module dark in a cleared symbol of the given version.
+	private: static void initializeFunctionModules(int ver, std::uint8_t qrcode[]);
+	
+	
+	// Draws the light parts of the function patterns, and the version bits, over
+	// the dark areas set by initializeFunctionModules().
+	private: static void drawLightFunctionModules(std::uint8_t qrcode[], int ver);
+	
+	
+	private: static void drawFormatBits(QrCode::Ecc ecl, int msk, std::uint8_t qrcode[]);
+	
+	
+	// Writes the codewords into the light (non-function) modules in the zigzag order.
+	private: static void drawCodewords(const std::uint8_t data[], int dataLen, std::uint8_t qrcode[]);
+	
+	
+	// XORs the modules that aren't dark in functionModules[] with the mask pattern.
+	private: static void applyMask(const std::uint8_t functionModules[], std::uint8_t qrcode[], int msk);
+	
+	
+	private: static long getPenaltyScore(const std::uint8_t qrcode[]);
+	
+	
+	// Fills result[] with the ascending alignment pattern positions, returns how many.
+	private: static int getAlignmentPatternPositions(int ver, std::uint8_t result[7]);
+	
+	
+	private: static void fillRectangle(int left, int top, int width, int height, std::uint8_t qrcode[]);
+	
+	
+	private: static void setModule(std::uint8_t qrcode[], int x, int y, bool isDark);
+	
+	
+	// Like setModule(), but does nothing for coordinates out of bounds.
+	private: static void setModuleUnbounded(std::uint8_t qrcode[], int x, int y, bool isDark);
+	
+	
+	// Computes the Reed-Solomon generator polynomial of the given degree into result[]
+	// and the remainder of data[] divided by it, using the GF(2^8/0x11D) log tables.
+	private: static void reedSolomonComputeDivisor(int degree, std::uint8_t result[]);
+	
+	private: static void reedSolomonComputeRemainder(const std::uint8_t data[], int dataLen,
+		const std::uint8_t generator[], int degree, std::uint8_t result[]);
+	
+	private: static std::uint8_t reedSolomonMultiply(std::uint8_t x, std::uint8_t y);
+	
+	
+	// Helpers for getPenaltyScore(), the same as the QrCode ones.
+	private: static int finderPenaltyCountPatterns(const int runHistory[7], int size);
+	
+	private: static int finderPenaltyTerminateAndCount(bool currentRunColor, int currentRunLength, int runHistory[7], int size);
+	
+	private: static void finderPenaltyAddHistory(int currentRunLength, int runHistory[7], int size);
+	
+	
+	/*---- Constants ----*/
+	
+	// The longest Reed-Solomon generator polynomial in any version.
+	private: static constexpr int REED_SOLOMON_DEGREE_MAX = 30;
+	
+};
+
+
+
+/* 
+ * A symbol of at most the given version with its storage inline, so it can live
+ * on the stack or in a static. The scratch buffer is passed in by the caller,
+ * who can share one between codes or drop it once encoding is done.
+ */
+template<int MAX_VER>
+class FixedQrCode final {
+	
+	static_assert(QrCode::MIN_VERSION <= MAX_VER && MAX_VER <= QrCode::MAX_VERSION, "Version out of range");
+	
+	/*---- Constants ----*/
+	
+	public: static constexpr std::size_t BUFFER_LEN = FixedQrEncoder::bufferLenForVersion(MAX_VER);
+	
+	
+	/*---- Fields ----*/
+	
+	private: std::uint8_t modules[BUFFER_LEN] = {};
+	
+	
+	/*---- Methods ----*/
+	
+	// See FixedQrEncoder::encodeText(). Replaces any symbol encoded before.
+	public: bool encodeText(const char *text, QrCode::Ecc ecl, std::uint8_t (&tempBuffer)[BUFFER_LEN]) {
+		return FixedQrEncoder::encodeText(text, ecl, MAX_VER, modules, tempBuffer);
+	}
+	
+	
+	// Side length in modules, 0 if nothing has been encoded.
+	public: int getSize() const {
+		return FixedQrEncoder::getSize(modules);
+	}
+	
+	
+	public: bool getModule(int x, int y) const {
+		return FixedQrEncoder::getModule(modules, x, y);
+	}
+	
+};
+
 }
@@ -0,0 +1,91 @@
+# Pre-build step: compress the web UI in 1-Slideshow/html into PROGMEM arrays
+# in 1-Slideshow/web_assets.h, which the firmware sends as gzip content as-is.
+#
+# index.html is served at "/", other pages at their name without ".html"
+# (upload_file.html -> /upload_file) and everything else under its file name.
+# Runs from PlatformIO (extra_scripts = pre:script/gzip_web.py) or by hand.
+
+import gzip
+import hashlib
+import os
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    PROJECT_DIR = env.subst("$PROJECT_DIR")  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+SOURCE_DIR = os.path.join(PROJECT_DIR, "1-Slideshow", "html")
+OUTPUT = os.path.join(PROJECT_DIR, "1-Slideshow", "web_assets.h")
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".ico": "image/x-icon",
+}
+
+
+def url_for(name):
+    base, ext = os.path.splitext(name)
+    if name == "index.html":
+        return "/"
+    if ext == ".html":
+        return "/" + base
+    return "/" + name
+
+
+def symbol_for(name):
+    return "web_" + "".join(c if c.isalnum() else "_" for c in name)
+
+
+def generate():
+    names = sorted(n for n in os.listdir(SOURCE_DIR)
+                   if os.path.splitext(n)[1] in CONTENT_TYPES)
+    sources = [os.path.join(SOURCE_DIR, n) for n in names] + [os.path.abspath(__file__)]
+    if os.path.exists(OUTPUT) and \
+            os.path.getmtime(OUTPUT) >= max(os.path.getmtime(p) for p in sources):
+        return
+
+    lines = [
+        "// Generated by script/gzip_web.py from 1-Slideshow/html, do not edit",
+        "#pragma once",
+        "",
+        "struct WebAsset {",
+        "  const char *path;         // URL the asset is served at",
+        "  const char *contentType;",
+        "  const char *etag;         // Hash of the uncompressed file",
+        "  const uint8_t *data;      // Gzipped contents in flash",
+        "  size_t length;",
+        "};",
+        "",
+    ]
+    table = []
+    for name in names:
+        with open(os.path.join(SOURCE_DIR, name), "rb") as f:
+            raw = f.read()
+        packed = gzip.compress(raw, 9, mtime=0)  # mtime=0 keeps builds reproducible
+        symbol = symbol_for(name)
+        etag = '\\"%s\\"' % hashlib.sha1(raw).hexdigest()[:16]
+        lines.append("// %s: %d bytes, %d gzipped" % (name, len(raw), len(packed)))
+        lines.append("const uint8_t %s[] PROGMEM = {" % symbol)
+        for i in range(0, len(packed), 16):
+            lines.append("  " + ", ".join("0x%02x" % b for b in packed[i:i + 16]) + ",")
+        lines.append("};")
+        lines.append("")
+        table.append('  {"%s", "%s", "%s", %s, sizeof(%s)},' % (
+            url_for(name), CONTENT_TYPES[os.path.splitext(name)[1]], etag, symbol, symbol))
+
+    lines.append("const WebAsset webAssets[] = {")
+    lines.extend(table)
+    lines.append("};")
+    lines.append("")
+
+    with open(OUTPUT, "w", newline="\n") as f:
+        f.write("\n".join(lines))
+    print("gzip_web: packed %d web assets into %s" % (len(names), os.path.relpath(OUTPUT, PROJECT_DIR)))
+
+
+generate()